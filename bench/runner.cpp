@@ -0,0 +1,111 @@
+// The Boba benchmark runner. Every benchmark is a Boba script that gets lexed,
+// parsed and evaluated from scratch in a fresh Runtime a number of times. We
+// report the best and the median wall-clock time over all iterations, since
+// the mean is too easily thrown off by a single slow run.
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "lexer.h"
+#include "parser.h"
+#include "runtime.h"
+
+struct Benchmark
+{
+    std::string name;
+    std::string path;
+    int iterations;
+};
+
+std::string read_file(const std::string& path)
+{
+    std::ifstream file(path);
+
+    if (!file.is_open())
+    {
+        std::cerr << "Error: could not open " << path << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    return std::string((std::istreambuf_iterator<char>(file)),
+                       (std::istreambuf_iterator<char>()   ));
+}
+
+// A runtime configuration that every benchmark is run under.
+struct Config
+{
+    std::string name;
+    RuntimeOptions options;
+};
+
+// Runs a script once and returns the time it took in milliseconds.
+double run_script(std::string& content, const RuntimeOptions& options)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    Runtime runtime(options);
+    TextHandle handle(content);
+    auto tokens = tokenize(handle);
+
+    while (!tokens.done())
+    {
+        auto ast = parse_expr(tokens);
+        runtime.eval_ast(ast);
+    }
+
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+int main()
+{
+    const Benchmark benchmarks[] = {
+        { "fib",     "examples/fib.boba",     20  },
+        { "closure", "examples/closure.boba", 1000 },
+    };
+
+    std::vector<Config> configs(6);
+    configs[0].name = "threaded";
+    configs[0].options.dispatch = Dispatch::Threaded;
+    configs[1].name = "table";
+    configs[1].options.dispatch = Dispatch::Table;
+    configs[2].name = "no-super";
+    configs[2].options.superinstructions = false;
+    configs[3].name = "register";
+    configs[3].options.backend = Backend::Register;
+    configs[4].name = "region";
+    configs[4].options.region_heap = true;
+    configs[5].name = "-O1";
+    configs[5].options.optimize = 1;
+
+    printf("%-12s %-12s %10s %12s %12s\n", "benchmark", "config",
+           "iterations", "best (ms)", "median (ms)");
+    printf("================================================================\n");
+
+    for (const auto& benchmark : benchmarks)
+    {
+        std::string content = read_file(benchmark.path);
+
+        for (const auto& config : configs)
+        {
+            std::vector<double> times;
+
+            for (int i = 0; i < benchmark.iterations; i++)
+            {
+                times.push_back(run_script(content, config.options));
+            }
+
+            std::sort(times.begin(), times.end());
+            printf("%-12s %-12s %10d %12.3f %12.3f\n",
+                   benchmark.name.c_str(), config.name.c_str(),
+                   benchmark.iterations, times.front(),
+                   times[times.size() / 2]);
+        }
+    }
+}
@@ -0,0 +1,359 @@
+#include "array.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "kernels.h"
+#include "processor.h"
+#include "register_processor.h"
+#include "str.h"
+
+[[noreturn]] static void array_error(const std::string& message)
+{
+    printf("ERROR: %s\n", message.c_str());
+    exit(-1);
+}
+
+static Array* expect_array(Value value, const char* builtin)
+{
+    if (value.type() != ValueType::Array)
+    {
+        array_error(std::string(builtin) + " expects an array, but got "
+                    + value.to_string());
+    }
+
+    return value.as<Array*>();
+}
+
+static void expect_number(Value value, const char* builtin)
+{
+    if (!value.is_number())
+    {
+        array_error(std::string(builtin) + " expects a number, but got "
+                    + value.to_string());
+    }
+}
+
+// Errors out unless a and b have the same length.
+static void expect_same_length(Array* a, Array* b, const char* builtin)
+{
+    if (a->length != b->length)
+    {
+        array_error(std::string(builtin) + " expects arrays of the same "
+                    "length, but got " + std::to_string(a->length) + " and "
+                    + std::to_string(b->length) + " elements");
+    }
+}
+
+// Element i of an array as a double, whatever the array's element type.
+static inline double element(Array* a, size_t i)
+{
+    return a->element_type == ElementType::Int
+        ? static_cast<double>(a->ints()[i])
+        : a->floats()[i];
+}
+
+Value array_length(Value a)
+{
+    if (a.type() == ValueType::Str)
+    {
+        return string_length(a);
+    }
+
+    return Value(static_cast<int>(expect_array(a, "length")->length));
+}
+
+Value array_at(Value a, Value i)
+{
+    Array* array = expect_array(a, "at");
+
+    if (!i.is_int() || i.as_int() < 0
+        || static_cast<size_t>(i.as_int()) >= array->length)
+    {
+        array_error("index " + i.to_string() + " is out of bounds for an "
+                    "array of " + std::to_string(array->length)
+                    + " elements");
+    }
+
+    return array->at(i.as_int());
+}
+
+Value array_sum(Value a)
+{
+    Array* array = expect_array(a, "sum");
+
+    if (array->element_type == ElementType::Int)
+    {
+        int64_t sum = sum_ints(array->ints(), array->length);
+        return Value(static_cast<int>(static_cast<uint32_t>(sum)));
+    }
+
+    return Value(sum_floats(array->floats(), array->length));
+}
+
+Value array_dot(Value a, Value b)
+{
+    Array* x = expect_array(a, "dot");
+    Array* y = expect_array(b, "dot");
+
+    expect_same_length(x, y, "dot");
+
+    if (x->element_type != y->element_type)
+    {
+        double sum = 0;
+
+        for (size_t i = 0; i < x->length; i++)
+        {
+            sum += element(x, i) * element(y, i);
+        }
+
+        return Value(sum);
+    }
+
+    if (x->element_type == ElementType::Int)
+    {
+        int64_t sum = dot_ints(x->ints(), y->ints(), x->length);
+        return Value(static_cast<int>(static_cast<uint32_t>(sum)));
+    }
+
+    return Value(dot_floats(x->floats(), y->floats(), x->length));
+}
+
+Value array_argmax(Value a)
+{
+    Array* array = expect_array(a, "argmax");
+
+    if (array->length == 0)
+    {
+        array_error("argmax of an empty array");
+    }
+
+    size_t index = array->element_type == ElementType::Int
+        ? argmax_ints(array->ints(), array->length)
+        : argmax_floats(array->floats(), array->length);
+
+    return Value(static_cast<int>(index));
+}
+
+static size_t range_length(Value n)
+{
+    if (!n.is_int() || n.as_int() < 0)
+    {
+        array_error("range expects a count of at least 0, but got "
+                    + n.to_string());
+    }
+
+    return n.as_int();
+}
+
+static void fill_range(Array* dst)
+{
+    for (size_t i = 0; i < dst->length; i++)
+    {
+        dst->ints()[i] = i;
+    }
+}
+
+static void fill_values(Array* dst, const Value* values, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        if (dst->element_type == ElementType::Float)
+        {
+            expect_number(values[i], "float-array");
+            dst->floats()[i] = values[i].as_number();
+        }
+        else if (values[i].is_int())
+        {
+            dst->ints()[i] = values[i].as_int();
+        }
+        else
+        {
+            array_error("int-array expects integers, but got "
+                        + values[i].to_string());
+        }
+    }
+}
+
+static ElementType map_add_type(Array* a, Value b)
+{
+    bool is_int;
+
+    if (b.type() == ValueType::Array)
+    {
+        expect_same_length(a, b.as<Array*>(), "map+");
+        is_int = b.as<Array*>()->element_type == ElementType::Int;
+    }
+    else
+    {
+        expect_number(b, "map+");
+        is_int = b.is_int();
+    }
+
+    return is_int && a->element_type == ElementType::Int
+        ? ElementType::Int
+        : ElementType::Float;
+}
+
+// Arrays of the same type and numbers that match the array's element type go
+// to the kernels. Anything mixed has its integers converted one at a time.
+static void map_add(Array* dst, Array* a, Value b)
+{
+    size_t n = a->length;
+
+    if (b.type() != ValueType::Array)
+    {
+        if (dst->element_type == ElementType::Int)
+        {
+            add_scalar_ints(dst->ints(), a->ints(), b.as_int(), n);
+        }
+        else if (a->element_type == ElementType::Float)
+        {
+            add_scalar_floats(dst->floats(), a->floats(), b.as_number(), n);
+        }
+        else
+        {
+            for (size_t i = 0; i < n; i++)
+            {
+                dst->floats()[i] = element(a, i) + b.as_number();
+            }
+        }
+
+        return;
+    }
+
+    Array* other = b.as<Array*>();
+
+    if (a->element_type != other->element_type)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            dst->floats()[i] = element(a, i) + element(other, i);
+        }
+    }
+    else if (dst->element_type == ElementType::Int)
+    {
+        add_ints(dst->ints(), a->ints(), other->ints(), n);
+    }
+    else
+    {
+        add_floats(dst->floats(), a->floats(), other->floats(), n);
+    }
+}
+
+static ElementType scale_type(Array* a, Value k)
+{
+    expect_number(k, "scale");
+
+    return k.is_int() && a->element_type == ElementType::Int
+        ? ElementType::Int
+        : ElementType::Float;
+}
+
+static void scale(Array* dst, Array* a, Value k)
+{
+    size_t n = a->length;
+
+    if (dst->element_type == ElementType::Int)
+    {
+        scale_ints(dst->ints(), a->ints(), k.as_int(), n);
+    }
+    else if (a->element_type == ElementType::Float)
+    {
+        scale_floats(dst->floats(), a->floats(), k.as_number(), n);
+    }
+    else
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            dst->floats()[i] = element(a, i) * k.as_number();
+        }
+    }
+}
+
+static void filter_less(Array* dst, Array* a, Value limit)
+{
+    expect_number(limit, "filter<");
+
+    size_t n = a->length;
+
+    if (a->element_type == ElementType::Float)
+    {
+        dst->length = filter_less_floats(dst->floats(), a->floats(),
+                                         limit.as_number(), n);
+    }
+    else if (limit.is_int())
+    {
+        dst->length = filter_less_ints(dst->ints(), a->ints(),
+                                       limit.as_int(), n);
+    }
+    else
+    {
+        size_t count = 0;
+
+        for (size_t i = 0; i < n; i++)
+        {
+            dst->ints()[count] = a->ints()[i];
+            count += element(a, i) < limit.as_number();
+        }
+
+        dst->length = count;
+    }
+}
+
+template <ElementType type, typename Proc>
+Value array_of_values(Proc& proc, const Value* values, int n)
+{
+    Array* dst = allocate_array(proc, type, n);
+    fill_values(dst, values, n);
+    return Value(dst);
+}
+
+template <typename Proc>
+Value array_range(Proc& proc, Value n)
+{
+    Array* dst = allocate_array(proc, ElementType::Int, range_length(n));
+    fill_range(dst);
+    return Value(dst);
+}
+
+template <typename Proc>
+Value array_map_add(Proc& proc, Value a, Value b)
+{
+    Array* array = expect_array(a, "map+");
+    Array* dst = allocate_array(proc, map_add_type(array, b), array->length);
+    map_add(dst, array, b);
+    return Value(dst);
+}
+
+template <typename Proc>
+Value array_scale(Proc& proc, Value a, Value k)
+{
+    Array* array = expect_array(a, "scale");
+    Array* dst = allocate_array(proc, scale_type(array, k), array->length);
+    scale(dst, array, k);
+    return Value(dst);
+}
+
+template <typename Proc>
+Value array_filter_less(Proc& proc, Value a, Value limit)
+{
+    Array* array = expect_array(a, "filter<");
+    Array* dst = allocate_array(proc, array->element_type, array->length);
+    filter_less(dst, array, limit);
+    return Value(dst);
+}
+
+#define INSTANTIATE_ARRAY_BUILTINS(Proc)                                \
+    template Value array_of_values<ElementType::Int>(Proc&, const Value*, \
+                                                     int);              \
+    template Value array_of_values<ElementType::Float>(Proc&,           \
+                                                       const Value*, int); \
+    template Value array_range(Proc&, Value);                           \
+    template Value array_map_add(Proc&, Value, Value);                  \
+    template Value array_scale(Proc&, Value, Value);                    \
+    template Value array_filter_less(Proc&, Value, Value);
+
+INSTANTIATE_ARRAY_BUILTINS(Processor)
+INSTANTIATE_ARRAY_BUILTINS(RegisterProcessor)
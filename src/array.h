@@ -0,0 +1,45 @@
+#pragma once
+
+#include "environment.h"
+
+// The array builtins, on values. Both backends run each of them from a single
+// instruction, and they do their work with the kernels in kernels.h, so no
+// element ever goes through the interpreter. Each one errors out if it gets
+// something that isn't what it expects. They are defined in array.cpp, which
+// keeps them out of the dispatch loops.
+//
+// An operation gives an integer array if everything it works on is an
+// integer, and a float array otherwise, just like arithmetic on numbers.
+
+// (length a) also gives the length of a string, in bytes.
+Value array_length(Value a);
+Value array_at(Value a, Value i);
+Value array_sum(Value a);
+Value array_dot(Value a, Value b);
+Value array_argmax(Value a);
+
+// The builtins that make a new array allocate it in the processor they get,
+// through its allocate_array(). They never collect, so a processor that has a
+// garbage collector has to run it before calling them, while their arguments
+// are still reachable. They are instantiated for both processors.
+
+// (int-array ...) and (float-array ...)
+template <ElementType type, typename Proc>
+Value array_of_values(Proc& proc, const Value* values, int n);
+
+// (range n) is the integers from 0 up to n - 1.
+template <typename Proc>
+Value array_range(Proc& proc, Value n);
+
+// (map+ a b) adds up a and b element by element if b is an array, and adds b
+// to every element of a if it is a number.
+template <typename Proc>
+Value array_map_add(Proc& proc, Value a, Value b);
+
+// (scale a k) multiplies every element of a by k.
+template <typename Proc>
+Value array_scale(Proc& proc, Value a, Value k);
+
+// (filter< a limit) is the elements of a that are less than limit, in order.
+template <typename Proc>
+Value array_filter_less(Proc& proc, Value a, Value limit);
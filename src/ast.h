@@ -1,8 +1,14 @@
 
 #pragma once
 
-#include <vector>
+#include <charconv>
 #include <memory>
+#include <vector>
+#include <string>
+#include <string_view>
+
+#include "error.h"
+#include "symbols.h"
 #include "token.h"
 
 enum class ASTType
@@ -24,21 +30,79 @@ struct AST
 {
     ASTType type;
     std::vector<std::unique_ptr<AST>> children;
-    std::shared_ptr<Token> token;
+    Token token;
+
+    // Source text the token was lexed from. It has to outlive the AST.
+    std::string_view source;
 
-    AST(ASTType type) : type(type)
+    AST(ASTType type) : type(type), token()
     {
 
     }
 
-    AST(ASTType type, std::shared_ptr<Token> token) : type(type), token(token)
+    AST(ASTType type, const Token& token, std::string_view source)
+        : type(type), token(token), source(source)
     {
 
     }
-        
 
-    inline void add_leaf_child(ASTType type, std::shared_ptr<Token> token)
+    inline void add_leaf_child(ASTType type, const Token& token)
+    {
+        children.push_back(std::make_unique<AST>(type, token, source));
+    }
+
+    // Text of the token the node was made from.
+    inline std::string_view text() const
+    {
+        return token.text(source);
+    }
+
+    // Name of a symbol node.
+    inline const std::string& symbol_name() const
+    {
+        return symbols().name(token.id);
+    }
+
+    // Value of an integer literal node.
+    inline int int_value() const
+    {
+        std::string_view str = text();
+        int value = 0;
+
+        // from_chars doesn't accept a leading '+', and the lexer never
+        // produces one.
+        auto result = std::from_chars(str.data(), str.data() + str.size(),
+                                      value);
+
+        if (result.ec != std::errc())
+        {
+            err_token(source, token, "integer literal out of range");
+        }
+
+        return value;
+    }
+
+    // Value of a float literal node.
+    inline double float_value() const
+    {
+        std::string_view str = text();
+        double value = 0;
+
+        auto result = std::from_chars(str.data(), str.data() + str.size(),
+                                      value);
+
+        if (result.ec != std::errc())
+        {
+            err_token(source, token, "float literal out of range");
+        }
+
+        return value;
+    }
+
+    // Bytes of a string literal node, without its quotes.
+    inline std::string_view string_value() const
     {
-        children.push_back(std::make_unique<AST>(type, token));
+        std::string_view str = text();
+        return str.substr(1, str.size() - 2);
     }
 };
@@ -1,42 +1,329 @@
+#include <algorithm>
+#include <cstdlib>
+#include <iomanip>
 #include <iostream>
 #include <string>
-#include <fstream>
-#include <deque>
+#include <vector>
 
 #include "lexer.h"
 #include "parser.h"
+#include "bobac.h"
 #include "runtime.h"
+#include "source.h"
+
+void usage()
+{
+    std::cerr << "Usage: boba [options] file\n"
+              << "The file is either source code or a compiled .bobac file.\n"
+              << "Options:\n"
+              << "  --compile                  write file's bytecode to a .bobac file\n"
+              << "  -O0, -O1 (or -O)           optimization level of the stack backend\n"
+              << "  --inline-budget=N          inline function bodies of up to N nodes\n"
+              << "  --inline-report            report which functions were inlined\n"
+              << "  --backend=stack|register   virtual machine to run on\n"
+              << "  --dispatch=threaded|table  instruction dispatch mode\n"
+              << "  --code-stats               report code memory when done\n"
+              << "  --gc-stats                 report heap and GC pauses when done\n"
+              << "  --region-heap              allocate each form's objects in a region\n"
+              << "  --profile                  report how often each instruction ran\n"
+              << "                             and how long it took when done\n";
+    exit(EXIT_FAILURE);
+}
+
+// Number of instruction pairs that the profile lists.
+#define PROFILE_TOP_PAIRS 20
+
+// Lists every instruction that ran, most frequent first, with the clock ticks
+// that it took on average over the executions that were timed and its
+// estimated share of all of them. Then come the most frequent pairs.
+void print_profile(const Profile& profile)
+{
+    std::vector<int> insts;
+    uint64_t total = 0;
+    double total_ticks = 0;
+    double ticks[256] = {};
+
+    for (int i = 0; i < 256; i++)
+    {
+        if (profile.counts[i] == 0)
+        {
+            continue;
+        }
+
+        insts.push_back(i);
+        total += profile.counts[i];
+
+        if (profile.samples[i] > 0)
+        {
+            ticks[i] = static_cast<double>(profile.ticks[i])
+                       / profile.samples[i] * profile.counts[i];
+            total_ticks += ticks[i];
+        }
+    }
+
+    std::sort(insts.begin(), insts.end(), [&](int a, int b)
+    {
+        return profile.counts[a] > profile.counts[b];
+    });
+
+    auto percent = [](double part, double whole)
+    {
+        return whole > 0 ? 100 * part / whole : 0.0;
+    };
+
+    std::cerr << std::fixed << std::setprecision(1)
+              << std::left << std::setw(24) << "instruction" << std::right
+              << std::setw(14) << "count" << std::setw(8) << "%"
+              << std::setw(12) << "ticks/run" << std::setw(8) << "time %"
+              << "\n";
+
+    for (int i : insts)
+    {
+        std::cerr << std::left << std::setw(24) << instruction_name(i)
+                  << std::right << std::setw(14) << profile.counts[i]
+                  << std::setw(8) << percent(profile.counts[i], total);
+
+        if (profile.samples[i] > 0)
+        {
+            std::cerr << std::setw(12)
+                      << static_cast<double>(profile.ticks[i])
+                         / profile.samples[i]
+                      << std::setw(8) << percent(ticks[i], total_ticks);
+        }
+
+        std::cerr << "\n";
+    }
+
+    // Pairs that start with 0 are the first instruction of a form.
+    std::vector<std::pair<int, int>> pairs;
+    uint64_t total_pairs = 0;
+
+    for (int a = 1; a < 256; a++)
+    {
+        for (int b = 0; b < 256; b++)
+        {
+            if (profile.pairs[a][b] > 0)
+            {
+                pairs.emplace_back(a, b);
+                total_pairs += profile.pairs[a][b];
+            }
+        }
+    }
+
+    size_t n_top = std::min<size_t>(pairs.size(), PROFILE_TOP_PAIRS);
+    std::partial_sort(pairs.begin(), pairs.begin() + n_top, pairs.end(),
+                      [&](auto x, auto y)
+    {
+        return profile.pairs[x.first][x.second]
+            > profile.pairs[y.first][y.second];
+    });
+
+    std::cerr << "\n" << std::left << std::setw(38) << "instruction pair"
+              << std::right << std::setw(14) << "count" << std::setw(8) << "%"
+              << "\n";
+
+    for (size_t i = 0; i < n_top; i++)
+    {
+        auto [a, b] = pairs[i];
+        std::string name = std::string(instruction_name(a)) + " "
+                           + instruction_name(b);
+
+        std::cerr << std::left << std::setw(38) << name << std::right
+                  << std::setw(14) << profile.pairs[a][b] << std::setw(8)
+                  << percent(profile.pairs[a][b], total_pairs) << "\n";
+    }
+}
 
 int main(int argc, char *argv[])
 {
+    RuntimeOptions options;
+    const char* path = nullptr;
+    bool print_code_stats = false;
+    bool print_gc_stats = false;
+    bool print_inline_report = false;
+    bool compile = false;
 
-    if (argc < 2)
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+
+        if (arg == "--backend=stack")
+        {
+            options.backend = Backend::Stack;
+        }
+        else if (arg == "--backend=register")
+        {
+            options.backend = Backend::Register;
+        }
+        else if (arg == "--dispatch=threaded")
+        {
+            options.dispatch = Dispatch::Threaded;
+        }
+        else if (arg == "--dispatch=table")
+        {
+            options.dispatch = Dispatch::Table;
+        }
+        else if (arg == "--code-stats")
+        {
+            print_code_stats = true;
+        }
+        else if (arg == "--gc-stats")
+        {
+            print_gc_stats = true;
+        }
+        else if (arg == "--compile")
+        {
+            compile = true;
+        }
+        else if (arg == "--region-heap")
+        {
+            options.region_heap = true;
+        }
+        else if (arg == "-O" || arg == "-O1")
+        {
+            options.optimize = 1;
+        }
+        else if (arg == "-O0")
+        {
+            options.optimize = 0;
+        }
+        else if (arg.rfind("--inline-budget=", 0) == 0)
+        {
+            options.inline_budget = std::atoi(arg.c_str() + 16);
+        }
+        else if (arg == "--inline-report")
+        {
+            print_inline_report = true;
+        }
+        else if (arg == "--profile")
+        {
+            options.profile = true;
+        }
+        else if (arg.size() > 0 && arg[0] == '-')
+        {
+            std::cerr << "Error: unknown option '" << arg << "'" << std::endl;
+            usage();
+        }
+        else
+        {
+            path = argv[i];
+        }
+    }
+
+    if (path == nullptr)
     {
         std::cerr << "Error: no input file" << std::endl;
+        usage();
+    }
+
+    if (options.profile && options.backend != Backend::Stack)
+    {
+        std::cerr << "Error: --profile only works on the stack backend"
+                  << std::endl;
         exit(EXIT_FAILURE);
     }
     
-    std::ifstream file;
-    file.open(argv[1]);
+    SourceFile file;
 
-    if (!file.is_open())
+    if (!file.open(path))
     {
         perror("Error: open()");
         exit(EXIT_FAILURE);
     }
 
-    std::string content((std::istreambuf_iterator<char>(file)),
-                        (std::istreambuf_iterator<char>()   ));
+    Runtime runtime(options);
 
-    Runtime runtime;
-    TextHandle handle(content);
-    
-    auto tokens = tokenize(handle);
+    if (compile)
+    {
+        // foo.boba is compiled to foo.bobac.
+        std::string out_path = path;
+        size_t dot = out_path.find_last_of("./");
+
+        if (dot != std::string::npos && out_path[dot] == '.')
+        {
+            out_path.resize(dot);
+        }
+
+        out_path += ".bobac";
+
+        if (!write_bobac(runtime, file.text(), out_path.c_str()))
+        {
+            exit(EXIT_FAILURE);
+        }
+
+        return 0;
+    }
+
+    auto print_result = [](Value result)
+    {
+        std::cout << result.to_string() << '\n';
+    };
+
+    if (is_bobac(file.text()))
+    {
+        if (!run_bobac(runtime, file.text(), print_result))
+        {
+            exit(EXIT_FAILURE);
+        }
+    }
+    else
+    {
+        TextHandle handle(file.text());
+        TokenList tokens;
+
+        // Each top-level form is lexed, parsed and run before the lexer moves
+        // on to the next one.
+        while (tokenize_form(handle, tokens))
+        {
+            auto ast = parse_expr(tokens);
+            print_result(runtime.eval_ast(ast));
+        }
+    }
+
+    if (print_code_stats)
+    {
+        CodeStats stats = runtime.code_stats();
+
+        std::cerr << "top-level code: " << stats.toplevel_bytes << " bytes\n"
+                  << "live functions: " << stats.n_protos << ", "
+                  << stats.proto_bytes << " bytes of code\n"
+                  << "reclaimed functions: " << stats.n_reclaimed << ", "
+                  << stats.reclaimed_bytes << " bytes of code\n";
+    }
+
+    if (print_inline_report)
+    {
+        for (const auto& fn : runtime.inline_stats())
+        {
+            std::cerr << "inlined " << fn.name << " (" << fn.size
+                      << " nodes) at " << fn.n_sites << " call sites\n";
+        }
+    }
+
+    if (print_gc_stats)
+    {
+        GCStats stats = runtime.gc_stats();
+
+        std::cerr << "collections: " << stats.n_collections << ", "
+                  << stats.total_pause_ns / 1000 << " us total pause, "
+                  << stats.max_pause_ns / 1000 << " us max pause\n"
+                  << "heap: " << stats.n_objects << " objects, "
+                  << stats.heap_bytes << " bytes, "
+                  << stats.peak_heap_bytes << " bytes at peak\n"
+                  << "freed: " << stats.n_freed << " objects, "
+                  << stats.freed_bytes << " bytes\n";
+
+        if (options.region_heap)
+        {
+            std::cerr << "promoted: " << stats.n_promoted << " objects, "
+                      << stats.promoted_bytes << " bytes\n"
+                      << "region: " << stats.peak_region_bytes
+                      << " bytes at peak\n";
+        }
+    }
 
-    while (tokens.size() > 0)
+    if (options.profile)
     {
-        auto ast = parse_expr(tokens);
-        auto result = runtime.eval_ast(ast);
-        std::cout << result->to_string() << '\n';
+        print_profile(*runtime.profile());
     }
 }
@@ -0,0 +1,397 @@
+#include "bobac.h"
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "lexer.h"
+#include "parser.h"
+#include "processor.h"
+#include "str.h"
+#include "symbols.h"
+
+bool is_bobac(std::string_view contents)
+{
+    return contents.size() >= sizeof(BobacHeader)
+        && contents.substr(0, 8) == std::string_view(BOBAC_MAGIC, 8);
+}
+
+// Appends n values to a buffer, and returns the offset they start at.
+template <typename T>
+uint32_t append(std::vector<unsigned char>& out, const T* values, size_t n)
+{
+    uint32_t offset = out.size();
+    auto bytes = reinterpret_cast<const unsigned char*>(values);
+
+    out.insert(out.end(), bytes, bytes + n * sizeof(T));
+    return offset;
+}
+
+// Copies a table into the room that was reserved for it at offset. An empty
+// table has no data to copy from, which memcpy() can't be given even for
+// zero bytes.
+template <typename T>
+void copy_table(std::vector<unsigned char>& out, uint32_t offset,
+                const std::vector<T>& table)
+{
+    if (!table.empty())
+    {
+        std::memcpy(out.data() + offset, table.data(),
+                    table.size() * sizeof(T));
+    }
+}
+
+inline uint32_t append_string(std::vector<unsigned char>& out,
+                              const std::string& str)
+{
+    return append(out, str.c_str(), str.size() + 1);
+}
+
+// Appends the bytes of every constant, followed by a table of them, and
+// returns the offset the table starts at.
+static uint32_t append_constants(std::vector<unsigned char>& out,
+                                 const std::vector<Value>& constants)
+{
+    std::vector<BobacConstant> table;
+
+    for (Value value : constants)
+    {
+        std::string chars = string_chars(value);
+        table.push_back({ append(out, chars.data(), chars.size()),
+                          static_cast<uint32_t>(chars.size()) });
+    }
+
+    return append(out, table.data(), table.size());
+}
+
+bool write_bobac(Runtime& runtime, std::string_view source, const char* path)
+{
+    if (runtime.register_backend)
+    {
+        std::cerr << "Error: only the stack backend can compile to .bobac"
+                  << std::endl;
+        return false;
+    }
+
+    Processor& proc = runtime.proc;
+    int n_builtins = runtime.builtin_counter;
+
+    // Compile every form without running any of them. The compiler only needs
+    // to know which globals exist, not what is in them.
+    std::vector<unsigned char> form_code;
+    std::vector<BobacForm> forms;
+
+    TextHandle handle(source);
+    TokenList tokens;
+
+    while (tokenize_form(handle, tokens))
+    {
+        auto ast = parse_expr(tokens);
+
+        BobacForm form;
+        form.code_offset = form_code.size();
+
+        form.max_stack = runtime.compile_ast(ast, form_code);
+
+        form.code_size = form_code.size() - form.code_offset;
+        forms.push_back(form);
+    }
+
+    // Name of every global slot. Globals can't be redefined, so the entry of
+    // each symbol bound in the global scope is its only one.
+    std::vector<std::string> global_names(proc.globals.size());
+
+    for (uint32_t symbol : runtime.scopes[0].symbols)
+    {
+        int slot = runtime.entries[runtime.bound[symbol]].binding.index;
+        global_names[slot] = symbols().name(symbol);
+    }
+
+    BobacHeader header;
+    std::memcpy(header.magic, BOBAC_MAGIC, sizeof(header.magic));
+    header.version = BOBAC_VERSION;
+    header.n_builtins = n_builtins;
+    header.n_protos = proc.protos.size() - n_builtins;
+    header.n_forms = forms.size();
+    header.n_globals = global_names.size();
+    header.protos_offset = sizeof(BobacHeader);
+    header.forms_offset = header.protos_offset
+        + header.n_protos * sizeof(BobacProto);
+    header.globals_offset = header.forms_offset
+        + header.n_forms * sizeof(BobacForm);
+
+    // Everything the tables point to goes after them.
+    std::vector<unsigned char> out(header.globals_offset
+                                   + header.n_globals * sizeof(uint32_t));
+
+    std::vector<BobacProto> protos;
+
+    for (size_t i = n_builtins; i < proc.protos.size(); i++)
+    {
+        FunctionProto* proto = proc.protos[i].get();
+        BobacProto entry;
+
+        std::vector<uint32_t> children(proto->protos.begin(),
+                                       proto->protos.end());
+
+        entry.name_offset = append_string(out, proto->name);
+        entry.n_args = proto->n_args;
+        entry.variadic = proto->last_param_variadic;
+        entry.frame_size = proto->frame_size;
+        entry.max_stack = proto->max_stack;
+        entry.n_captures = proto->n_captures;
+        entry.code_offset = append(out, proto->entry, proto->code_size);
+        entry.code_size = proto->code_size;
+        entry.children_offset = append(out, children.data(), children.size());
+        entry.n_children = children.size();
+        entry.constants_offset = append_constants(out, proto->constants);
+        entry.n_constants = proto->constants.size();
+
+        protos.push_back(entry);
+    }
+
+    header.constants_offset = append_constants(out, proc.constants);
+    header.n_constants = proc.constants.size();
+
+    uint32_t form_code_offset = append(out, form_code.data(), form_code.size());
+
+    for (auto& form : forms)
+    {
+        form.code_offset += form_code_offset;
+    }
+
+    std::vector<uint32_t> name_offsets;
+
+    for (auto& name : global_names)
+    {
+        name_offsets.push_back(append_string(out, name));
+    }
+
+    std::memcpy(out.data(), &header, sizeof(header));
+    copy_table(out, header.protos_offset, protos);
+    copy_table(out, header.forms_offset, forms);
+    copy_table(out, header.globals_offset, name_offsets);
+
+    std::ofstream file(path, std::ios::binary);
+    file.write(reinterpret_cast<const char*>(out.data()), out.size());
+    file.close();
+
+    if (file.fail())
+    {
+        std::cerr << "Error: can't write " << path << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+// Returns whether n values of type T starting at offset lie within image.
+template <typename T>
+inline bool in_image(std::string_view image, uint64_t offset, uint64_t n)
+{
+    return offset <= image.size() && n * sizeof(T) <= image.size() - offset;
+}
+
+// Returns the NUL-terminated string at offset, or nullptr if it doesn't end
+// within image.
+inline const char* image_string(std::string_view image, uint32_t offset)
+{
+    if (offset >= image.size()
+        || std::memchr(image.data() + offset, 0, image.size() - offset)
+           == nullptr)
+    {
+        return nullptr;
+    }
+
+    return image.data() + offset;
+}
+
+template <typename T>
+inline T image_get(std::string_view image, uint64_t offset)
+{
+    T value;
+    std::memcpy(&value, image.data() + offset, sizeof(T));
+    return value;
+}
+
+// Makes the n constants in the table at offset into strings, appending them to
+// constants. Returns false if any of them doesn't lie within image.
+static bool load_constants(Processor& proc, std::string_view image,
+                           uint32_t offset, uint32_t n,
+                           std::vector<Value>& constants)
+{
+    if (!in_image<BobacConstant>(image, offset, n))
+    {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < n; i++)
+    {
+        auto constant = image_get<BobacConstant>(
+            image, offset + i * sizeof(BobacConstant));
+
+        if (!in_image<char>(image, constant.offset, constant.length))
+        {
+            return false;
+        }
+
+        constants.push_back(make_string(proc, image.substr(constant.offset,
+                                                           constant.length)));
+    }
+
+    return true;
+}
+
+bool run_bobac(Runtime& runtime, std::string_view image,
+               const std::function<void(Value)>& on_result)
+{
+    auto fail = [](const char* message)
+    {
+        std::cerr << "Error: " << message << std::endl;
+        return false;
+    };
+
+    if (runtime.register_backend)
+    {
+        return fail("only the stack backend can run .bobac files");
+    }
+
+    if (!is_bobac(image))
+    {
+        return fail("not a compiled Boba file");
+    }
+
+    auto header = image_get<BobacHeader>(image, 0);
+    Processor& proc = runtime.proc;
+    uint32_t n_builtins = runtime.builtin_counter;
+
+    if (header.version != BOBAC_VERSION)
+    {
+        return fail("compiled by a different version of Boba; recompile it");
+    }
+
+    if (header.n_builtins != n_builtins
+        || proc.protos.size() != n_builtins
+        || proc.globals.size() != n_builtins)
+    {
+        return fail("compiled against different builtins; recompile it");
+    }
+
+    if (!in_image<BobacProto>(image, header.protos_offset, header.n_protos)
+        || !in_image<BobacForm>(image, header.forms_offset, header.n_forms)
+        || !in_image<uint32_t>(image, header.globals_offset, header.n_globals)
+        || header.n_globals < n_builtins)
+    {
+        return fail("compiled file is truncated or corrupt");
+    }
+
+    // The code is run where it is. The processor quickens it in place, so the
+    // image has to be writable.
+    auto base = reinterpret_cast<unsigned char*>(
+        const_cast<char*>(image.data()));
+
+    for (uint32_t i = 0; i < header.n_protos; i++)
+    {
+        auto entry = image_get<BobacProto>(
+            image, header.protos_offset + i * sizeof(BobacProto));
+        const char* name = image_string(image, entry.name_offset);
+
+        if (name == nullptr
+            || !in_image<unsigned char>(image, entry.code_offset,
+                                        entry.code_size)
+            || !in_image<uint32_t>(image, entry.children_offset,
+                                   entry.n_children))
+        {
+            return fail("compiled file is truncated or corrupt");
+        }
+
+        auto proto = std::make_unique<FunctionProto>();
+        proto->name = name;
+        proto->n_args = entry.n_args;
+        proto->last_param_variadic = entry.variadic;
+        proto->frame_size = entry.frame_size;
+        proto->max_stack = entry.max_stack;
+        proto->n_captures = entry.n_captures;
+        proto->entry = base + entry.code_offset;
+        proto->code_size = entry.code_size;
+
+        for (uint32_t j = 0; j < entry.n_children; j++)
+        {
+            uint32_t child = image_get<uint32_t>(
+                image, entry.children_offset + j * sizeof(uint32_t));
+
+            if (child >= n_builtins + header.n_protos)
+            {
+                return fail("compiled file is truncated or corrupt");
+            }
+
+            proto->protos.push_back(child);
+        }
+
+        if (!load_constants(proc, image, entry.constants_offset,
+                            entry.n_constants, proto->constants))
+        {
+            return fail("compiled file is truncated or corrupt");
+        }
+
+        proc.add_proto(std::move(proto));
+    }
+
+    if (!load_constants(proc, image, header.constants_offset,
+                        header.n_constants, proc.constants))
+    {
+        return fail("compiled file is truncated or corrupt");
+    }
+
+    // Forms that haven't run yet may create closures from any prototype, so
+    // none of them can be reclaimed. Their code is part of the mapping anyway.
+    proc.code_collect_at = SIZE_MAX;
+
+    // Bind the globals by name as well, which leaves the global scope just as
+    // it would be if the program had been compiled by this runtime.
+    for (uint32_t slot = n_builtins; slot < header.n_globals; slot++)
+    {
+        const char* name = image_string(
+            image, image_get<uint32_t>(image, header.globals_offset
+                                       + slot * sizeof(uint32_t)));
+
+        if (name == nullptr)
+        {
+            return fail("compiled file is truncated or corrupt");
+        }
+
+        runtime.bind(0, symbols().intern(name),
+                     { BindingKind::Global, runtime.scopes[0].n_slots++ });
+        proc.globals.push_back(Value());
+    }
+
+    std::vector<BobacForm> forms;
+
+    for (uint32_t i = 0; i < header.n_forms; i++)
+    {
+        auto form = image_get<BobacForm>(
+            image, header.forms_offset + i * sizeof(BobacForm));
+
+        if (form.code_size == 0
+            || !in_image<unsigned char>(image, form.code_offset,
+                                        form.code_size)
+            || base[form.code_offset + form.code_size - 1] != 0)
+        {
+            return fail("compiled file is truncated or corrupt");
+        }
+
+        forms.push_back(form);
+    }
+
+    for (auto& form : forms)
+    {
+        on_result(runtime.run_toplevel(base + form.code_offset,
+                                              form.max_stack));
+    }
+
+    return true;
+}
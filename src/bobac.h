@@ -0,0 +1,114 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string_view>
+
+#include "runtime.h"
+
+// A .bobac file holds a whole program compiled for the stack machine, so that
+// it can be run without lexing, parsing or compiling anything. The file is
+// memory-mapped privately and its code is run in place, which means processes
+// that run the same file share its pages until quickening writes to them.
+//
+// Everything is stored in the byte order of the machine that wrote the file.
+// The file starts with a BobacHeader, followed by the tables it points to:
+//
+//   BobacProto[n_protos]   Function prototypes, in the order CreateClosure
+//                          indexes them, following the builtins.
+//   BobacForm[n_forms]     Top-level forms, in the order they are run.
+//   uint32_t[n_globals]    Offset of the name of every global slot, including
+//                          the builtins.
+//   BobacConstant[n_constants]
+//                          Constants of the top-level forms, which PushConst
+//                          indexes when no function is running.
+//
+// The code, the prototypes' child indices and constants, and the names live in
+// the rest of the file, and every offset is from the start of the file.
+// Numbers are immediate operands in the code, so the only constants are the
+// strings, which are made again when the file is loaded.
+//
+// The code is only meaningful to a processor with the same instruction set,
+// so BOBAC_VERSION has to change whenever Instruction does, as well as whenever
+// the layout of the file does.
+
+#define BOBAC_MAGIC "BOBAC\r\n\x1a"
+#define BOBAC_VERSION 9
+
+struct BobacHeader
+{
+    char magic[8];
+    uint32_t version;
+
+    // Number of builtins the program was compiled against. They take up the
+    // first global slots and prototype indices.
+    uint32_t n_builtins;
+
+    uint32_t n_protos;
+    uint32_t n_forms;
+    uint32_t n_globals;
+
+    uint32_t protos_offset;
+    uint32_t forms_offset;
+    uint32_t globals_offset;
+
+    uint32_t constants_offset;
+    uint32_t n_constants;
+};
+
+struct BobacProto
+{
+    // Offset of the function's name, which is NUL-terminated.
+    uint32_t name_offset;
+
+    uint32_t n_args;
+    uint32_t variadic;
+    uint32_t frame_size;
+    uint32_t max_stack;
+    uint32_t n_captures;
+
+    uint32_t code_offset;
+    uint32_t code_size;
+
+    // Indices of the prototypes the code creates closures from, as an array
+    // of uint32_t.
+    uint32_t children_offset;
+    uint32_t n_children;
+
+    // The function's constants, as an array of BobacConstant.
+    uint32_t constants_offset;
+    uint32_t n_constants;
+};
+
+// A string constant, whose bytes aren't NUL-terminated.
+struct BobacConstant
+{
+    uint32_t offset;
+    uint32_t length;
+};
+
+struct BobacForm
+{
+    // Code of the form, which ends in a 0 byte.
+    uint32_t code_offset;
+    uint32_t code_size;
+
+    // How far the code goes on the stack, like FunctionProto::max_stack.
+    uint32_t max_stack;
+};
+
+// Returns whether a file's contents look like a .bobac file.
+bool is_bobac(std::string_view contents);
+
+// Compiles every top-level form of source with runtime, which must not have
+// run anything yet, and writes the program to path. Returns false, with an
+// error printed, if that fails.
+bool write_bobac(Runtime& runtime, std::string_view source, const char* path);
+
+// Loads the program in image into runtime, which must not have run anything
+// yet, and runs it, passing the result of each top-level form to on_result.
+// image has to stay mapped, and writable, for as long as the runtime exists.
+// Returns false, with an error printed, if image isn't a valid .bobac file for
+// this build.
+bool run_bobac(Runtime& runtime, std::string_view image,
+               const std::function<void(Value)>& on_result);
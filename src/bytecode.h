@@ -1,29 +1,62 @@
+#pragma once
+
+#include <cstddef>
+
 enum class Instruction : unsigned char
 {
     // Pushing stuff onto the stack:
     PushInt = 1,
-    PushStr,
+
+    // Push one of the running function's constants, or one of the top-level
+    // code's if no function is running. Takes the constant's index.
+    PushConst,
+
+    // Push a float. Takes the double.
     PushFloat,
+
+    // Push a local variable. Takes the variable's slot in the current frame.
     PushRef,
+
+    // Push a global variable. Takes the global's index.
+    PushGlobal,
+
+    // Push a variable captured by the running closure. Takes the capture's
+    // index.
+    PushCapture,
+
+    // Push the running closure.
+    PushSelf,
     
     PushTrue,
     PushFalse,
     
     PushNil,
 
-    // Store:
+    // Store into a slot of the current frame, or into a global:
     Store,
+    StoreGlobal,
 
     // Relative jumps:
     Jmp,
     JmpTrue,
     JmpFalse,
 
-    // Call directly into the closure without putting it on the stack.
+    // Call the closure in a global directly, without putting it on the stack.
+    // Takes the global's index and the number of arguments.
     Call,
 
-    // Call a closure from the top of the stack, popping it
+    // Call a closure from the top of the stack, popping it. Takes the number
+    // of arguments.
     CallPop,
+
+    // Like Call and CallPop, but for calls in tail position. The callee takes
+    // over the current frame instead of getting a new one, and returns
+    // straight to the current function's caller.
+    TailCall,
+    TailCallPop,
+
+    // Create a closure from a function prototype, popping the values it
+    // captures. Takes the index of the prototype.
     CreateClosure,
     
     Ret,
@@ -46,4 +79,270 @@ enum class Instruction : unsigned char
     Mul,
     Div,
     Neg,
+    Min,
+    Max,
+
+    // Reductions. These pop a number of values and push the result of folding
+    // them from left to right. Each takes the number of values, or 0 for every
+    // argument of the running function, which is how the code of a variadic
+    // builtin that is called indirectly uses them.
+    AddN,
+    MulN,
+    MinN,
+    MaxN,
+    AndN,
+    OrN,
+
+    // Chained comparisons, which are true if every value compares true with
+    // the next one. Like the reductions, they take the number of values.
+    EqN,
+    GreaterN,
+    GreaterEqN,
+    LessN,
+    LessEqN,
+
+    // Arrays. IntArray and FloatArray make an array out of a number of values,
+    // which they take like the reductions do. The rest pop the arguments of
+    // the builtin of the same name and push its result.
+    IntArray,
+    FloatArray,
+    Range,
+    Length,
+    At,
+    Sum,
+    Dot,
+    MapAdd,
+    Scale,
+    FilterLess,
+    ArgMax,
+
+    // Strings. Concat takes a number of values like the reductions do, and
+    // Substring pops its three arguments.
+    Concat,
+    Substring,
+
+    // Maps. Each of these pops the arguments of its builtin and pushes its
+    // result.
+    MakeMap,
+    MapGet,
+    MapPut,
+    MapHas,
+    Count,
+
+    // Superinstructions. These fuse sequences that the compiler emits over and
+    // over again into a single instruction, so that they only cost one
+    // dispatch. The sequences were picked by counting executed opcode pairs
+    // on examples/fib.boba, where PushRef -> PushInt, PushInt -> Eq and
+    // Eq -> JmpFalse together make up over a third of all dispatches.
+
+    // A comparison followed by a JmpFalse. Takes the jump offset.
+    EqJmpFalse,
+    GreaterJmpFalse,
+    GreaterEqJmpFalse,
+    LessJmpFalse,
+    LessEqJmpFalse,
+
+    // PushRef, PushInt, a comparison and a JmpFalse. Takes the slot of the
+    // variable, the integer and the jump offset.
+    RefIntEqJmpFalse,
+    RefIntGreaterJmpFalse,
+    RefIntGreaterEqJmpFalse,
+    RefIntLessJmpFalse,
+    RefIntLessEqJmpFalse,
+
+    // PushRef, PushInt and Add or Sub. Takes the slot of the variable and the
+    // integer.
+    RefIntAdd,
+    RefIntSub,
+
+    // Quickened instructions. The compiler never emits these. A generic
+    // arithmetic or comparison instruction rewrites itself into its Int or
+    // Float variant once it has seen two integer or two float operands, and
+    // the variant rewrites itself back if it ever sees anything else.
+    IntEq,
+    IntGreater,
+    IntGreaterEq,
+    IntLess,
+    IntLessEq,
+    IntAdd,
+    IntSub,
+    IntMul,
+    IntDiv,
+    FloatEq,
+    FloatGreater,
+    FloatGreaterEq,
+    FloatLess,
+    FloatLessEq,
+    FloatAdd,
+    FloatSub,
+    FloatMul,
+    FloatDiv,
+};
+
+// Size of an instruction, including its operands, in bytes.
+inline size_t instruction_size(Instruction inst)
+{
+    switch (inst)
+    {
+    case Instruction::PushFloat:
+        return 1 + sizeof(double);
+    case Instruction::PushInt:
+    case Instruction::PushConst:
+    case Instruction::PushRef:
+    case Instruction::PushGlobal:
+    case Instruction::PushCapture:
+    case Instruction::Store:
+    case Instruction::StoreGlobal:
+    case Instruction::Jmp:
+    case Instruction::JmpTrue:
+    case Instruction::JmpFalse:
+    case Instruction::CallPop:
+    case Instruction::TailCallPop:
+    case Instruction::CreateClosure:
+    case Instruction::EqJmpFalse:
+    case Instruction::GreaterJmpFalse:
+    case Instruction::GreaterEqJmpFalse:
+    case Instruction::LessJmpFalse:
+    case Instruction::LessEqJmpFalse:
+    case Instruction::AddN:
+    case Instruction::MulN:
+    case Instruction::MinN:
+    case Instruction::MaxN:
+    case Instruction::AndN:
+    case Instruction::OrN:
+    case Instruction::EqN:
+    case Instruction::GreaterN:
+    case Instruction::GreaterEqN:
+    case Instruction::LessN:
+    case Instruction::LessEqN:
+    case Instruction::IntArray:
+    case Instruction::FloatArray:
+    case Instruction::Concat:
+        return 1 + sizeof(int);
+    case Instruction::Call:
+    case Instruction::TailCall:
+    case Instruction::RefIntAdd:
+    case Instruction::RefIntSub:
+        return 1 + 2 * sizeof(int);
+    case Instruction::RefIntEqJmpFalse:
+    case Instruction::RefIntGreaterJmpFalse:
+    case Instruction::RefIntGreaterEqJmpFalse:
+    case Instruction::RefIntLessJmpFalse:
+    case Instruction::RefIntLessEqJmpFalse:
+        return 1 + 3 * sizeof(int);
+    default:
+        return 1;
+    }
+}
+
+// Whether an instruction may jump. The jump offset is always its last
+// operand, and is relative to the start of the instruction.
+inline bool is_jump(Instruction inst)
+{
+    switch (inst)
+    {
+    case Instruction::Jmp:
+    case Instruction::JmpTrue:
+    case Instruction::JmpFalse:
+    case Instruction::EqJmpFalse:
+    case Instruction::GreaterJmpFalse:
+    case Instruction::GreaterEqJmpFalse:
+    case Instruction::LessJmpFalse:
+    case Instruction::LessEqJmpFalse:
+    case Instruction::RefIntEqJmpFalse:
+    case Instruction::RefIntGreaterJmpFalse:
+    case Instruction::RefIntGreaterEqJmpFalse:
+    case Instruction::RefIntLessJmpFalse:
+    case Instruction::RefIntLessEqJmpFalse:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// The Int variant that a generic instruction is quickened into, or inst itself
+// if it has none.
+inline Instruction int_instruction(Instruction inst)
+{
+    switch (inst)
+    {
+    case Instruction::Eq: return Instruction::IntEq;
+    case Instruction::Greater: return Instruction::IntGreater;
+    case Instruction::GreaterEq: return Instruction::IntGreaterEq;
+    case Instruction::Less: return Instruction::IntLess;
+    case Instruction::LessEq: return Instruction::IntLessEq;
+    case Instruction::Add: return Instruction::IntAdd;
+    case Instruction::Sub: return Instruction::IntSub;
+    case Instruction::Mul: return Instruction::IntMul;
+    case Instruction::Div: return Instruction::IntDiv;
+    default: return inst;
+    }
+}
+
+// The Float variant that a generic instruction is quickened into, or inst
+// itself if it has none.
+inline Instruction float_instruction(Instruction inst)
+{
+    switch (inst)
+    {
+    case Instruction::Eq: return Instruction::FloatEq;
+    case Instruction::Greater: return Instruction::FloatGreater;
+    case Instruction::GreaterEq: return Instruction::FloatGreaterEq;
+    case Instruction::Less: return Instruction::FloatLess;
+    case Instruction::LessEq: return Instruction::FloatLessEq;
+    case Instruction::Add: return Instruction::FloatAdd;
+    case Instruction::Sub: return Instruction::FloatSub;
+    case Instruction::Mul: return Instruction::FloatMul;
+    case Instruction::Div: return Instruction::FloatDiv;
+    default: return inst;
+    }
+}
+
+// The generic instruction that a quickened one was rewritten from, or inst
+// itself if it isn't quickened.
+inline Instruction generic_instruction(Instruction inst)
+{
+    switch (inst)
+    {
+    case Instruction::IntEq: return Instruction::Eq;
+    case Instruction::IntGreater: return Instruction::Greater;
+    case Instruction::IntGreaterEq: return Instruction::GreaterEq;
+    case Instruction::IntLess: return Instruction::Less;
+    case Instruction::IntLessEq: return Instruction::LessEq;
+    case Instruction::IntAdd: return Instruction::Add;
+    case Instruction::IntSub: return Instruction::Sub;
+    case Instruction::IntMul: return Instruction::Mul;
+    case Instruction::IntDiv: return Instruction::Div;
+    case Instruction::FloatEq: return Instruction::Eq;
+    case Instruction::FloatGreater: return Instruction::Greater;
+    case Instruction::FloatGreaterEq: return Instruction::GreaterEq;
+    case Instruction::FloatLess: return Instruction::Less;
+    case Instruction::FloatLessEq: return Instruction::LessEq;
+    case Instruction::FloatAdd: return Instruction::Add;
+    case Instruction::FloatSub: return Instruction::Sub;
+    case Instruction::FloatMul: return Instruction::Mul;
+    case Instruction::FloatDiv: return Instruction::Div;
+    default: return inst;
+    }
+}
+
+// How a call by name to a builtin is compiled, by either backend.
+enum class BuiltinKind
+{
+    // Takes exactly num_args arguments, which go straight to inst.
+    Fixed,
+
+    // Applies inst to the first two arguments, and then to the result and
+    // each of the following ones.
+    Fold,
+
+    // Compares each argument with the next one. Two arguments are compared
+    // with inst, and any other number with reduce.
+    Chain,
+
+    // Like Fold, but stops evaluating arguments once the result is known.
+    Logical,
+
+    // Makes a single value out of all of the arguments with reduce.
+    Collect,
 };
@@ -1,10 +1,13 @@
 #pragma once
 
-#include <any>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
 #include <unordered_map>
 #include <string>
-
-#define CLOSURE_INSTRUCTION_SIZE 4096
+#include <vector>
 
 enum class ValueType
 {
@@ -13,85 +16,647 @@ enum class ValueType
     Float,
     Str,
     Bool,
-    Closure
+    Closure,
+    Array,
+    Map
 };
 
-struct Value
+// Alignment of the elements of an array, which is what the widest vector
+// loads of the array kernels want.
+#define ARRAY_ALIGNMENT 32
+
+// Number of slots in a group of a map, whose control bytes are matched all at
+// once. A map has at least one group.
+#define MAP_GROUP_SIZE 16
+
+// Control byte of an empty slot in a map. A full slot's control byte is 7 bits
+// of the hash of its key, which is never negative.
+#define MAP_EMPTY (-128)
+
+// Every runtime object that lives on the heap begins with this header. The
+// processor threads all of the objects it allocates into a list through
+// `next`, which is how it finds them again when it is torn down.
+struct Object
 {
     ValueType type;
-    std::any value;
 
-    Value()
+    // Set while the processor traces which objects are reachable.
+    bool marked = false;
+
+    // Set if the object was allocated in the processor's region rather than
+    // on its heap. A region object that has been moved to the heap has marked
+    // set, and next points at its copy.
+    bool in_region = false;
+
+    Object* next = nullptr;
+
+    Object(ValueType type) : type(type)
+    {
+
+    }
+};
+
+// Values are NaN-boxed into 64 bits. Any double that is not a NaN is stored
+// as-is, and everything else is packed into the payload of a quiet NaN:
+//
+//   s 11111111111 11 tttttttttttttttt pppppppppppppppppppppppppppppppp
+//
+// Heap objects have the sign bit s set and keep their pointer in the low 48
+// bits. Nil, booleans and integers have the sign bit clear and use the 16 t
+// bits as a tag, with integers stored in the 32 p bits. Reading a value is
+// therefore just a mask and a compare, and no value ever needs its own
+// allocation.
+//
+// Strings of up to SHORT_STRING_MAX bytes are stored in the value as well.
+// They set the top t bit, keep their length in the three bits below the top
+// byte of t, and their bytes in the low 40 bits, first byte lowest. Every
+// other bit is clear, so two short strings are equal exactly when their bits
+// are.
+struct Value
+{
+    static constexpr uint64_t QNAN      = 0x7ffc000000000000;
+    static constexpr uint64_t SIGN_BIT  = 0x8000000000000000;
+    static constexpr uint64_t TAG_MASK  = 0x0000ffff00000000;
+
+    static constexpr uint64_t NIL_BITS  = QNAN | (1ULL << 32);
+    static constexpr uint64_t FALSE_BITS = QNAN | (2ULL << 32);
+    static constexpr uint64_t TRUE_BITS = QNAN | (3ULL << 32);
+    static constexpr uint64_t INT_TAG   = QNAN | (4ULL << 32);
+
+    static constexpr uint64_t SHORT_STRING_TAG = QNAN | (1ULL << 47);
+    static constexpr size_t SHORT_STRING_MAX = 5;
+
+    // The NaN that every NaN double gets canonicalized to, so that it can't be
+    // mistaken for a tagged value.
+    static constexpr uint64_t CANONICAL_NAN = 0x7ff8000000000000;
+
+    uint64_t bits;
+
+    Value() : bits(NIL_BITS)
+    {
+
+    }
+
+    Value(int v) : bits(INT_TAG | static_cast<uint32_t>(v))
+    {
+
+    }
+
+    Value(bool v) : bits(v ? TRUE_BITS : FALSE_BITS)
+    {
+
+    }
+
+    Value(double v)
     {
-        type = ValueType::Nil;
+        if (v != v)
+        {
+            bits = CANONICAL_NAN;
+        }
+        else
+        {
+            std::memcpy(&bits, &v, sizeof(double));
+        }
+    }
+
+    explicit Value(Object* object)
+        : bits(SIGN_BIT | QNAN | reinterpret_cast<uint64_t>(object))
+    {
+
+    }
+
+    inline bool is_nil() const
+    {
+        return bits == NIL_BITS;
+    }
+
+    inline bool is_int() const
+    {
+        return (bits & (SIGN_BIT | QNAN | TAG_MASK)) == INT_TAG;
+    }
+
+    // Whether a and b are both integers, checked with a single branch.
+    static inline bool both_int(Value a, Value b)
+    {
+        return (((a.bits ^ INT_TAG) | (b.bits ^ INT_TAG))
+                & (SIGN_BIT | QNAN | TAG_MASK)) == 0;
+    }
+
+    inline bool is_short_string() const
+    {
+        return (bits & (SIGN_BIT | QNAN | (1ULL << 47))) == SHORT_STRING_TAG;
+    }
+
+    inline bool is_bool() const
+    {
+        return (bits | (1ULL << 32)) == TRUE_BITS;
+    }
+
+    inline bool is_float() const
+    {
+        return (bits & QNAN) != QNAN;
+    }
+
+    inline bool is_number() const
+    {
+        return is_int() || is_float();
     }
-    
-    Value(int v)
+
+    inline bool is_object() const
     {
-        type = ValueType::Int;
-        value = v;
+        return (bits & (SIGN_BIT | QNAN)) == (SIGN_BIT | QNAN);
     }
-   
-    Value(bool v)
+
+    inline int as_int() const
     {
-        type = ValueType::Bool;
-        value = v;
+        return static_cast<int>(static_cast<uint32_t>(bits));
     }
 
-    inline bool is_nil()
+    inline bool as_bool() const
     {
-        return type == ValueType::Nil;
+        return bits == TRUE_BITS;
     }
 
-    template <typename T> inline T as()
+    inline double as_float() const
     {
-        return std::any_cast<T>(value);
+        double v;
+        std::memcpy(&v, &bits, sizeof(double));
+        return v;
     }
 
-    std::string to_string()
+    // Value of a number as a double, whether it is an integer or a float.
+    inline double as_number() const
     {
-        switch (type)
+        return is_int() ? as_int() : as_float();
+    }
+
+    inline Object* as_object() const
+    {
+        return reinterpret_cast<Object*>(bits & ~(SIGN_BIT | QNAN));
+    }
+
+    // A string of at most SHORT_STRING_MAX bytes.
+    static inline Value short_string(const char* chars, size_t length)
+    {
+        Value value;
+        value.bits = SHORT_STRING_TAG | (static_cast<uint64_t>(length) << 40);
+
+        for (size_t i = 0; i < length; i++)
+        {
+            value.bits |= static_cast<uint64_t>(
+                static_cast<unsigned char>(chars[i])) << (8 * i);
+        }
+
+        return value;
+    }
+
+    inline size_t short_string_length() const
+    {
+        return (bits >> 40) & 7;
+    }
+
+    // Copies the bytes of a short string to chars.
+    inline void short_string_chars(char* chars) const
+    {
+        for (size_t i = 0; i < short_string_length(); i++)
+        {
+            chars[i] = static_cast<char>(bits >> (8 * i));
+        }
+    }
+
+    ValueType type() const
+    {
+        if (is_float())
+        {
+            return ValueType::Float;
+        }
+
+        if (is_object())
+        {
+            return as_object()->type;
+        }
+
+        if (is_int())
+        {
+            return ValueType::Int;
+        }
+
+        if (is_short_string())
         {
-        case ValueType::Nil:
-            return "nil";
-        case ValueType::Int:
-            return std::to_string(as<int>());
-        default:
-            break;
+            return ValueType::Str;
         }
-        
-        return "<unknown>";
+
+        return is_bool() ? ValueType::Bool : ValueType::Nil;
     }
+
+    template <typename T> inline T as() const;
+
+    // Shortest text that reads back as v, with a ".0" added if it would
+    // otherwise look like an integer.
+    static std::string float_to_string(double v)
+    {
+        char buf[32];
+        auto result = std::to_chars(buf, buf + sizeof(buf), v);
+        std::string str(buf, result.ptr);
+
+        if (str.find_first_of(".ein") == std::string::npos)
+        {
+            str += ".0";
+        }
+
+        return str;
+    }
+
+    std::string to_string() const;
 };
 
-struct Closure
+// Everything about a function that is known at compile time. A prototype is
+// created once, when the function's definition is compiled, and is shared by
+// every closure that is made from it. Prototypes never change after they have
+// been created.
+struct FunctionProto
 {
+    std::string name;
 
-    // Number of arguments the closure takes.
-    int n_args;
+    // Number of arguments the function takes.
+    int n_args = 0;
 
     // Whether the last argument should be treated as variadic.
     bool last_param_variadic = false;
 
-    unsigned char instructions[CLOSURE_INSTRUCTION_SIZE];
-    unsigned int inst_size = 0;
+    // Number of slots in the frame of a call to the function. The arguments
+    // are the first slots, and the variables bound by defs in the body follow
+    // them.
+    int frame_size = 0;
+
+    // Largest number of values the body has on the stack above its frame at
+    // any one time. Entering a closure checks that there is room for the
+    // frame and these, so the body can push without checking for overflow.
+    int max_stack = 0;
 
-    // Environment that gets loaded onto the environment stack upon
-    // this closure's call.
-    std::unordered_map<int, std::shared_ptr<Value>> env;
+    // Number of values that closures made from the prototype capture.
+    int n_captures = 0;
+
+    std::vector<unsigned char> code;
+
+    // Where the code that runs starts, and how long it is. For a prototype
+    // that was compiled by this process that is code, and for one loaded from
+    // a .bobac file it is part of the mapped file, with code left empty.
+    unsigned char* entry = nullptr;
+    size_t code_size = 0;
+
+    // Indices of the prototypes that the code creates closures from. They
+    // have to be kept around for as long as this prototype is.
+    std::vector<int> protos;
+
+    // Values that PushConst pushes, by index. These are the function's string
+    // literals, which are made once when it is compiled instead of every time
+    // they are pushed.
+    std::vector<Value> constants;
+
+    // Set while the processor traces which prototypes are reachable.
+    bool marked = false;
+};
+
+struct Closure : Object
+{
+    FunctionProto* proto;
 
-    Closure()
+    Closure(FunctionProto* proto)
+        : Object(ValueType::Closure), proto(proto)
     {
-        std::memset(instructions, 0, CLOSURE_INSTRUCTION_SIZE);
+
     }
 
+    // Values of the variables from enclosing functions that the body refers
+    // to, copied in when the closure was created. Bindings can't be changed,
+    // so a copy is always up to date. They are stored right after the closure
+    // itself, which keeps it in one allocation with nothing to destroy.
+    inline Value* captures()
+    {
+        return reinterpret_cast<Value*>(this + 1);
+    }
 
-    Closure(int n_args, bool last_param_variadic, unsigned char inst)
-        : n_args(n_args), last_param_variadic(last_param_variadic)
+    // Size of a closure made from proto, including its captures.
+    static inline size_t size(const FunctionProto* proto)
     {
-        
-        std::memset(instructions, 0, CLOSURE_INSTRUCTION_SIZE);
-        instructions[0] = inst;
-        inst_size++;
+        return sizeof(Closure) + proto->n_captures * sizeof(Value);
     }
 };
+
+enum class ElementType : unsigned char
+{
+    Int,
+    Float
+};
+
+// A fixed-length array of numbers that all have the same type. Integers are
+// stored as 64 bits and floats as doubles, in a buffer of their own that is
+// aligned to ARRAY_ALIGNMENT, so that the array builtins can run over them
+// with vector instructions instead of going through the interpreter one
+// element at a time.
+struct Array : Object
+{
+    ElementType element_type;
+
+    // Number of elements. An array made by a filter can have fewer elements
+    // than its buffer has room for.
+    size_t length;
+    size_t capacity;
+
+    void* data;
+
+    Array(ElementType element_type, size_t capacity)
+        : Object(ValueType::Array), element_type(element_type),
+          length(capacity), capacity(capacity),
+          data(::operator new(capacity * sizeof(int64_t),
+                              std::align_val_t(ARRAY_ALIGNMENT)))
+    {
+
+    }
+
+    Array(const Array&) = delete;
+
+    ~Array()
+    {
+        ::operator delete(data, std::align_val_t(ARRAY_ALIGNMENT));
+    }
+
+    inline int64_t* ints()
+    {
+        return static_cast<int64_t*>(data);
+    }
+
+    inline double* floats()
+    {
+        return static_cast<double*>(data);
+    }
+
+    // Value of an element. Integers are truncated to the 32 bits of an
+    // integer value, the same way integer arithmetic wraps around.
+    inline Value at(size_t i)
+    {
+        if (element_type == ElementType::Int)
+        {
+            return Value(static_cast<int>(static_cast<uint32_t>(ints()[i])));
+        }
+
+        return Value(floats()[i]);
+    }
+
+    // Size of an array with a buffer of capacity elements.
+    static inline size_t size(size_t capacity)
+    {
+        return sizeof(Array) + capacity * sizeof(int64_t);
+    }
+};
+
+struct MapSlot
+{
+    Value key;
+    Value value;
+};
+
+// A hash map from values to values, laid out like a Swiss table. The slots are
+// in groups of MAP_GROUP_SIZE, and next to them is a control byte per slot
+// that says whether it is empty, and if it isn't holds 7 bits of its key's
+// hash. A lookup matches all the control bytes of a group against the hash at
+// once, and only compares the keys of the slots that match, so most probes
+// never touch a key that isn't the one being looked for. map.h works with
+// maps.
+//
+// Keys are stored so that equal keys are the same value: a long string is
+// always its interned flat string. Maps are updated in place, so they are
+// never allocated in a region.
+struct Map : Object
+{
+    // Number of entries, and of slots, which is a power of two.
+    uint32_t count = 0;
+    uint32_t capacity;
+
+    // The control bytes, followed by the slots.
+    unsigned char* table;
+
+    Map(uint32_t capacity)
+        : Object(ValueType::Map), capacity(capacity),
+          table(static_cast<unsigned char*>(
+                    ::operator new(table_size(capacity))))
+    {
+        std::memset(table, MAP_EMPTY, capacity);
+    }
+
+    Map(const Map&) = delete;
+
+    ~Map()
+    {
+        ::operator delete(table);
+    }
+
+    inline int8_t* control()
+    {
+        return reinterpret_cast<int8_t*>(table);
+    }
+
+    inline MapSlot* slots()
+    {
+        return reinterpret_cast<MapSlot*>(table + capacity);
+    }
+
+    inline bool full(size_t i)
+    {
+        return control()[i] != MAP_EMPTY;
+    }
+
+    // Size of the table of a map with capacity slots, and of the whole map.
+    static inline size_t table_size(size_t capacity)
+    {
+        return capacity * (1 + sizeof(MapSlot));
+    }
+
+    static inline size_t size(size_t capacity)
+    {
+        return sizeof(Map) + table_size(capacity);
+    }
+};
+
+enum class StringKind : unsigned char
+{
+    Flat,
+    Concat,
+    Slice
+};
+
+// A string that is too long to be stored in a value. Its bytes are in one of
+// three kinds of objects, which str.h works with.
+struct String : Object
+{
+    StringKind kind;
+    uint32_t length;
+
+    String(StringKind kind, uint32_t length)
+        : Object(ValueType::Str), kind(kind), length(length)
+    {
+
+    }
+};
+
+// A string whose bytes are stored right after the object, which keeps it in
+// one allocation with nothing to destroy. Flat strings are interned, so there
+// is never more than one with the same bytes, and its hash is worked out once
+// when it is made.
+struct FlatString : String
+{
+    uint32_t hash;
+
+    FlatString(uint32_t length, uint32_t hash)
+        : String(StringKind::Flat, length), hash(hash)
+    {
+
+    }
+
+    inline char* chars()
+    {
+        return reinterpret_cast<char*>(this + 1);
+    }
+
+    // Size of a flat string of length bytes.
+    static inline size_t size(size_t length)
+    {
+        return sizeof(FlatString) + length;
+    }
+};
+
+// Two strings joined together, which are only copied into a flat string when
+// something needs all of the bytes in one place. Once they have been, flat is
+// set and left and right are dropped.
+struct ConcatString : String
+{
+    Value left;
+    Value right;
+    FlatString* flat = nullptr;
+
+    ConcatString(uint32_t length, Value left, Value right)
+        : String(StringKind::Concat, length), left(left), right(right)
+    {
+
+    }
+};
+
+// Part of a flat string, which shares its bytes.
+struct SliceString : String
+{
+    FlatString* source;
+    uint32_t start;
+
+    SliceString(uint32_t length, FlatString* source, uint32_t start)
+        : String(StringKind::Slice, length), source(source), start(start)
+    {
+
+    }
+
+    inline const char* chars()
+    {
+        return source->chars() + start;
+    }
+};
+
+// Bytes of a string, of any kind. Defined in str.cpp.
+std::string string_chars(Value value);
+
+inline std::string Value::to_string() const
+{
+    switch (type())
+    {
+    case ValueType::Nil:
+        return "nil";
+    case ValueType::Int:
+        return std::to_string(as_int());
+    case ValueType::Float:
+        return float_to_string(as_float());
+    case ValueType::Array:
+    {
+        auto array = static_cast<Array*>(as_object());
+        std::string str = "[";
+
+        for (size_t i = 0; i < array->length; i++)
+        {
+            str += (i > 0 ? " " : "") + array->at(i).to_string();
+        }
+
+        return str + "]";
+    }
+    case ValueType::Map:
+    {
+        auto map = static_cast<Map*>(as_object());
+        std::string str = "{";
+
+        for (size_t i = 0; i < map->capacity; i++)
+        {
+            if (map->full(i))
+            {
+                str += (str.size() > 1 ? ", " : "")
+                    + map->slots()[i].key.to_string() + " "
+                    + map->slots()[i].value.to_string();
+            }
+        }
+
+        return str + "}";
+    }
+    case ValueType::Str:
+        return "\"" + string_chars(*this) + "\"";
+    default:
+        break;
+    }
+
+    return "<unknown>";
+}
+
+template <> inline int Value::as<int>() const
+{
+    return as_int();
+}
+
+template <> inline bool Value::as<bool>() const
+{
+    return as_bool();
+}
+
+template <> inline double Value::as<double>() const
+{
+    return as_float();
+}
+
+template <> inline Closure* Value::as<Closure*>() const
+{
+    return static_cast<Closure*>(as_object());
+}
+
+template <> inline Array* Value::as<Array*>() const
+{
+    return static_cast<Array*>(as_object());
+}
+
+template <> inline String* Value::as<String*>() const
+{
+    return static_cast<String*>(as_object());
+}
+
+template <> inline Map* Value::as<Map*>() const
+{
+    return static_cast<Map*>(as_object());
+}
+
+// The value itself, or the heap copy of a region object that has been moved
+// out of the region in the middle of a form. Frames that were running when it
+// moved still hold the original, so anything that compares objects by
+// address has to look through it first.
+inline Value resolve_forwarded(Value value)
+{
+    if (value.is_object() && value.as_object()->in_region
+        && value.as_object()->marked)
+    {
+        return Value(value.as_object()->next);
+    }
+
+    return value;
+}
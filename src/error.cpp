@@ -3,55 +3,50 @@
 #include <iostream>
 #include <string.h>
 
-void err_token(std::shared_ptr<Token> token, std::string message)
+void err_token(std::string_view source, const Token& token,
+               std::string message)
 {
-    // TODO: Avoid pointer deref here
-    std::string stream = *(token->stream);
-    std::cout << "ERROR: line "
-              << token->line_num
-              << ", column "
-              << token->col_num
-              << std::endl;
+    // Find the line the token is on, and where that line starts. A \r\n
+    // sequence counts as a single line break.
+    int line_num = 1;
+    size_t line_start = 0;
 
-    size_t i = 0;
-    for (int line = 1; line < token->line_num; line++)
+    for (size_t i = 0; i < token.offset && i < source.length(); i++)
     {
-        while (stream[i] != '\n' && stream[i] != '\r')
+        if (source[i] == '\n'
+            || (source[i] == '\r'
+                && (i + 1 >= source.length() || source[i + 1] != '\n')))
         {
-            i++;
+            line_num++;
+            line_start = i + 1;
         }
-
-        // Handle \r\n. If peeking one character ahead would put us outside the
-        // stream, just return -1.
-        if (stream[i] == 'r'
-            && (i + 1 < stream.length() ? stream[i + 1] : -1) == '\n')
-        {
-            i++;
-        }
-        
-        // We've ended on top of a \n, so move by one more char.
-        i++;
     }
 
+    std::cout << "ERROR: line "
+              << line_num
+              << ", column "
+              << token.offset - line_start + 1
+              << std::endl;
+
     // Print this entire current line:
-    std::string line;
+    size_t line_end = line_start;
 
-    while (stream[i] != '\n' && stream[i] != '\r' && i < stream.length())
+    while (line_end < source.length()
+           && source[line_end] != '\n' && source[line_end] != '\r')
     {
-        line += stream[i];
-        i++;
+        line_end++;
     }
-    
-    std::cout << line << std::endl;
+
+    std::cout << source.substr(line_start, line_end - line_start) << std::endl;
 
     // Print the message under the line:
-    for (int i = 1; i < token->col_num; i++)
+    for (size_t i = line_start; i < token.offset; i++)
     {
         std::cout << " ";
     }
 
     // Underline the offending token
-    for (size_t i = 0; i < token->string_value.length(); i++)
+    for (size_t i = 0; i < token.length; i++)
     {
         std::cout << "^";
     }
@@ -60,4 +55,3 @@ void err_token(std::shared_ptr<Token> token, std::string message)
 
     exit(-1);
 }
-
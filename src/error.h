@@ -1,7 +1,10 @@
 #pragma once
 
+#include <string>
+#include <string_view>
+
 #include "token.h"
-#include <memory>
 
-void err_token(std::shared_ptr<Token> token, std::string message);
+void err_token(std::string_view source, const Token& token,
+               std::string message);
 void err_line(int line_num, std::string message);
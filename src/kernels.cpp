@@ -0,0 +1,921 @@
+#include "kernels.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define KERNELS_X86 1
+#include <immintrin.h>
+#else
+#define KERNELS_X86 0
+#endif
+
+// Plain loops. They are what runs on machines without vector kernels, and
+// they handle the elements after the last full vector everywhere else.
+// Integers are added and multiplied as unsigned, which wraps around instead
+// of overflowing.
+
+static int64_t scalar_sum_ints(const int64_t* a, size_t n)
+{
+    uint64_t sum = 0;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        sum += static_cast<uint64_t>(a[i]);
+    }
+
+    return static_cast<int64_t>(sum);
+}
+
+static double scalar_sum_floats(const double* a, size_t n)
+{
+    double sum = 0;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        sum += a[i];
+    }
+
+    return sum;
+}
+
+static int64_t scalar_dot_ints(const int64_t* a, const int64_t* b, size_t n)
+{
+    uint64_t sum = 0;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        sum += static_cast<uint64_t>(a[i]) * static_cast<uint64_t>(b[i]);
+    }
+
+    return static_cast<int64_t>(sum);
+}
+
+static double scalar_dot_floats(const double* a, const double* b, size_t n)
+{
+    double sum = 0;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        sum += a[i] * b[i];
+    }
+
+    return sum;
+}
+
+static void scalar_add_ints(int64_t* dst, const int64_t* a, const int64_t* b,
+                            size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        dst[i] = static_cast<int64_t>(static_cast<uint64_t>(a[i])
+                                      + static_cast<uint64_t>(b[i]));
+    }
+}
+
+static void scalar_add_floats(double* dst, const double* a, const double* b,
+                              size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        dst[i] = a[i] + b[i];
+    }
+}
+
+static void scalar_add_scalar_ints(int64_t* dst, const int64_t* a, int64_t k,
+                                   size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        dst[i] = static_cast<int64_t>(static_cast<uint64_t>(a[i])
+                                      + static_cast<uint64_t>(k));
+    }
+}
+
+static void scalar_add_scalar_floats(double* dst, const double* a, double k,
+                                     size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        dst[i] = a[i] + k;
+    }
+}
+
+static void scalar_scale_ints(int64_t* dst, const int64_t* a, int64_t k,
+                              size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        dst[i] = static_cast<int64_t>(static_cast<uint64_t>(a[i])
+                                      * static_cast<uint64_t>(k));
+    }
+}
+
+static void scalar_scale_floats(double* dst, const double* a, double k,
+                                size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        dst[i] = a[i] * k;
+    }
+}
+
+// Every element is stored, but the count only moves past the ones that are
+// kept, so there is no branch to mispredict. The count never gets ahead of i,
+// so the stores stay inside dst.
+static size_t scalar_filter_less_ints(int64_t* dst, const int64_t* a,
+                                      int64_t limit, size_t n)
+{
+    size_t count = 0;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        dst[count] = a[i];
+        count += a[i] < limit;
+    }
+
+    return count;
+}
+
+static size_t scalar_filter_less_floats(double* dst, const double* a,
+                                        double limit, size_t n)
+{
+    size_t count = 0;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        dst[count] = a[i];
+        count += a[i] < limit;
+    }
+
+    return count;
+}
+
+static size_t scalar_argmax_ints(const int64_t* a, size_t n)
+{
+    size_t best = 0;
+
+    for (size_t i = 1; i < n; i++)
+    {
+        if (a[i] > a[best])
+        {
+            best = i;
+        }
+    }
+
+    return best;
+}
+
+static size_t scalar_argmax_floats(const double* a, size_t n)
+{
+    size_t best = 0;
+
+    for (size_t i = 1; i < n; i++)
+    {
+        if (a[i] > a[best])
+        {
+            best = i;
+        }
+    }
+
+    return best;
+}
+
+#if KERNELS_X86
+
+// SSE2 kernels, which every x86-64 CPU can run. They work on two elements at a
+// time.
+
+// Low 64 bits of the products of the 64-bit lanes of a and b, put together
+// from 32-bit multiplications, since SSE2 and AVX2 have no 64-bit one.
+static inline __m128i sse2_mul_epi64(__m128i a, __m128i b)
+{
+    __m128i low = _mm_mul_epu32(a, b);
+    __m128i cross = _mm_add_epi64(_mm_mul_epu32(_mm_srli_epi64(a, 32), b),
+                                  _mm_mul_epu32(a, _mm_srli_epi64(b, 32)));
+
+    return _mm_add_epi64(low, _mm_slli_epi64(cross, 32));
+}
+
+static inline int64_t sse2_lane_sum(__m128i v)
+{
+    alignas(16) int64_t lanes[2];
+    _mm_store_si128(reinterpret_cast<__m128i*>(lanes), v);
+
+    return static_cast<int64_t>(static_cast<uint64_t>(lanes[0])
+                                + static_cast<uint64_t>(lanes[1]));
+}
+
+static inline double sse2_lane_sum(__m128d v)
+{
+    alignas(16) double lanes[2];
+    _mm_store_pd(lanes, v);
+
+    return lanes[0] + lanes[1];
+}
+
+static int64_t sse2_sum_ints(const int64_t* a, size_t n)
+{
+    __m128i sum = _mm_setzero_si128();
+    size_t i = 0;
+
+    for (; i + 2 <= n; i += 2)
+    {
+        sum = _mm_add_epi64(sum, _mm_load_si128(
+            reinterpret_cast<const __m128i*>(a + i)));
+    }
+
+    return static_cast<int64_t>(static_cast<uint64_t>(sse2_lane_sum(sum))
+                                + scalar_sum_ints(a + i, n - i));
+}
+
+// Sums of floats are spread over two vectors, so that one addition doesn't
+// have to wait for the one before it.
+static double sse2_sum_floats(const double* a, size_t n)
+{
+    __m128d sum0 = _mm_setzero_pd();
+    __m128d sum1 = _mm_setzero_pd();
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4)
+    {
+        sum0 = _mm_add_pd(sum0, _mm_load_pd(a + i));
+        sum1 = _mm_add_pd(sum1, _mm_load_pd(a + i + 2));
+    }
+
+    return sse2_lane_sum(_mm_add_pd(sum0, sum1))
+        + scalar_sum_floats(a + i, n - i);
+}
+
+static int64_t sse2_dot_ints(const int64_t* a, const int64_t* b, size_t n)
+{
+    __m128i sum = _mm_setzero_si128();
+    size_t i = 0;
+
+    for (; i + 2 <= n; i += 2)
+    {
+        __m128i x = _mm_load_si128(reinterpret_cast<const __m128i*>(a + i));
+        __m128i y = _mm_load_si128(reinterpret_cast<const __m128i*>(b + i));
+        sum = _mm_add_epi64(sum, sse2_mul_epi64(x, y));
+    }
+
+    return static_cast<int64_t>(static_cast<uint64_t>(sse2_lane_sum(sum))
+                                + scalar_dot_ints(a + i, b + i, n - i));
+}
+
+static double sse2_dot_floats(const double* a, const double* b, size_t n)
+{
+    __m128d sum0 = _mm_setzero_pd();
+    __m128d sum1 = _mm_setzero_pd();
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4)
+    {
+        sum0 = _mm_add_pd(sum0, _mm_mul_pd(_mm_load_pd(a + i),
+                                           _mm_load_pd(b + i)));
+        sum1 = _mm_add_pd(sum1, _mm_mul_pd(_mm_load_pd(a + i + 2),
+                                           _mm_load_pd(b + i + 2)));
+    }
+
+    return sse2_lane_sum(_mm_add_pd(sum0, sum1))
+        + scalar_dot_floats(a + i, b + i, n - i);
+}
+
+static void sse2_add_ints(int64_t* dst, const int64_t* a, const int64_t* b,
+                          size_t n)
+{
+    size_t i = 0;
+
+    for (; i + 2 <= n; i += 2)
+    {
+        __m128i x = _mm_load_si128(reinterpret_cast<const __m128i*>(a + i));
+        __m128i y = _mm_load_si128(reinterpret_cast<const __m128i*>(b + i));
+        _mm_store_si128(reinterpret_cast<__m128i*>(dst + i),
+                        _mm_add_epi64(x, y));
+    }
+
+    scalar_add_ints(dst + i, a + i, b + i, n - i);
+}
+
+static void sse2_add_floats(double* dst, const double* a, const double* b,
+                            size_t n)
+{
+    size_t i = 0;
+
+    for (; i + 2 <= n; i += 2)
+    {
+        _mm_store_pd(dst + i, _mm_add_pd(_mm_load_pd(a + i),
+                                         _mm_load_pd(b + i)));
+    }
+
+    scalar_add_floats(dst + i, a + i, b + i, n - i);
+}
+
+static void sse2_add_scalar_ints(int64_t* dst, const int64_t* a, int64_t k,
+                                 size_t n)
+{
+    __m128i y = _mm_set1_epi64x(k);
+    size_t i = 0;
+
+    for (; i + 2 <= n; i += 2)
+    {
+        __m128i x = _mm_load_si128(reinterpret_cast<const __m128i*>(a + i));
+        _mm_store_si128(reinterpret_cast<__m128i*>(dst + i),
+                        _mm_add_epi64(x, y));
+    }
+
+    scalar_add_scalar_ints(dst + i, a + i, k, n - i);
+}
+
+static void sse2_add_scalar_floats(double* dst, const double* a, double k,
+                                   size_t n)
+{
+    __m128d y = _mm_set1_pd(k);
+    size_t i = 0;
+
+    for (; i + 2 <= n; i += 2)
+    {
+        _mm_store_pd(dst + i, _mm_add_pd(_mm_load_pd(a + i), y));
+    }
+
+    scalar_add_scalar_floats(dst + i, a + i, k, n - i);
+}
+
+static void sse2_scale_ints(int64_t* dst, const int64_t* a, int64_t k,
+                            size_t n)
+{
+    __m128i y = _mm_set1_epi64x(k);
+    size_t i = 0;
+
+    for (; i + 2 <= n; i += 2)
+    {
+        __m128i x = _mm_load_si128(reinterpret_cast<const __m128i*>(a + i));
+        _mm_store_si128(reinterpret_cast<__m128i*>(dst + i),
+                        sse2_mul_epi64(x, y));
+    }
+
+    scalar_scale_ints(dst + i, a + i, k, n - i);
+}
+
+static void sse2_scale_floats(double* dst, const double* a, double k,
+                              size_t n)
+{
+    __m128d y = _mm_set1_pd(k);
+    size_t i = 0;
+
+    for (; i + 2 <= n; i += 2)
+    {
+        _mm_store_pd(dst + i, _mm_mul_pd(_mm_load_pd(a + i), y));
+    }
+
+    scalar_scale_floats(dst + i, a + i, k, n - i);
+}
+
+// SSE2 can't compare 64-bit integers, so these two use the plain loops.
+
+static size_t sse2_filter_less_ints(int64_t* dst, const int64_t* a,
+                                    int64_t limit, size_t n)
+{
+    return scalar_filter_less_ints(dst, a, limit, n);
+}
+
+static size_t sse2_argmax_ints(const int64_t* a, size_t n)
+{
+    return scalar_argmax_ints(a, n);
+}
+
+// Compares a vector at a time, and then stores the elements one by one like
+// the plain loop does, with the comparison's bits deciding which are kept.
+static size_t sse2_filter_less_floats(double* dst, const double* a,
+                                      double limit, size_t n)
+{
+    __m128d y = _mm_set1_pd(limit);
+    size_t count = 0;
+    size_t i = 0;
+
+    for (; i + 2 <= n; i += 2)
+    {
+        int mask = _mm_movemask_pd(_mm_cmplt_pd(_mm_load_pd(a + i), y));
+
+        dst[count] = a[i];
+        count += mask & 1;
+        dst[count] = a[i + 1];
+        count += (mask >> 1) & 1;
+    }
+
+    return count + scalar_filter_less_floats(dst + count, a + i, limit, n - i);
+}
+
+// Finds the largest element a vector at a time, and then the first element
+// that is equal to it. If there is a NaN, the vector maximum doesn't agree
+// with the plain loop's, so the plain loop decides.
+static size_t sse2_argmax_floats(const double* a, size_t n)
+{
+    if (n < 4)
+    {
+        return scalar_argmax_floats(a, n);
+    }
+
+    __m128d best = _mm_load_pd(a);
+    __m128d nan = _mm_cmpunord_pd(best, best);
+    size_t i = 2;
+
+    for (; i + 2 <= n; i += 2)
+    {
+        __m128d x = _mm_load_pd(a + i);
+        nan = _mm_or_pd(nan, _mm_cmpunord_pd(x, x));
+        best = _mm_max_pd(best, x);
+    }
+
+    alignas(16) double lanes[2];
+    _mm_store_pd(lanes, best);
+
+    double max = lanes[0] > lanes[1] ? lanes[0] : lanes[1];
+    bool has_nan = _mm_movemask_pd(nan) != 0;
+
+    for (; i < n; i++)
+    {
+        has_nan |= a[i] != a[i];
+        max = a[i] > max ? a[i] : max;
+    }
+
+    if (has_nan)
+    {
+        return scalar_argmax_floats(a, n);
+    }
+
+    __m128d y = _mm_set1_pd(max);
+
+    for (i = 0; i + 2 <= n; i += 2)
+    {
+        int mask = _mm_movemask_pd(_mm_cmpeq_pd(_mm_load_pd(a + i), y));
+
+        if (mask != 0)
+        {
+            return i + __builtin_ctz(mask);
+        }
+    }
+
+    return n - 1;
+}
+
+// AVX2 kernels, which work on four elements at a time. They are compiled for
+// AVX2 whatever the rest of the program is compiled for, and only called once
+// the CPU has been checked for it.
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static inline __m256i avx2_mul_epi64(__m256i a, __m256i b)
+{
+    __m256i low = _mm256_mul_epu32(a, b);
+    __m256i cross = _mm256_add_epi64(
+        _mm256_mul_epu32(_mm256_srli_epi64(a, 32), b),
+        _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)));
+
+    return _mm256_add_epi64(low, _mm256_slli_epi64(cross, 32));
+}
+
+AVX2 static inline int64_t avx2_lane_sum(__m256i v)
+{
+    return static_cast<int64_t>(
+        static_cast<uint64_t>(sse2_lane_sum(_mm256_castsi256_si128(v)))
+        + static_cast<uint64_t>(sse2_lane_sum(_mm256_extracti128_si256(v, 1))));
+}
+
+AVX2 static inline double avx2_lane_sum(__m256d v)
+{
+    return sse2_lane_sum(_mm_add_pd(_mm256_castpd256_pd128(v),
+                                    _mm256_extractf128_pd(v, 1)));
+}
+
+AVX2 static int64_t avx2_sum_ints(const int64_t* a, size_t n)
+{
+    __m256i sum = _mm256_setzero_si256();
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4)
+    {
+        sum = _mm256_add_epi64(sum, _mm256_load_si256(
+            reinterpret_cast<const __m256i*>(a + i)));
+    }
+
+    return static_cast<int64_t>(static_cast<uint64_t>(avx2_lane_sum(sum))
+                                + scalar_sum_ints(a + i, n - i));
+}
+
+AVX2 static double avx2_sum_floats(const double* a, size_t n)
+{
+    __m256d sum0 = _mm256_setzero_pd();
+    __m256d sum1 = _mm256_setzero_pd();
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8)
+    {
+        sum0 = _mm256_add_pd(sum0, _mm256_load_pd(a + i));
+        sum1 = _mm256_add_pd(sum1, _mm256_load_pd(a + i + 4));
+    }
+
+    return avx2_lane_sum(_mm256_add_pd(sum0, sum1))
+        + scalar_sum_floats(a + i, n - i);
+}
+
+AVX2 static int64_t avx2_dot_ints(const int64_t* a, const int64_t* b,
+                                  size_t n)
+{
+    __m256i sum = _mm256_setzero_si256();
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256i x = _mm256_load_si256(reinterpret_cast<const __m256i*>(a + i));
+        __m256i y = _mm256_load_si256(reinterpret_cast<const __m256i*>(b + i));
+        sum = _mm256_add_epi64(sum, avx2_mul_epi64(x, y));
+    }
+
+    return static_cast<int64_t>(static_cast<uint64_t>(avx2_lane_sum(sum))
+                                + scalar_dot_ints(a + i, b + i, n - i));
+}
+
+AVX2 static double avx2_dot_floats(const double* a, const double* b,
+                                   size_t n)
+{
+    __m256d sum0 = _mm256_setzero_pd();
+    __m256d sum1 = _mm256_setzero_pd();
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8)
+    {
+        sum0 = _mm256_add_pd(sum0, _mm256_mul_pd(_mm256_load_pd(a + i),
+                                                 _mm256_load_pd(b + i)));
+        sum1 = _mm256_add_pd(sum1, _mm256_mul_pd(_mm256_load_pd(a + i + 4),
+                                                 _mm256_load_pd(b + i + 4)));
+    }
+
+    return avx2_lane_sum(_mm256_add_pd(sum0, sum1))
+        + scalar_dot_floats(a + i, b + i, n - i);
+}
+
+AVX2 static void avx2_add_ints(int64_t* dst, const int64_t* a,
+                               const int64_t* b, size_t n)
+{
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256i x = _mm256_load_si256(reinterpret_cast<const __m256i*>(a + i));
+        __m256i y = _mm256_load_si256(reinterpret_cast<const __m256i*>(b + i));
+        _mm256_store_si256(reinterpret_cast<__m256i*>(dst + i),
+                           _mm256_add_epi64(x, y));
+    }
+
+    scalar_add_ints(dst + i, a + i, b + i, n - i);
+}
+
+AVX2 static void avx2_add_floats(double* dst, const double* a,
+                                 const double* b, size_t n)
+{
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4)
+    {
+        _mm256_store_pd(dst + i, _mm256_add_pd(_mm256_load_pd(a + i),
+                                               _mm256_load_pd(b + i)));
+    }
+
+    scalar_add_floats(dst + i, a + i, b + i, n - i);
+}
+
+AVX2 static void avx2_add_scalar_ints(int64_t* dst, const int64_t* a,
+                                      int64_t k, size_t n)
+{
+    __m256i y = _mm256_set1_epi64x(k);
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256i x = _mm256_load_si256(reinterpret_cast<const __m256i*>(a + i));
+        _mm256_store_si256(reinterpret_cast<__m256i*>(dst + i),
+                           _mm256_add_epi64(x, y));
+    }
+
+    scalar_add_scalar_ints(dst + i, a + i, k, n - i);
+}
+
+AVX2 static void avx2_add_scalar_floats(double* dst, const double* a,
+                                        double k, size_t n)
+{
+    __m256d y = _mm256_set1_pd(k);
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4)
+    {
+        _mm256_store_pd(dst + i, _mm256_add_pd(_mm256_load_pd(a + i), y));
+    }
+
+    scalar_add_scalar_floats(dst + i, a + i, k, n - i);
+}
+
+AVX2 static void avx2_scale_ints(int64_t* dst, const int64_t* a, int64_t k,
+                                 size_t n)
+{
+    __m256i y = _mm256_set1_epi64x(k);
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256i x = _mm256_load_si256(reinterpret_cast<const __m256i*>(a + i));
+        _mm256_store_si256(reinterpret_cast<__m256i*>(dst + i),
+                           avx2_mul_epi64(x, y));
+    }
+
+    scalar_scale_ints(dst + i, a + i, k, n - i);
+}
+
+AVX2 static void avx2_scale_floats(double* dst, const double* a, double k,
+                                   size_t n)
+{
+    __m256d y = _mm256_set1_pd(k);
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4)
+    {
+        _mm256_store_pd(dst + i, _mm256_mul_pd(_mm256_load_pd(a + i), y));
+    }
+
+    scalar_scale_floats(dst + i, a + i, k, n - i);
+}
+
+// Stores the four elements at a like the plain loop does, keeping the ones
+// whose bit is set in mask.
+static inline size_t compress4(int64_t* dst, const int64_t* a, int mask)
+{
+    size_t count = 0;
+
+    for (int j = 0; j < 4; j++)
+    {
+        dst[count] = a[j];
+        count += (mask >> j) & 1;
+    }
+
+    return count;
+}
+
+static inline size_t compress4(double* dst, const double* a, int mask)
+{
+    size_t count = 0;
+
+    for (int j = 0; j < 4; j++)
+    {
+        dst[count] = a[j];
+        count += (mask >> j) & 1;
+    }
+
+    return count;
+}
+
+AVX2 static size_t avx2_filter_less_ints(int64_t* dst, const int64_t* a,
+                                         int64_t limit, size_t n)
+{
+    __m256i y = _mm256_set1_epi64x(limit);
+    size_t count = 0;
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256i x = _mm256_load_si256(reinterpret_cast<const __m256i*>(a + i));
+        int mask = _mm256_movemask_pd(
+            _mm256_castsi256_pd(_mm256_cmpgt_epi64(y, x)));
+
+        count += compress4(dst + count, a + i, mask);
+    }
+
+    return count + scalar_filter_less_ints(dst + count, a + i, limit, n - i);
+}
+
+AVX2 static size_t avx2_filter_less_floats(double* dst, const double* a,
+                                           double limit, size_t n)
+{
+    __m256d y = _mm256_set1_pd(limit);
+    size_t count = 0;
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4)
+    {
+        int mask = _mm256_movemask_pd(
+            _mm256_cmp_pd(_mm256_load_pd(a + i), y, _CMP_LT_OQ));
+
+        count += compress4(dst + count, a + i, mask);
+    }
+
+    return count + scalar_filter_less_floats(dst + count, a + i, limit, n - i);
+}
+
+AVX2 static size_t avx2_argmax_ints(const int64_t* a, size_t n)
+{
+    if (n < 8)
+    {
+        return scalar_argmax_ints(a, n);
+    }
+
+    __m256i best = _mm256_load_si256(reinterpret_cast<const __m256i*>(a));
+    size_t i = 4;
+
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256i x = _mm256_load_si256(reinterpret_cast<const __m256i*>(a + i));
+        best = _mm256_blendv_epi8(best, x, _mm256_cmpgt_epi64(x, best));
+    }
+
+    alignas(32) int64_t lanes[4];
+    _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), best);
+
+    int64_t max = lanes[0];
+
+    for (int j = 1; j < 4; j++)
+    {
+        max = lanes[j] > max ? lanes[j] : max;
+    }
+
+    for (; i < n; i++)
+    {
+        max = a[i] > max ? a[i] : max;
+    }
+
+    __m256i y = _mm256_set1_epi64x(max);
+
+    for (i = 0; i + 4 <= n; i += 4)
+    {
+        __m256i x = _mm256_load_si256(reinterpret_cast<const __m256i*>(a + i));
+        int mask = _mm256_movemask_pd(
+            _mm256_castsi256_pd(_mm256_cmpeq_epi64(x, y)));
+
+        if (mask != 0)
+        {
+            return i + __builtin_ctz(mask);
+        }
+    }
+
+    while (a[i] != max)
+    {
+        i++;
+    }
+
+    return i;
+}
+
+AVX2 static size_t avx2_argmax_floats(const double* a, size_t n)
+{
+    if (n < 8)
+    {
+        return scalar_argmax_floats(a, n);
+    }
+
+    __m256d best = _mm256_load_pd(a);
+    __m256d nan = _mm256_cmp_pd(best, best, _CMP_UNORD_Q);
+    size_t i = 4;
+
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256d x = _mm256_load_pd(a + i);
+        nan = _mm256_or_pd(nan, _mm256_cmp_pd(x, x, _CMP_UNORD_Q));
+        best = _mm256_max_pd(best, x);
+    }
+
+    alignas(32) double lanes[4];
+    _mm256_store_pd(lanes, best);
+
+    double max = lanes[0];
+    bool has_nan = _mm256_movemask_pd(nan) != 0;
+
+    for (int j = 1; j < 4; j++)
+    {
+        max = lanes[j] > max ? lanes[j] : max;
+    }
+
+    for (; i < n; i++)
+    {
+        has_nan |= a[i] != a[i];
+        max = a[i] > max ? a[i] : max;
+    }
+
+    if (has_nan)
+    {
+        return scalar_argmax_floats(a, n);
+    }
+
+    __m256d y = _mm256_set1_pd(max);
+
+    for (i = 0; i + 4 <= n; i += 4)
+    {
+        int mask = _mm256_movemask_pd(
+            _mm256_cmp_pd(_mm256_load_pd(a + i), y, _CMP_EQ_OQ));
+
+        if (mask != 0)
+        {
+            return i + __builtin_ctz(mask);
+        }
+    }
+
+    while (a[i] != max)
+    {
+        i++;
+    }
+
+    return i;
+}
+
+static bool has_avx2()
+{
+    static const bool avx2 = (__builtin_cpu_init(),
+                              __builtin_cpu_supports("avx2"));
+    return avx2;
+}
+
+// Calls the AVX2 version of a kernel if the CPU supports it, and the SSE2 one
+// otherwise.
+#define DISPATCH(kernel, ...)                                           \
+    (has_avx2() ? avx2_##kernel(__VA_ARGS__) : sse2_##kernel(__VA_ARGS__))
+
+#else
+
+#define DISPATCH(kernel, ...) scalar_##kernel(__VA_ARGS__)
+
+#endif
+
+int64_t sum_ints(const int64_t* a, size_t n)
+{
+    return DISPATCH(sum_ints, a, n);
+}
+
+double sum_floats(const double* a, size_t n)
+{
+    return DISPATCH(sum_floats, a, n);
+}
+
+int64_t dot_ints(const int64_t* a, const int64_t* b, size_t n)
+{
+    return DISPATCH(dot_ints, a, b, n);
+}
+
+double dot_floats(const double* a, const double* b, size_t n)
+{
+    return DISPATCH(dot_floats, a, b, n);
+}
+
+void add_ints(int64_t* dst, const int64_t* a, const int64_t* b, size_t n)
+{
+    DISPATCH(add_ints, dst, a, b, n);
+}
+
+void add_floats(double* dst, const double* a, const double* b, size_t n)
+{
+    DISPATCH(add_floats, dst, a, b, n);
+}
+
+void add_scalar_ints(int64_t* dst, const int64_t* a, int64_t k, size_t n)
+{
+    DISPATCH(add_scalar_ints, dst, a, k, n);
+}
+
+void add_scalar_floats(double* dst, const double* a, double k, size_t n)
+{
+    DISPATCH(add_scalar_floats, dst, a, k, n);
+}
+
+void scale_ints(int64_t* dst, const int64_t* a, int64_t k, size_t n)
+{
+    DISPATCH(scale_ints, dst, a, k, n);
+}
+
+void scale_floats(double* dst, const double* a, double k, size_t n)
+{
+    DISPATCH(scale_floats, dst, a, k, n);
+}
+
+size_t filter_less_ints(int64_t* dst, const int64_t* a, int64_t limit,
+                        size_t n)
+{
+    return DISPATCH(filter_less_ints, dst, a, limit, n);
+}
+
+size_t filter_less_floats(double* dst, const double* a, double limit,
+                          size_t n)
+{
+    return DISPATCH(filter_less_floats, dst, a, limit, n);
+}
+
+size_t argmax_ints(const int64_t* a, size_t n)
+{
+    return DISPATCH(argmax_ints, a, n);
+}
+
+size_t argmax_floats(const double* a, size_t n)
+{
+    return DISPATCH(argmax_floats, a, n);
+}
+
+const char* kernel_isa()
+{
+#if KERNELS_X86
+    return has_avx2() ? "avx2" : "sse2";
+#else
+    return "scalar";
+#endif
+}
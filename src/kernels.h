@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Numeric kernels that the array builtins run on. Each one works on n
+// contiguous elements, and picks the widest vector instructions the machine
+// supports when it is called: AVX2 if the CPU has it, SSE2 on any other x86-64
+// machine, and plain loops everywhere else. Every pointer has to be aligned to
+// 32 bytes, as the buffers of arrays are. Integer arithmetic wraps around at
+// 64 bits. Float sums are accumulated in several lanes at once, so they can
+// differ in the last bits from adding the elements up one by one.
+
+int64_t sum_ints(const int64_t* a, size_t n);
+double sum_floats(const double* a, size_t n);
+
+int64_t dot_ints(const int64_t* a, const int64_t* b, size_t n);
+double dot_floats(const double* a, const double* b, size_t n);
+
+// dst[i] = a[i] + b[i]
+void add_ints(int64_t* dst, const int64_t* a, const int64_t* b, size_t n);
+void add_floats(double* dst, const double* a, const double* b, size_t n);
+
+// dst[i] = a[i] + k
+void add_scalar_ints(int64_t* dst, const int64_t* a, int64_t k, size_t n);
+void add_scalar_floats(double* dst, const double* a, double k, size_t n);
+
+// dst[i] = a[i] * k
+void scale_ints(int64_t* dst, const int64_t* a, int64_t k, size_t n);
+void scale_floats(double* dst, const double* a, double k, size_t n);
+
+// Copies the elements of a that are less than limit to dst, in order, and
+// returns how many there were. dst must have room for n elements.
+size_t filter_less_ints(int64_t* dst, const int64_t* a, int64_t limit,
+                        size_t n);
+size_t filter_less_floats(double* dst, const double* a, double limit,
+                          size_t n);
+
+// Index of the first largest element, where n is at least 1. This is what a
+// loop that keeps the first element greater than every one before it finds,
+// so a NaN never replaces the largest element so far, and once it is the
+// largest element so far nothing replaces it.
+size_t argmax_ints(const int64_t* a, size_t n);
+size_t argmax_floats(const double* a, size_t n);
+
+// Instruction set the kernels use on this machine: "avx2", "sse2" or
+// "scalar".
+const char* kernel_isa();
@@ -5,11 +5,11 @@
 #include "lexer.h"
 
 #include <iostream>
-#include <memory>
-#include <string>
+#include <string_view>
 #include <vector>
 
 #include "error.h"
+#include "symbols.h"
 
 inline bool is_alpha(char c)
 {
@@ -37,123 +37,79 @@ inline bool is_punctuation(char c)
         || c == ']' || c == '{' || c == '}';
 }
 
-// Returns whether the lexer has processed the entire stream. This happens when
-// idx is pushed beyond the length of the actual stream.
-inline bool TextHandle::done()
-{
-    return idx >= stream.length();
-}
-
-// If the stream is not done, returns the character at stream_idx. Otherwise,
-// returns -1 (an invalid character).
-char TextHandle::cur_char()
-{
-    if (!done())
-    {
-        return stream[idx];
-    }
-
-    return -1;
-}
-
-// Peeks at the character directly after current character of the TextHandle. If
-// reading this character would cause an out-of-bounds violation (i.e. there are
-// no more characters left), returns -1.
-char TextHandle::peek()
+// Skips over whitespace characters until a non-whitespace character is
+// encountered.
+void TextHandle::skip_whitespace()
 {
-    if (idx + 1 < stream.length())
+    while (is_whitespace(cur_char()))
     {
-        return stream[idx + 1];
+        advance_char();
     }
-
-    return -1;
 }
 
-// If the lexer has not processed the entire stream yet, advances the
-// TextHandle's idx to the next character, incrementing the current column
-// number. If idx ends on a newline sequence (i.e. the character \n or the
-// sequence \r\n), advance_char() skips over the newline and adjusts the line
-// and column numbers accordingly.
-void TextHandle::advance_char()
+// Starts a token of the given type at the current position. Its length is
+// filled in by end_token() once the lexer has moved past its last character.
+inline Token begin_token(TextHandle& t, TokenType type)
 {
-    char cur = cur_char();
-    
-    if (!done())
-    {
-        idx++;
-        col_num++;
-
-        if (cur == '\n' || (cur == '\r' && peek() == '\n'))
-        {
-            // If we went over to the next line, reset col_num to 1
-	    // and increment line_num.
-            col_num = 1;
-            line_num++;
-        }
-    }
+    Token token;
+    token.type = type;
+    token.offset = t.idx;
+    token.length = 0;
+    token.id = 0;
+    return token;
 }
 
-// Skips over whitespace characters until a non-whitespace character is
-// encountered.
-void TextHandle::skip_whitespace()
+inline Token end_token(TextHandle& t, Token token)
 {
-    while (is_whitespace(cur_char()))
-    {
-        advance_char();
-    }
+    token.length = t.idx - token.offset;
+    return token;
 }
 
 // Returns a token that is not a literal. These can be tokens like "+", ">=",
 // "variable-name", etc. The lexer does not validate the names of the tokens, as
 // that is done later.
-std::shared_ptr<Token> get_symbol(TextHandle& t)
+Token get_symbol(TextHandle& t)
 {
-    auto token = std::make_shared<Token>();
-    token->col_num = t.col_num;
-    token->line_num = t.line_num;
-    token->stream = &t.stream;
-    
-    std::string str;
+    Token token = begin_token(t, TokenType::Symbol);
 
     // Don't need to check for out of bounds since cur_char just
     // returns -1 once we've reached the end of the stream.
     while (!is_whitespace(t.cur_char()) && !t.done()
            && !is_punctuation(t.cur_char()))
     {
-        str += t.cur_char();
         t.advance_char();
     }
 
-    token->string_value = str;
+    token = end_token(t, token);
+
+    std::string_view str = token.text(t.stream);
 
     // TODO: formatting?
-    token->type = (str == "true" || str == "false")
-        ? TokenType::BoolLiteral
-        : TokenType::Symbol;
+    if (str == "true" || str == "false")
+    {
+        token.type = TokenType::BoolLiteral;
+    }
+    else
+    {
+        token.id = symbols().intern(str);
+    }
 
     return token;
 }
 
 // Returns a token for a numeric literal (like 123, 3.14, or their negative
 // counterparts).
-std::shared_ptr<Token> get_numeric_literal(TextHandle& t)
+Token get_numeric_literal(TextHandle& t)
 {
-    auto token = std::make_shared<Token>();
-    token->col_num = t.col_num;
-    token->line_num = t.line_num;
-    token->stream = &t.stream;
-    std::string num_literal;
-    bool is_float_literal = false;
+    Token token = begin_token(t, TokenType::IntLiteral);
 
     if (t.cur_char() == '-')
     {
-        num_literal += t.cur_char();
         t.advance_char();
     }
 
     while (is_numeric(t.cur_char()))
     {
-        num_literal += t.cur_char();
         t.advance_char();
     }
 
@@ -161,41 +117,31 @@ std::shared_ptr<Token> get_numeric_literal(TextHandle& t)
     // literal.
     if (t.cur_char() == '.' && is_numeric(t.peek()))
     {
-        is_float_literal = true;
-        num_literal += t.cur_char();
+        token.type = TokenType::FloatLiteral;
         t.advance_char();
     }
 
     else if (t.cur_char() == '.' && !is_numeric(t.peek()))
     {
-        err_token(token, "decimals in the form of 'x.' are not allowed");
+        err_token(t.stream, end_token(t, token),
+                  "decimals in the form of 'x.' are not allowed");
     }
 
     // Add the decimal part, if it exists.
     while (is_numeric(t.cur_char()))
     {
-        num_literal += t.cur_char();
         t.advance_char();
     }
-    
-    token->string_value = num_literal;
-    token->type = is_float_literal
-        ? TokenType::FloatLiteral
-        : TokenType::IntLiteral;
 
-    return token;
+    return end_token(t, token);
 }
 
 // Returns a token for "punctuation". This is a catch-all term for tokens that
 // are not symbols or literals.
-std::shared_ptr<Token> get_punctuation(TextHandle& t)
+Token get_punctuation(TextHandle& t)
 {
-    auto token = std::make_shared<Token>();
-    token->col_num = t.col_num;
-    token->line_num = t.line_num;
-    token->stream = &t.stream;
-    token->string_value += t.cur_char();
-    token->type = TokenType::Punctuation;
+    Token token = begin_token(t, TokenType::Punctuation);
+    token.length = 1;
 
     switch (t.cur_char())
     {
@@ -209,7 +155,7 @@ std::shared_ptr<Token> get_punctuation(TextHandle& t)
         case ']':
             break;
         default:
-            err_token(token, "unrecognized character");
+            err_token(t.stream, token, "unrecognized character");
             break;
     }
     
@@ -217,102 +163,139 @@ std::shared_ptr<Token> get_punctuation(TextHandle& t)
     return token;
 }
 
-// Returns a token for a string literal, like "Hello".
-std::shared_ptr<Token> get_string_literal(TextHandle& t)
+// Returns a token for a string literal, like "Hello". The token's text
+// includes the quotes.
+Token get_string_literal(TextHandle& t)
 {
-    auto token = std::make_shared<Token>();
-    token->col_num = t.col_num;
-    token->line_num = t.line_num;
-    token->stream = &t.stream;
-    std::string str_literal;
-
-    str_literal += t.cur_char();
+    Token token = begin_token(t, TokenType::StrLiteral);
     t.advance_char();
 
     while (t.cur_char() != '"' && !t.done())
     {
-        str_literal += t.cur_char();
         t.advance_char();
     }
 
-    // Add in closing quote, if it exists:
+    // Include the closing quote, if it exists:
     if (t.cur_char() == '"')
     {
-        str_literal += t.cur_char();
         t.advance_char();
     }
     
     else
     {
         // No matching quote
-        err_token(token, "no matching quote");
+        err_token(t.stream, end_token(t, token), "no matching quote");
     }
 
-    token->type = TokenType::StrLiteral;;
-    token->string_value = str_literal;
-    return token;
+    return end_token(t, token);
 }
 
-// Tokenizes the string in a TextHandle into a token list.
-std::deque<std::shared_ptr<Token>> tokenize(TextHandle& t)
-{    
-    std::deque<std::shared_ptr<Token>> tokens;
-
-    while (!t.done())
+// Lexes the next token in the stream into token, skipping over whitespace and
+// comments. Returns false if the stream ends before another token does.
+bool next_token(TextHandle& t, Token& token)
+{
+    for (;;)
     {
-        // Case for negative numbers:
-        if (t.cur_char() == '-' && (t.peek() == '.' || is_numeric(t.peek())))
-        {
-            tokens.push_back(get_numeric_literal(t));
-        }
+        t.skip_whitespace();
 
-        else if (is_numeric(t.cur_char())
-                 || (t.cur_char() == '.' && is_numeric(t.peek())))
+        if (t.done())
         {
-            tokens.push_back(get_numeric_literal(t));
+            return false;
         }
 
-        // Beginning of a string literal
-        else if (t.cur_char() == '"')
+        // Comments. We'll just skip the rest of the line here.
+        if (t.cur_char() != ';')
         {
-            tokens.push_back(get_string_literal(t));
+            break;
         }
 
-        // Comments. We'll just skip the rest of the line here.
-        else if (t.cur_char() == ';')
+        while (t.cur_char() != '\r' && t.cur_char() != '\n' && !t.done())
         {
-            t.advance_char(); // skip over ;
-            while (t.cur_char() != '\r' && t.cur_char() != '\n' && !t.done())
-            {
-                t.advance_char();
-            }
-            
-            if (t.cur_char() == '\n')
-            {
-                t.advance_char();
-            }
-            
-            else if (t.cur_char() == '\r' && t.peek() == '\n')
-            {
-                t.advance_char();
-                t.advance_char();
-            }
+            t.advance_char();
         }
+    }
+
+    // Case for negative numbers:
+    if (t.cur_char() == '-' && (t.peek() == '.' || is_numeric(t.peek())))
+    {
+        token = get_numeric_literal(t);
+    }
+
+    else if (is_numeric(t.cur_char())
+             || (t.cur_char() == '.' && is_numeric(t.peek())))
+    {
+        token = get_numeric_literal(t);
+    }
+
+    // Beginning of a string literal
+    else if (t.cur_char() == '"')
+    {
+        token = get_string_literal(t);
+    }
+
+    // Everything else is assumed to be punctuation
+    else if (is_punctuation(t.cur_char()))
+    {
+        token = get_punctuation(t);
+    }
+
+    else
+    {
+        token = get_symbol(t);
+    }
 
-        // Everything else is assumed to be punctuation
-        else if (is_punctuation(t.cur_char()))
+    return true;
+}
+
+// Tokenizes the string in a TextHandle into a token list. The tokens refer to
+// the handle's stream rather than copying out of it.
+TokenList tokenize(TextHandle& t)
+{
+    TokenList tokens;
+    tokens.source = t.stream;
+
+    // Most tokens are at least a few characters apart, so this is usually
+    // enough to never have to grow the array.
+    tokens.tokens.reserve(t.stream.length() / 4 + 1);
+
+    Token token;
+
+    while (next_token(t, token))
+    {
+        tokens.tokens.push_back(token);
+    }
+
+    return tokens;
+}
+
+// Replaces the contents of tokens with the tokens of the next top-level form in
+// the stream, which ends where its opening parenthesis is closed. Returns false
+// if there are no tokens left. The lexer never looks past the end of the form,
+// so a large file can be run without ever holding all of its tokens.
+bool tokenize_form(TextHandle& t, TokenList& tokens)
+{
+    tokens.source = t.stream;
+    tokens.tokens.clear();
+    tokens.next = 0;
+
+    int depth = 0;
+    Token token;
+
+    while (next_token(t, token))
+    {
+        tokens.tokens.push_back(token);
+
+        if (token.type == TokenType::Punctuation)
         {
-            tokens.push_back(get_punctuation(t));
+            char c = t.stream[token.offset];
+            depth += c == '(' ? 1 : c == ')' ? -1 : 0;
         }
 
-        else
+        if (depth <= 0)
         {
-            tokens.push_back(get_symbol(t));
+            break;
         }
-
-        // Skip whitespace characters
-        t.skip_whitespace();
     }
 
-    return tokens;
+    return tokens.tokens.size() > 0;
 }
@@ -1,31 +1,75 @@
 #pragma once
 
-#include <deque>
-#include <memory>
-#include <string>
-#include <unordered_map>
+#include <string_view>
 #include <vector>
 
 #include "token.h"
 
 // A TextHandle bundles together a stream (a program represented as a string)
-// and a current position within that string.
+// and a current position within that string. It only views the stream, which
+// has to outlive the handle and every token lexed from it.
 struct TextHandle
 {
-    unsigned int idx = 0;
-    unsigned int line_num = 1;
-    unsigned int col_num = 1;
+    uint32_t idx = 0;
 
-    std::string stream;
+    std::string_view stream;
 
-    TextHandle(std::string& stream) : stream(stream) {}
+    TextHandle(std::string_view stream) : stream(stream) {}
+
+    inline bool done() const
+    {
+        return idx >= stream.length();
+    }
+
+    // Returns the character at idx, or -1 (an invalid character) if the
+    // stream is done.
+    inline char cur_char() const
+    {
+        return done() ? -1 : stream[idx];
+    }
+
+    // Returns the character after the current one, or -1 if there is none.
+    inline char peek() const
+    {
+        return idx + 1 < stream.length() ? stream[idx + 1] : -1;
+    }
+
+    inline void advance_char()
+    {
+        idx++;
+    }
 
-    bool done();
-    char cur_char();
-    char peek();
-    void advance_char();
     void skip_whitespace();
 };
 
-std::deque<std::shared_ptr<Token>> tokenize(TextHandle& t);
+// Every token of a source text, in order, along with the position of the next
+// one the parser hasn't consumed yet.
+struct TokenList
+{
+    std::string_view source;
+    std::vector<Token> tokens;
+    size_t next = 0;
+
+    inline bool done() const
+    {
+        return next >= tokens.size();
+    }
+
+    inline const Token& front() const
+    {
+        return tokens[next];
+    }
+
+    inline void pop_front()
+    {
+        next++;
+    }
+
+    inline std::string_view text(const Token& token) const
+    {
+        return token.text(source);
+    }
+};
 
+TokenList tokenize(TextHandle& t);
+bool tokenize_form(TextHandle& t, TokenList& tokens);
@@ -0,0 +1,288 @@
+#include "map.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "array.h"
+#include "processor.h"
+#include "register_processor.h"
+#include "str.h"
+
+#if defined(__SSE2__)
+#define MAP_SSE2 1
+#include <emmintrin.h>
+#else
+#define MAP_SSE2 0
+#endif
+
+// A map grows once more than this many eighths of its slots are full.
+#define MAP_MAX_LOAD 7
+
+[[noreturn]] static void map_error(const std::string& message)
+{
+    printf("ERROR: %s\n", message.c_str());
+    exit(-1);
+}
+
+static Map* expect_map(Value value, const char* builtin)
+{
+    if (value.type() != ValueType::Map)
+    {
+        map_error(std::string(builtin) + " expects a map, but got "
+                  + value.to_string());
+    }
+
+    return value.as<Map*>();
+}
+
+// The finalizer of MurmurHash3, which spreads every bit of x over the whole
+// result.
+static inline uint64_t mix(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb53fe1a85a53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+// A key being looked up. A long string is found by its bytes and the hash
+// that its interned flat string has, whether or not it is that string. An
+// object that has been moved out of the region is found as its heap copy,
+// and one that is still in it can't be in any map.
+struct Key
+{
+    Value value;
+    uint64_t hash;
+
+    // Set for long strings that aren't flat.
+    bool by_bytes = false;
+    std::string_view bytes;
+    std::string storage;
+
+    Key(Value key) : value(resolve_forwarded(key))
+    {
+        if (value.type() != ValueType::Str || value.is_short_string())
+        {
+            hash = mix(value.bits);
+            return;
+        }
+
+        auto string = value.as<String*>();
+
+        if (string->kind == StringKind::Flat)
+        {
+            hash = mix(static_cast<FlatString*>(string)->hash);
+            return;
+        }
+
+        by_bytes = true;
+        bytes = string_bytes(value, storage);
+        hash = mix(hash_chars(bytes));
+    }
+
+    // Whether a stored key is this one.
+    inline bool matches(Value key) const
+    {
+        if (!by_bytes)
+        {
+            return key.bits == value.bits;
+        }
+
+        if (key.type() != ValueType::Str || key.is_short_string())
+        {
+            return false;
+        }
+
+        auto flat = static_cast<FlatString*>(key.as<String*>());
+        return flat->length == bytes.size()
+            && std::memcmp(flat->chars(), bytes.data(), bytes.size()) == 0;
+    }
+};
+
+// The 7 bits of a hash that go in the control byte, and the rest, which picks
+// the group that probing starts at.
+static inline int8_t control_bits(uint64_t hash)
+{
+    return hash & 0x7f;
+}
+
+static inline size_t group_bits(uint64_t hash)
+{
+    return hash >> 7;
+}
+
+// Bit i of the result is set if control byte i of a group is byte.
+static inline uint32_t match(const int8_t* group, int8_t byte)
+{
+#if MAP_SSE2
+    __m128i control = _mm_loadu_si128(reinterpret_cast<const __m128i*>(group));
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(control, _mm_set1_epi8(byte)));
+#else
+    uint32_t bits = 0;
+
+    for (int i = 0; i < MAP_GROUP_SIZE; i++)
+    {
+        bits |= static_cast<uint32_t>(group[i] == byte) << i;
+    }
+
+    return bits;
+#endif
+}
+
+// The groups are probed in triangular order, which visits each of them once
+// when there is a power of two of them.
+static MapSlot* find(Map* map, const Key& key)
+{
+    size_t mask = map->capacity / MAP_GROUP_SIZE - 1;
+    size_t group = group_bits(key.hash) & mask;
+    int8_t bits = control_bits(key.hash);
+
+    for (size_t step = 1;; step++)
+    {
+        const int8_t* control = map->control() + group * MAP_GROUP_SIZE;
+        MapSlot* slots = map->slots() + group * MAP_GROUP_SIZE;
+
+        for (uint32_t hits = match(control, bits); hits != 0;
+             hits &= hits - 1)
+        {
+            MapSlot* slot = &slots[__builtin_ctz(hits)];
+
+            if (key.matches(slot->key))
+            {
+                return slot;
+            }
+        }
+
+        if (match(control, MAP_EMPTY) != 0)
+        {
+            return nullptr;
+        }
+
+        group = (group + step) & mask;
+    }
+}
+
+// Puts an entry that isn't in the map yet into the first empty slot along its
+// key's probe sequence. There has to be one.
+static void insert(Map* map, Value key, uint64_t hash, Value value)
+{
+    size_t mask = map->capacity / MAP_GROUP_SIZE - 1;
+    size_t group = group_bits(hash) & mask;
+
+    for (size_t step = 1;; step++)
+    {
+        int8_t* control = map->control() + group * MAP_GROUP_SIZE;
+        uint32_t empty = match(control, MAP_EMPTY);
+
+        if (empty != 0)
+        {
+            int i = __builtin_ctz(empty);
+
+            control[i] = control_bits(hash);
+            map->slots()[group * MAP_GROUP_SIZE + i] = { key, value };
+            map->count++;
+            return;
+        }
+
+        group = (group + step) & mask;
+    }
+}
+
+// Moves every entry into a table twice as big.
+static void grow(Map* map)
+{
+    uint32_t old_capacity = map->capacity;
+    int8_t* old_control = map->control();
+    MapSlot* old_slots = map->slots();
+    unsigned char* old_table = map->table;
+
+    map->capacity *= 2;
+    map->count = 0;
+    map->table = static_cast<unsigned char*>(
+        ::operator new(Map::table_size(map->capacity)));
+    std::memset(map->table, MAP_EMPTY, map->capacity);
+
+    for (size_t i = 0; i < old_capacity; i++)
+    {
+        if (old_control[i] != MAP_EMPTY)
+        {
+            Key key(old_slots[i].key);
+            insert(map, old_slots[i].key, key.hash, old_slots[i].value);
+        }
+    }
+
+    ::operator delete(old_table);
+}
+
+Value map_get(Value m, Value key)
+{
+    MapSlot* slot = find(expect_map(m, "get"), Key(key));
+    return slot != nullptr ? slot->value : Value();
+}
+
+Value map_has(Value m, Value key)
+{
+    return Value(find(expect_map(m, "has?"), Key(key)) != nullptr);
+}
+
+Value map_count(Value m)
+{
+    if (m.type() == ValueType::Map)
+    {
+        return Value(static_cast<int>(m.as<Map*>()->count));
+    }
+
+    if (m.type() != ValueType::Array && m.type() != ValueType::Str)
+    {
+        map_error("count expects a map, an array or a string, but got "
+                  + m.to_string());
+    }
+
+    return array_length(m);
+}
+
+template <typename Proc>
+Value map_new(Proc& proc)
+{
+    return Value(allocate_map(proc));
+}
+
+template <typename Proc>
+Value map_put(Proc& proc, Value m, Value key, Value value)
+{
+    Map* map = expect_map(m, "put");
+
+    // Objects are hashed by their address, so the key has to be where it is
+    // going to stay before it is hashed.
+    key = to_heap(proc, key);
+    value = to_heap(proc, value);
+
+    Key lookup(key);
+    MapSlot* slot = find(map, lookup);
+
+    if (slot != nullptr)
+    {
+        slot->value = value;
+        return m;
+    }
+
+    if (8 * (map->count + 1) > MAP_MAX_LOAD * map->capacity)
+    {
+        grow(map);
+        map_grown(proc, map->capacity / 2, map->capacity);
+    }
+
+    insert(map, lookup.by_bytes ? string_intern(proc, key) : key, lookup.hash,
+           value);
+    return m;
+}
+
+#define INSTANTIATE_MAP_BUILTINS(Proc)                                  \
+    template Value map_new(Proc&);                                      \
+    template Value map_put(Proc&, Value, Value, Value);
+
+INSTANTIATE_MAP_BUILTINS(Processor)
+INSTANTIATE_MAP_BUILTINS(RegisterProcessor)
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "environment.h"
+
+// The map builtins, on values. Both backends run each of them from a single
+// instruction. Keys are equal if they are the same value, or strings with the
+// same bytes, so 1 and 1.0 are different keys, while a string key is found
+// however it was made. Each builtin errors out if it gets something that isn't
+// a map where it expects one. They are defined in map.cpp.
+
+// (get m key) is the value of key in m, or nil if it has none.
+Value map_get(Value m, Value key);
+
+// (has? m key)
+Value map_has(Value m, Value key);
+
+// (count m) is the number of entries in a map, or the length of an array or a
+// string.
+Value map_count(Value m);
+
+// The builtins that allocate go through the processor they get, with its
+// allocate_map(), and move whatever they put in a map to the heap with its
+// to_heap(). They never collect, and are instantiated for both processors.
+
+// (hash-map) is a new, empty map.
+template <typename Proc>
+Value map_new(Proc& proc);
+
+// (put m key value) sets the value of key in m, and gives m back, so that puts
+// can be chained.
+template <typename Proc>
+Value map_put(Proc& proc, Value m, Value key, Value value);
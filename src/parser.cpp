@@ -1,9 +1,9 @@
 #include "parser.h"
 
-#include <deque>
 #include <iostream>
 #include <memory>
 #include <string>
+#include <string_view>
 
 #include "ast.h"
 #include "error.h"
@@ -12,24 +12,23 @@
 
 // Expect the next token in the stream to have a particular string as its
 // contents. If not, fail with an error on the token.
-void expect_token_string(std::string str,
-                         std::deque<std::shared_ptr<Token>> &tokens)
+void expect_token_string(std::string_view str, TokenList& tokens)
 {
 
-    if (tokens.size() == 0)
+    if (tokens.done())
     {
         printf("Unexpected EOF at end of file\n");
         exit(-1);
     }
     
     auto& token = tokens.front();
-    if (token->string_value != str)
+    if (tokens.text(token) != str)
     {
-        err_token(token,
+        err_token(tokens.source, token,
                   "syntax error: expected '"
-                  + str
+                  + std::string(str)
                   + "', but got '"
-                  + token->string_value
+                  + std::string(tokens.text(token))
                   + "' ");
     }
 
@@ -38,39 +37,39 @@ void expect_token_string(std::string str,
 
 // Expect the next token in the stream to have a particular type. If not, fail
 // with an error on the token.
-void expect_token_type(TokenType type,
-                       std::deque<std::shared_ptr<Token>> &tokens)
+void expect_token_type(TokenType type, TokenList& tokens)
 {
 
-    if (tokens.size() == 0)
+    if (tokens.done())
     {
         printf("Unexpected EOF at end of file\n");
         exit(-1);
     }
 
-    auto token = tokens.front();
+    auto& token = tokens.front();
 
-    if (tokens.front()->type != type)
+    if (token.type != type)
     {
         switch (type)
         {
         case TokenType::Symbol:
-            err_token(token, "expected a symbol");
+            err_token(tokens.source, token, "expected a symbol");
             break;
         case TokenType::Punctuation:
-            err_token(token, "expected '(', ')', '[', ']', '{', or '{'");
+            err_token(tokens.source, token,
+                      "expected '(', ')', '[', ']', '{', or '{'");
             break;
         case TokenType::IntLiteral:
-            err_token(token, "expected an integer literal");
+            err_token(tokens.source, token, "expected an integer literal");
             break;
         case TokenType::FloatLiteral:
-            err_token(token, "expected a float literal");
+            err_token(tokens.source, token, "expected a float literal");
             break;
         case TokenType::StrLiteral:
-            err_token(token, "expected a string literal");
+            err_token(tokens.source, token, "expected a string literal");
             break;
         case TokenType::BoolLiteral:
-            err_token(token, "expected a boolean literal");
+            err_token(tokens.source, token, "expected a boolean literal");
             break;
         }
     }
@@ -80,17 +79,23 @@ void expect_token_type(TokenType type,
 
 // Parse an s-expression from the token stream. An expression (for
 // now) is anything that is enclosed by parentheses.
-std::unique_ptr<AST> parse_expr(std::deque<std::shared_ptr<Token>>& tokens)
+std::unique_ptr<AST> parse_expr(TokenList& tokens)
 {
+    if (tokens.done())
+    {
+        printf("Unexpected EOF at end of file\n");
+        exit(-1);
+    }
 
-    auto ast = std::make_unique<AST>(ASTType::Expr, tokens.front());
+    auto ast = std::make_unique<AST>(ASTType::Expr, tokens.front(),
+                                     tokens.source);
     expect_token_string("(", tokens);
 
-    while (tokens.size() > 0 && tokens.front()->string_value != ")")
+    while (!tokens.done() && tokens.text(tokens.front()) != ")")
     {
-        auto front = tokens.front();
+        const Token& front = tokens.front();
 
-        switch (front->type)
+        switch (front.type)
         {
         case (TokenType::Symbol):
             ast->add_leaf_child(ASTType::Symbol, front);
@@ -113,13 +118,14 @@ std::unique_ptr<AST> parse_expr(std::deque<std::shared_ptr<Token>>& tokens)
             expect_token_type(TokenType::BoolLiteral, tokens);
             break;
         default:
-            if (front->string_value == "(")
+            if (tokens.text(front) == "(")
             {
                 ast->children.push_back(parse_expr(tokens));
             }
             else
             {
-                err_token(front, "internal parser error: unhandled token type");
+                err_token(tokens.source, front,
+                          "internal parser error: unhandled token type");
             }
         }
     }
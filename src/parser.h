@@ -1,11 +1,9 @@
 #pragma once
 
-#include <deque>
-#include <unordered_map>
-#include <vector>
+#include <memory>
 
 #include "ast.h"
+#include "lexer.h"
 #include "token.h"
 
-std::unique_ptr<AST>
-parse_expr(std::deque<std::shared_ptr<Token>>& tokens);
+std::unique_ptr<AST> parse_expr(TokenList& tokens);
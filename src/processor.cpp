@@ -1,280 +1,1433 @@
 #include "processor.h"
 
+#include <algorithm>
+#include <chrono>
+#include <functional>
 #include <memory>
+#include <type_traits>
 
+#include "array.h"
 #include "environment.h"
+#include "map.h"
+#include "str.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PROFILE_RDTSC 1
+#include <x86intrin.h>
+#else
+#define PROFILE_RDTSC 0
+#endif
 
 #define INST_ENTRY(id, fun) (jump_table[(unsigned long) id] = fun)
 
+// Instruction handlers.
+//
+// Every handler is written once, as an inline function that receives the
+// instruction pointer and the stack pointer by reference. The jump table wraps
+// each handler in a function that loads these from the processor and stores
+// them back afterwards. The threaded interpreter in run_threaded() instead
+// inlines every handler into a single function, where ip and sp are locals
+// that the compiler can keep in registers for the whole run.
+//
+// GCC stops inlining into run_threaded() once it has grown by a certain
+// amount, and any handler it leaves out of line has the addresses of ip and
+// sp, which sends both to memory for the whole loop. The generic arithmetic
+// handlers and create_closure() are the first ones it gives up on, so they
+// are forced inline.
+#if defined(__GNUC__)
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+inline void push(Value*& sp, Value value)
+{
+    *sp++ = value;
+}
+
+inline Value pop(Value*& sp)
+{
+    return *--sp;
+}
+
 // Pushes an integer onto the stack.
-void push_int(Processor &proc)
+inline void push_int(Processor&, unsigned char*& ip, Value*& sp)
 {
-    proc.ip += sizeof(Instruction);
-    
-    int i = mem_get<int>(proc.ip);
-    proc.stack.push_back(std::make_shared<Value>(i));
-    proc.ip += sizeof(int);
+    ip += sizeof(Instruction);
+
+    int i = mem_get<int>(ip);
+    push(sp, Value(i));
+    ip += sizeof(int);
 }
 
-void push_ref(Processor &proc)
+// Pushes a float onto the stack. Floats are stored in the value itself, so
+// this never allocates.
+inline void push_float(Processor&, unsigned char*& ip, Value*& sp)
 {
-    proc.ip += sizeof(Instruction);
-    
-    int var_index = mem_get<int>(proc.ip);
-    proc.stack.push_back(proc.envs.back()[var_index]);
-    proc.ip += sizeof(int);
+    ip += sizeof(Instruction);
+
+    double d = mem_get<double>(ip);
+    push(sp, Value(d));
+    ip += sizeof(double);
 }
 
-void store(Processor &proc)
+// Pushes a constant of the running function, or of the top-level code, which
+// is made once when the code is compiled.
+inline void push_const(Processor& proc, unsigned char*& ip, Value*& sp)
 {
-    proc.ip += sizeof(Instruction);
-    int var = mem_get<int>(proc.ip);
+    int index = mem_get<int>(ip + sizeof(Instruction));
+    auto& constants = proc.closure != nullptr ? proc.closure->proto->constants
+                                              : proc.constants;
 
-    auto value = proc.stack.back();
-    
-    // If we are storing a closure, then the closure also needs to
-    // receive a copy of itself in its environment.
-    if (value->type == ValueType::Closure)
-    {
-        auto closure = value->as<std::shared_ptr<Closure>>();
-        closure->env[var] = value;
-    }
-    
-    proc.envs.back()[var] = proc.stack.back();
-    proc.stack.pop_back();
-    proc.ip += sizeof(int);
+    push(sp, constants[index]);
+    ip += sizeof(Instruction) + sizeof(int);
+}
+
+inline void push_true(Processor&, unsigned char*& ip, Value*& sp)
+{
+    ip += sizeof(Instruction);
+    push(sp, Value(true));
+}
+
+inline void push_false(Processor&, unsigned char*& ip, Value*& sp)
+{
+    ip += sizeof(Instruction);
+    push(sp, Value(false));
+}
+
+inline void push_ref(Processor &proc, unsigned char*& ip, Value*& sp)
+{
+    ip += sizeof(Instruction);
+
+    int slot = mem_get<int>(ip);
+    push(sp, proc.base[slot]);
+    ip += sizeof(int);
+}
+
+inline void push_global(Processor &proc, unsigned char*& ip, Value*& sp)
+{
+    ip += sizeof(Instruction);
+
+    int index = mem_get<int>(ip);
+    push(sp, proc.globals[index]);
+    ip += sizeof(int);
 }
 
-void jmp(Processor &proc)
+inline void push_capture(Processor &proc, unsigned char*& ip, Value*& sp)
 {
-    int offset = mem_get<int>(proc.ip + sizeof(Instruction));
-    proc.ip += offset;
+    ip += sizeof(Instruction);
+
+    int index = mem_get<int>(ip);
+    push(sp, proc.closure->captures()[index]);
+    ip += sizeof(int);
+}
+
+inline void push_self(Processor &proc, unsigned char*& ip, Value*& sp)
+{
+    ip += sizeof(Instruction);
+    push(sp, Value(proc.closure));
+}
+
+inline void store(Processor &proc, unsigned char*& ip, Value*& sp)
+{
+    ip += sizeof(Instruction);
+
+    int slot = mem_get<int>(ip);
+    proc.base[slot] = pop(sp);
+    ip += sizeof(int);
+}
+
+inline void store_global(Processor &proc, unsigned char*& ip, Value*& sp)
+{
+    ip += sizeof(Instruction);
+
+    int index = mem_get<int>(ip);
+    proc.globals[index] = pop(sp);
+    ip += sizeof(int);
 }
 
-void jmp_true(Processor &proc)
+inline void jmp(Processor&, unsigned char*& ip, Value*&)
 {
-    bool is_true = proc.pop_as<bool>();
-    int offset = mem_get<int>(proc.ip + sizeof(Instruction));
-    
+    int offset = mem_get<int>(ip + sizeof(Instruction));
+    ip += offset;
+}
+
+inline void jmp_true(Processor&, unsigned char*& ip, Value*& sp)
+{
+    bool is_true = pop(sp).as<bool>();
+    int offset = mem_get<int>(ip + sizeof(Instruction));
+
     if (is_true)
     {
-        proc.ip += offset;
+        ip += offset;
         return;
     }
-    proc.ip += sizeof(Instruction) + sizeof(int);
+    ip += sizeof(Instruction) + sizeof(int);
 }
 
-void jmp_false(Processor &proc)
+inline void jmp_false(Processor&, unsigned char*& ip, Value*& sp)
 {
-    bool is_true = proc.pop_as<bool>();
-    int offset = mem_get<int>(proc.ip + sizeof(Instruction));
+    bool is_true = pop(sp).as<bool>();
+    int offset = mem_get<int>(ip + sizeof(Instruction));
 
     if (!is_true)
     {
-        proc.ip += offset;
+        ip += offset;
         return;
     }
 
-    proc.ip += sizeof(Instruction) + sizeof(int);
+    ip += sizeof(Instruction) + sizeof(int);
 }
 
-void call(Processor &proc)
+// Called when a function gets a different number of arguments than it has
+// parameters. That is only an error if it isn't variadic or got too few.
+static void check_variadic_arity(FunctionProto* proto, int n_args)
 {
-    // Push the ip after the call instruction onto the call stack:
-    proc.call_stack.push_back(proc.ip + sizeof(Instruction) + sizeof(int));
+    if (proto->last_param_variadic && n_args > proto->n_args)
+    {
+        return;
+    }
+
+    printf("ERROR: %s expects %s%d arguments, but got %d\n",
+           proto->name.c_str(), proto->last_param_variadic ? "at least " : "",
+           proto->n_args, n_args);
+    exit(-1);
+}
 
-    // Move ip to the first byte of the argument
-    proc.ip += sizeof(Instruction);
+// Kept out of line, so that the check in enter() and tail_enter() doesn't stop
+// them from being inlined.
+[[noreturn]] static void stack_overflow()
+{
+    printf("ERROR: Stack overflow\n");
+    exit(-1);
+}
 
-    // Get index of the function we're calling
-    int var_index = mem_get<int>(proc.ip);
+// Jumps into a closure whose n_args arguments are on top of the stack. The
+// arguments become the first slots of the new frame, and the rest of its slots
+// are pushed as nil. ret_ip is where the closure returns to.
+inline void enter(Processor &proc, unsigned char*& ip, Value*& sp,
+                  Closure* closure, int n_args, unsigned char* ret_ip)
+{
+    FunctionProto* proto = closure->proto;
 
-    if (proc.envs.back().find(var_index) == proc.envs.back().end())
+    if (n_args != proto->n_args)
     {
-        printf("No entry for %d in current environment\n", var_index);
+        check_variadic_arity(proto, n_args);
+    }
+
+    // Make sure there is enough room left on the stack for the frame and for
+    // the body to evaluate its expressions. A variadic function can get more
+    // arguments than its frame has slots.
+    if (sp - n_args - proc.stack.get() + std::max(n_args, proto->frame_size)
+        + proto->max_stack > PROC_STACK_SIZE)
+    {
+        stack_overflow();
+    }
+
+    proc.call_stack.push_back({ ret_ip, proc.base, proc.closure });
+
+    proc.base = sp - n_args;
+    proc.closure = closure;
+
+    for (int i = n_args; i < proto->frame_size; i++)
+    {
+        push(sp, Value());
+    }
+
+    ip = proto->entry;
+}
+
+// Jumps into a closure whose n_args arguments are on top of the stack, reusing
+// the current frame. The arguments are moved down to the start of the frame,
+// and everything else in it is discarded. The call stack is left alone, so the
+// closure returns to whoever called the current function.
+inline void tail_enter(Processor &proc, unsigned char*& ip, Value*& sp,
+                       Closure* closure, int n_args)
+{
+    FunctionProto* proto = closure->proto;
+
+    if (n_args != proto->n_args)
+    {
+        check_variadic_arity(proto, n_args);
+    }
+
+    if (proc.base - proc.stack.get() + std::max(n_args, proto->frame_size)
+        + proto->max_stack > PROC_STACK_SIZE)
+    {
+        stack_overflow();
+    }
+
+    Value* args = sp - n_args;
+
+    for (int i = 0; i < n_args; i++)
+    {
+        proc.base[i] = args[i];
+    }
+
+    sp = proc.base + n_args;
+    proc.closure = closure;
+
+    for (int i = n_args; i < proto->frame_size; i++)
+    {
+        push(sp, Value());
+    }
+
+    ip = proto->entry;
+}
+
+// Returns the closure stored in a global, or errors out if there is none.
+inline Closure* global_closure(Processor &proc, int index)
+{
+    Value callee = proc.globals[index];
+
+    if (callee.type() != ValueType::Closure)
+    {
+        printf("ERROR: Global %d is not a function\n", index);
         exit(-1);
     }
-    
-    auto closure = proc.envs.back()[var_index]->as<std::shared_ptr<Closure>>();
-    
-    // Create a new environment (invokes copy constructor):
-    proc.envs.push_back(closure->env);
-    proc.ip = closure->instructions;
+
+    return callee.as<Closure*>();
+}
+
+inline void call(Processor &proc, unsigned char*& ip, Value*& sp)
+{
+    int index = mem_get<int>(ip + sizeof(Instruction));
+    int n_args = mem_get<int>(ip + sizeof(Instruction) + sizeof(int));
+
+    enter(proc, ip, sp, global_closure(proc, index), n_args,
+          ip + sizeof(Instruction) + 2 * sizeof(int));
+}
+
+inline void call_pop(Processor &proc, unsigned char*& ip, Value*& sp)
+{
+    int n_args = mem_get<int>(ip + sizeof(Instruction));
+    auto closure = pop(sp).as<Closure*>();
+
+    enter(proc, ip, sp, closure, n_args, ip + sizeof(Instruction) + sizeof(int));
+}
+
+inline void tail_call(Processor &proc, unsigned char*& ip, Value*& sp)
+{
+    int index = mem_get<int>(ip + sizeof(Instruction));
+    int n_args = mem_get<int>(ip + sizeof(Instruction) + sizeof(int));
+
+    tail_enter(proc, ip, sp, global_closure(proc, index), n_args);
+}
+
+inline void tail_call_pop(Processor &proc, unsigned char*& ip, Value*& sp)
+{
+    int n_args = mem_get<int>(ip + sizeof(Instruction));
+    auto closure = pop(sp).as<Closure*>();
+
+    tail_enter(proc, ip, sp, closure, n_args);
 }
 
-void call_pop(Processor &proc)
+// Collects garbage if it is due, before an instruction allocates. Whatever
+// the instruction works on has to still be on the stack.
+inline void collect_if_due(Processor& proc, Value* sp)
 {
-    // Push the ip after the call instruction onto the call stack
-    proc.call_stack.push_back(proc.ip + sizeof(Instruction));
-    
-    auto closure = proc.pop_as<std::shared_ptr<Closure>>();
-    proc.envs.push_back(closure->env);
-    proc.ip = closure->instructions;
+    if (proc.should_collect() && !proc.use_region)
+    {
+        proc.sp = sp;
+        proc.collect(false);
+    }
 }
 
-void create_closure(Processor& proc)
+ALWAYS_INLINE void create_closure(Processor& proc, unsigned char*& ip, Value*& sp)
 {
-    // offset denotes how many bytes from the beginning of this instruction the
-    // processor would have to jump backwards to get to the first code byte in
-    // the closure. Essentially, offset denotes the size of the bytecode in the
-    // closure.
-    proc.ip += sizeof(Instruction);
-    
-    int offset = mem_get<int>(proc.ip);
-    proc.ip += sizeof(int);
-    
-    unsigned char* code_begin = proc.ip - sizeof(Instruction) - sizeof(int) - offset;
+    int index = mem_get<int>(ip + sizeof(Instruction));
+    FunctionProto* proto = proc.protos[index].get();
+
+    // The captured values are still on the stack here, so they survive.
+    collect_if_due(proc, sp);
 
-    auto closure = std::make_shared<Closure>();
-    std::memcpy(closure->instructions, code_begin, offset);
-    
-    closure->env = proc.envs.back();
-    closure->inst_size = offset;
+    auto closure = proc.allocate<Closure>(Closure::size(proto), proto);
 
-    Value v;
-    v.type = ValueType::Closure;
-    v.value = closure;
+    // The captured values were pushed in order, so the first one is deepest.
+    sp -= proto->n_captures;
+    std::copy(sp, sp + proto->n_captures, closure->captures());
 
-    proc.stack.push_back(std::make_shared<Value>(v));
+    push(sp, Value(closure));
+    ip += sizeof(Instruction) + sizeof(int);
 }
 
-void ret(Processor &proc)
+// Pops the current frame and everything above it, and leaves the value on top
+// of the stack as the call's result. A body that didn't leave anything above
+// its frame returns nil.
+inline void ret(Processor &proc, unsigned char*& ip, Value*& sp)
 {
     if (proc.call_stack.size() == 0)
     {
         printf("ERROR: No return address on call stack\n");
         exit(-1);
     }
-    
-    unsigned char* ret_ip = proc.call_stack.back();
+
+    Value* frame_end = proc.base + proc.closure->proto->frame_size;
+    Value result = sp > frame_end ? sp[-1] : Value();
+
+    sp = proc.base;
+    push(sp, result);
+
+    ReturnAddress& ret_addr = proc.call_stack.back();
+
+    ip = ret_addr.ip;
+    proc.base = ret_addr.base;
+    proc.closure = ret_addr.closure;
+
     proc.call_stack.pop_back();
-    
-    proc.ip = ret_ip;
-    proc.envs.pop_back();
 }
 
-void add(Processor &proc)
+// Quickening. Arithmetic and comparisons are compiled to generic
+// instructions, which look at the types of their operands. Once one has seen
+// two integers or two floats it overwrites its own opcode with its Int or
+// Float variant, which only has to check that its operands still have those
+// types. If they don't, the variant turns itself back into the generic
+// instruction and leaves ip where it is, so the generic one runs next and
+// handles them. Mixed integer and float operands stay on the generic path.
+
+// Applies operation to the second value from the top and the top value.
+template <template <typename> class Operation>
+ALWAYS_INLINE void binary(Processor&, unsigned char*& ip, Value*& sp)
+{
+    Value a = sp[-1];
+    Value b = sp[-2];
+    auto inst = static_cast<Instruction>(*ip);
+
+    if (Value::both_int(a, b))
+    {
+        *ip = static_cast<unsigned char>(int_instruction(inst));
+    }
+    else if (a.is_float() && b.is_float())
+    {
+        *ip = static_cast<unsigned char>(float_instruction(inst));
+    }
+
+    sp--;
+    sp[-1] = apply_binary<Operation>(b, a);
+    ip += sizeof(Instruction);
+}
+
+template <template <typename> class Operation>
+inline void int_binary(Processor&, unsigned char*& ip, Value*& sp)
+{
+    Value a = sp[-1];
+    Value b = sp[-2];
+
+    if (!Value::both_int(a, b))
+    {
+        *ip = static_cast<unsigned char>(
+            generic_instruction(static_cast<Instruction>(*ip)));
+        return;
+    }
+
+    sp--;
+    sp[-1] = Value(int_operation<Operation>(b.as_int(), a.as_int()));
+    ip += sizeof(Instruction);
+}
+
+template <template <typename> class Operation>
+inline void float_binary(Processor&, unsigned char*& ip, Value*& sp)
 {
-    proc.ip += sizeof(Instruction);
-    
-    int a = proc.pop_as<int>();
-    int b = proc.pop_as<int>();
-    proc.stack.push_back(std::make_shared<Value>(b + a));
+    Value a = sp[-1];
+    Value b = sp[-2];
+
+    if (!a.is_float() || !b.is_float())
+    {
+        *ip = static_cast<unsigned char>(
+            generic_instruction(static_cast<Instruction>(*ip)));
+        return;
+    }
+
+    sp--;
+    sp[-1] = Value(Operation<double>()(b.as_float(), a.as_float()));
+    ip += sizeof(Instruction);
 }
 
-void sub(Processor &proc)
+inline void neg(Processor&, unsigned char*& ip, Value*& sp)
 {
-    proc.ip += sizeof(Instruction);
-    
-    int a = proc.pop_as<int>();
-    int b = proc.pop_as<int>();
-    proc.stack.push_back(std::make_shared<Value>(b - a));
+    ip += sizeof(Instruction);
+
+    Value a = pop(sp);
+    push(sp, a.is_int() ? Value(-a.as_int()) : Value(-a.as_number()));
 }
 
-void mul(Processor &proc)
+// Applies one of the reductions in processor.h to the values on top of the
+// stack.
+template <Value (*reduction)(const Value*, int)>
+inline void reduce(Processor &proc, unsigned char*& ip, Value*& sp)
 {
-    proc.ip += sizeof(Instruction);
-    
-    int a = proc.pop_as<int>();
-    int b = proc.pop_as<int>();
-    proc.stack.push_back(std::make_shared<Value>(a * b));
+    int n = mem_get<int>(ip + sizeof(Instruction));
+
+    if (n == 0)
+    {
+        n = sp - proc.base;
+    }
+
+    sp -= n;
+    sp[0] = reduction(sp, n);
+    sp++;
+
+    ip += sizeof(Instruction) + sizeof(int);
 }
 
-void div(Processor &proc)
+// Array builtins. The ones that make a new array collect first, while their
+// arguments are still on the stack.
+
+// Makes a value out of a number of values, like the reductions take them.
+template <Value (*op)(Processor&, const Value*, int)>
+inline void make_from(Processor &proc, unsigned char*& ip, Value*& sp)
 {
-    proc.ip += sizeof(Instruction);
-    
-    int a = proc.pop_as<int>();
-    int b = proc.pop_as<int>();
-    proc.stack.push_back(std::make_shared<Value>(b / a));
+    int n = mem_get<int>(ip + sizeof(Instruction));
+
+    if (n == 0)
+    {
+        n = sp - proc.base;
+    }
+
+    collect_if_due(proc, sp);
+
+    sp -= n;
+    sp[0] = op(proc, sp, n);
+    sp++;
+
+    ip += sizeof(Instruction) + sizeof(int);
 }
 
-void neg(Processor &proc)
+template <Value (*op)(Value)>
+inline void array_unary(Processor&, unsigned char*& ip, Value*& sp)
 {
-    proc.ip += sizeof(Instruction);
-    
-    int a = proc.pop_as<int>();
-    proc.stack.push_back(std::make_shared<Value>(-a));
+    sp[-1] = op(sp[-1]);
+    ip += sizeof(Instruction);
 }
 
-void eq(Processor &proc)
+template <Value (*op)(Value, Value)>
+inline void array_binary(Processor&, unsigned char*& ip, Value*& sp)
 {
-    proc.ip += sizeof(Instruction);
-    
-    int a = proc.pop_as<int>();
-    int b = proc.pop_as<int>();
-    proc.stack.push_back(std::make_shared<Value>(a == b));
+    Value b = pop(sp);
+    sp[-1] = op(sp[-1], b);
+    ip += sizeof(Instruction);
 }
 
-void greater(Processor &proc)
+inline void range(Processor &proc, unsigned char*& ip, Value*& sp)
 {
-    proc.ip += sizeof(Instruction);
-    
-    int a = proc.pop_as<int>();
-    int b = proc.pop_as<int>();
-    proc.stack.push_back(std::make_shared<Value>(b > a));
+    collect_if_due(proc, sp);
+    sp[-1] = array_range(proc, sp[-1]);
+    ip += sizeof(Instruction);
 }
 
-void greater_eq(Processor &proc)
+template <Value (*op)(Processor&, Value, Value)>
+inline void array_build(Processor &proc, unsigned char*& ip, Value*& sp)
 {
-    proc.ip += sizeof(Instruction);
-    
-    int a = proc.pop_as<int>();
-    int b = proc.pop_as<int>();
-    proc.stack.push_back(std::make_shared<Value>(b >= a));
+    collect_if_due(proc, sp);
+
+    Value b = pop(sp);
+    sp[-1] = op(proc, sp[-1], b);
+    ip += sizeof(Instruction);
 }
 
-void less(Processor &proc)
+template <Value (*op)(Processor&, Value, Value, Value)>
+inline void build3(Processor &proc, unsigned char*& ip, Value*& sp)
 {
-    proc.ip += sizeof(Instruction);
-    
-    int a = proc.pop_as<int>();
-    int b = proc.pop_as<int>();
-    proc.stack.push_back(std::make_shared<Value>(b < a));
+    collect_if_due(proc, sp);
+
+    sp -= 2;
+    sp[-1] = op(proc, sp[-1], sp[0], sp[1]);
+    ip += sizeof(Instruction);
 }
 
-void less_eq(Processor &proc)
+inline void make_map(Processor &proc, unsigned char*& ip, Value*& sp)
 {
-    proc.ip += sizeof(Instruction);
-    
-    int a = proc.pop_as<int>();
-    int b = proc.pop_as<int>();
-    proc.stack.push_back(std::make_shared<Value>(b <= a));
+    collect_if_due(proc, sp);
+    push(sp, map_new(proc));
+    ip += sizeof(Instruction);
+}
+
+// A comparison followed by a JmpFalse. Superinstructions aren't quickened, but
+// they check for integers first, which is what they nearly always get.
+template <template <typename> class Compare>
+inline void cmp_jmp_false(Processor&, unsigned char*& ip, Value*& sp)
+{
+    Value a = pop(sp);
+    Value b = pop(sp);
+    bool result = Value::both_int(a, b)
+        ? Compare<int>()(b.as_int(), a.as_int())
+        : apply_binary<Compare>(b, a).as_bool();
+
+    if (!result)
+    {
+        ip += mem_get<int>(ip + sizeof(Instruction));
+        return;
+    }
+
+    ip += sizeof(Instruction) + sizeof(int);
+}
+
+// PushRef, PushInt, a comparison and a JmpFalse. Nothing is pushed or popped.
+template <template <typename> class Compare>
+inline void ref_int_cmp_jmp_false(Processor &proc, unsigned char*& ip, Value*&)
+{
+    int slot = mem_get<int>(ip + sizeof(Instruction));
+    int i = mem_get<int>(ip + sizeof(Instruction) + sizeof(int));
+    Value a = proc.base[slot];
+    bool result = a.is_int() ? Compare<int>()(a.as_int(), i)
+                             : apply_binary<Compare>(a, Value(i)).as_bool();
+
+    if (!result)
+    {
+        ip += mem_get<int>(ip + sizeof(Instruction) + 2 * sizeof(int));
+        return;
+    }
+
+    ip += sizeof(Instruction) + 3 * sizeof(int);
+}
+
+// PushRef, PushInt and an arithmetic operation.
+template <template <typename> class Operation>
+inline void ref_int_op(Processor &proc, unsigned char*& ip, Value*& sp)
+{
+    ip += sizeof(Instruction);
+
+    int slot = mem_get<int>(ip);
+    int i = mem_get<int>(ip + sizeof(int));
+    Value a = proc.base[slot];
+    push(sp, a.is_int() ? Value(int_operation<Operation>(a.as_int(), i))
+                        : apply_binary<Operation>(a, Value(i)));
+
+    ip += 2 * sizeof(int);
+}
+
+// Every implemented instruction along with its handler. Both the jump table and
+// the threaded interpreter are generated from this list, so a new instruction
+// only has to be added here.
+#define INSTRUCTIONS(X)                                                 \
+    X(PushInt, push_int)                                                \
+    X(PushConst, push_const)                                            \
+    X(PushFloat, push_float)                                            \
+    X(PushTrue, push_true)                                              \
+    X(PushFalse, push_false)                                            \
+    X(PushRef, push_ref)                                                \
+    X(PushGlobal, push_global)                                          \
+    X(PushCapture, push_capture)                                        \
+    X(PushSelf, push_self)                                              \
+    X(Store, store)                                                     \
+    X(StoreGlobal, store_global)                                        \
+    X(Add, binary<std::plus>)                                           \
+    X(Sub, binary<std::minus>)                                          \
+    X(Mul, binary<std::multiplies>)                                     \
+    X(Div, binary<std::divides>)                                        \
+    X(Neg, neg)                                                         \
+    X(Min, binary<minimum>)                                             \
+    X(Max, binary<maximum>)                                             \
+    X(AddN, reduce<fold_values<std::plus>>)                             \
+    X(MulN, reduce<fold_values<std::multiplies>>)                       \
+    X(MinN, reduce<fold_values<minimum>>)                               \
+    X(MaxN, reduce<fold_values<maximum>>)                               \
+    X(AndN, reduce<all_true>)                                           \
+    X(OrN, reduce<any_true>)                                            \
+    X(EqN, reduce<chain_values<std::equal_to>>)                         \
+    X(GreaterN, reduce<chain_values<std::greater>>)                     \
+    X(GreaterEqN, reduce<chain_values<std::greater_equal>>)             \
+    X(LessN, reduce<chain_values<std::less>>)                           \
+    X(LessEqN, reduce<chain_values<std::less_equal>>)                   \
+    X(IntArray, make_from<array_of_values<ElementType::Int>>)           \
+    X(FloatArray, make_from<array_of_values<ElementType::Float>>)       \
+    X(Range, range)                                                     \
+    X(Length, array_unary<array_length>)                                \
+    X(At, array_binary<array_at>)                                       \
+    X(Sum, array_unary<array_sum>)                                      \
+    X(Dot, array_binary<array_dot>)                                     \
+    X(MapAdd, array_build<array_map_add<Processor>>)                    \
+    X(Scale, array_build<array_scale<Processor>>)                       \
+    X(FilterLess, array_build<array_filter_less<Processor>>)            \
+    X(ArgMax, array_unary<array_argmax>)                                \
+    X(Concat, make_from<string_concat<Processor>>)                      \
+    X(Substring, build3<string_substring<Processor>>)                   \
+    X(MakeMap, make_map)                                                \
+    X(MapGet, array_binary<map_get>)                                    \
+    X(MapPut, build3<map_put<Processor>>)                               \
+    X(MapHas, array_binary<map_has>)                                    \
+    X(Count, array_unary<map_count>)                                    \
+    X(Jmp, jmp)                                                         \
+    X(JmpTrue, jmp_true)                                                \
+    X(JmpFalse, jmp_false)                                              \
+    X(Call, call)                                                       \
+    X(CallPop, call_pop)                                                \
+    X(TailCall, tail_call)                                              \
+    X(TailCallPop, tail_call_pop)                                       \
+    X(CreateClosure, create_closure)                                    \
+    X(Ret, ret)                                                         \
+    X(Eq, binary<std::equal_to>)                                        \
+    X(Greater, binary<std::greater>)                                    \
+    X(GreaterEq, binary<std::greater_equal>)                            \
+    X(Less, binary<std::less>)                                          \
+    X(LessEq, binary<std::less_equal>)                                  \
+    X(EqJmpFalse, cmp_jmp_false<std::equal_to>)                         \
+    X(GreaterJmpFalse, cmp_jmp_false<std::greater>)                     \
+    X(GreaterEqJmpFalse, cmp_jmp_false<std::greater_equal>)             \
+    X(LessJmpFalse, cmp_jmp_false<std::less>)                           \
+    X(LessEqJmpFalse, cmp_jmp_false<std::less_equal>)                   \
+    X(RefIntEqJmpFalse, ref_int_cmp_jmp_false<std::equal_to>)           \
+    X(RefIntGreaterJmpFalse, ref_int_cmp_jmp_false<std::greater>)       \
+    X(RefIntGreaterEqJmpFalse,                                          \
+      ref_int_cmp_jmp_false<std::greater_equal>)                        \
+    X(RefIntLessJmpFalse, ref_int_cmp_jmp_false<std::less>)             \
+    X(RefIntLessEqJmpFalse,                                             \
+      ref_int_cmp_jmp_false<std::less_equal>)                           \
+    X(RefIntAdd, ref_int_op<std::plus>)                                 \
+    X(RefIntSub, ref_int_op<std::minus>)                                \
+    X(IntEq, int_binary<std::equal_to>)                                 \
+    X(IntGreater, int_binary<std::greater>)                             \
+    X(IntGreaterEq, int_binary<std::greater_equal>)                     \
+    X(IntLess, int_binary<std::less>)                                   \
+    X(IntLessEq, int_binary<std::less_equal>)                           \
+    X(IntAdd, int_binary<std::plus>)                                    \
+    X(IntSub, int_binary<std::minus>)                                   \
+    X(IntMul, int_binary<std::multiplies>)                              \
+    X(IntDiv, int_binary<std::divides>)                                 \
+    X(FloatEq, float_binary<std::equal_to>)                             \
+    X(FloatGreater, float_binary<std::greater>)                         \
+    X(FloatGreaterEq, float_binary<std::greater_equal>)                 \
+    X(FloatLess, float_binary<std::less>)                               \
+    X(FloatLessEq, float_binary<std::less_equal>)                       \
+    X(FloatAdd, float_binary<std::plus>)                                \
+    X(FloatSub, float_binary<std::minus>)                               \
+    X(FloatMul, float_binary<std::multiplies>)                          \
+    X(FloatDiv, float_binary<std::divides>)
+
+[[noreturn]] void unknown_instruction(unsigned char* ip)
+{
+    printf("ERROR: Unknown instruction %d\n", *ip);
+    exit(-1);
+}
+
+// Adapts an inline handler to the signature of the jump table.
+template <void (*handler)(Processor&, unsigned char*&, Value*&)>
+void table_entry(Processor &proc)
+{
+    handler(proc, proc.ip, proc.sp);
+}
+
+void table_unknown(Processor &proc)
+{
+    unknown_instruction(proc.ip);
+}
+
+// Runs until we hit a 0 byte, making one indirect call through the jump table
+// per instruction.
+void Processor::run_table()
+{
+    while (*ip)
+    {
+        unsigned char inst = *ip;
+        jump_table[inst](*this);
+    }
+}
+
+// Runs until we hit a 0 byte. With GCC and Clang this uses computed gotos, so
+// every handler ends in its own indirect jump to the next one. Other compilers
+// get a switch in a loop, which at least keeps ip and sp in registers.
+void Processor::run_threaded()
+{
+    unsigned char* ip = this->ip;
+    Value* sp = this->sp;
+
+#if defined(__GNUC__)
+    void* labels[256];
+
+    for (auto& label : labels)
+    {
+        label = &&unknown;
+    }
+
+    labels[0] = &&done;
+
+#define LABEL_ENTRY(id, fun) labels[(unsigned long) Instruction::id] = &&op_##id;
+    INSTRUCTIONS(LABEL_ENTRY)
+#undef LABEL_ENTRY
+
+    goto *labels[*ip];
+
+#define LABEL_BODY(id, fun)                     \
+    op_##id:                                    \
+    fun(*this, ip, sp);                         \
+    goto *labels[*ip];
+    INSTRUCTIONS(LABEL_BODY)
+#undef LABEL_BODY
+
+#else
+    for (;;)
+    {
+        switch (static_cast<Instruction>(*ip))
+        {
+#define CASE_BODY(id, fun)                      \
+        case Instruction::id:                                           \
+            fun(*this, ip, sp);                                         \
+            break;
+            INSTRUCTIONS(CASE_BODY)
+#undef CASE_BODY
+        default:
+            if (*ip == 0)
+            {
+                goto done;
+            }
+
+            goto unknown;
+        }
+    }
+#endif
+
+unknown:
+    unknown_instruction(ip);
+
+done:
+    this->ip = ip;
+    this->sp = sp;
+}
+
+const char* instruction_name(unsigned char inst)
+{
+    switch (static_cast<Instruction>(inst))
+    {
+#define NAME_CASE(id, fun)                                              \
+    case Instruction::id:                                               \
+        return #id;
+        INSTRUCTIONS(NAME_CASE)
+#undef NAME_CASE
+    default:
+        return "?";
+    }
+}
+
+static inline uint64_t read_ticks()
+{
+#if PROFILE_RDTSC
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// Dispatches through the jump table, counting every instruction before it
+// runs and timing one in PROFILE_SAMPLE_INTERVAL of them. Going through the
+// table rather than inlining the handlers once more keeps the compiler from
+// moving any of them out of run_threaded(). The counting is what makes this
+// loop slower than the others, so the ticks are only comparable to each
+// other, not to a run that isn't being profiled.
+void Processor::run_profiled()
+{
+    Profile& profile = *this->profile;
+
+    profile.last = 0;
+
+    if (profile.n_dispatched == 0)
+    {
+        profile.clock_overhead = UINT64_MAX;
+
+        for (int i = 0; i < 1000; i++)
+        {
+            uint64_t start = read_ticks();
+            profile.clock_overhead = std::min(profile.clock_overhead,
+                                              read_ticks() - start);
+        }
+    }
+
+    while (*ip)
+    {
+        unsigned char inst = *ip;
+        bool timed = ++profile.n_dispatched % PROFILE_SAMPLE_INTERVAL == 0;
+        uint64_t start = timed ? read_ticks() : 0;
+
+        profile.counts[inst]++;
+        profile.pairs[profile.last][inst]++;
+        profile.last = inst;
+
+        jump_table[inst](*this);
+
+        if (timed)
+        {
+            uint64_t elapsed = read_ticks() - start;
+            profile.ticks[inst] += elapsed - std::min(elapsed,
+                                                      profile.clock_overhead);
+            profile.samples[inst]++;
+        }
+    }
+}
+
+void Processor::run()
+{
+    if (profile != nullptr)
+    {
+        run_profiled();
+        return;
+    }
+
+    switch (dispatch)
+    {
+    case Dispatch::Table:
+        run_table();
+        break;
+    case Dispatch::Threaded:
+        run_threaded();
+        break;
+    }
+}
+
+// Takes ownership of a finished prototype and returns the index that
+// CreateClosure refers to it by.
+int Processor::add_proto(std::unique_ptr<FunctionProto> proto)
+{
+    if (proto->entry == nullptr)
+    {
+        proto->entry = proto->code.data();
+        proto->code_size = proto->code.size();
+    }
+
+    code_bytes += proto->code_size;
+
+    if (free_protos.size() > 0)
+    {
+        int index = free_protos.back();
+        free_protos.pop_back();
+        protos[index] = std::move(proto);
+        return index;
+    }
+
+    protos.push_back(std::move(proto));
+    return protos.size() - 1;
+}
+
+// Walks the code once, keeping track of how many values are on the stack above
+// where it started. Jumps only go forwards, so by the time we reach an
+// instruction we have seen every jump that lands on it. Calls are counted as
+// popping their arguments and pushing the result, since the callee checks for
+// room for its own frame when it is entered.
+int Processor::stack_depth(unsigned char* code, size_t size)
+{
+    // Depth at each position that a jump lands on, or -1 if none does.
+    std::vector<int> targets(size + 1, -1);
+    int depth = 0;
+    int max_depth = 0;
+    bool reachable = true;
+
+    for (size_t pos = 0; pos < size;)
+    {
+        if (targets[pos] >= 0)
+        {
+            depth = reachable ? std::max(depth, targets[pos]) : targets[pos];
+            reachable = true;
+        }
+
+        auto inst = static_cast<Instruction>(code[pos]);
+        unsigned char* operands = code + pos + sizeof(Instruction);
+        size_t inst_size = instruction_size(inst);
+
+        if (!reachable)
+        {
+            pos += inst_size;
+            continue;
+        }
+
+        switch (generic_instruction(inst))
+        {
+        case Instruction::PushInt:
+        case Instruction::PushConst:
+        case Instruction::PushFloat:
+        case Instruction::PushRef:
+        case Instruction::PushGlobal:
+        case Instruction::PushCapture:
+        case Instruction::PushSelf:
+        case Instruction::PushTrue:
+        case Instruction::PushFalse:
+        case Instruction::PushNil:
+        case Instruction::MakeMap:
+        case Instruction::RefIntAdd:
+        case Instruction::RefIntSub:
+            depth++;
+            break;
+        case Instruction::Store:
+        case Instruction::StoreGlobal:
+        case Instruction::JmpTrue:
+        case Instruction::JmpFalse:
+        case Instruction::Add:
+        case Instruction::Sub:
+        case Instruction::Mul:
+        case Instruction::Div:
+        case Instruction::Min:
+        case Instruction::Max:
+        case Instruction::Eq:
+        case Instruction::Greater:
+        case Instruction::GreaterEq:
+        case Instruction::Less:
+        case Instruction::LessEq:
+        case Instruction::At:
+        case Instruction::Dot:
+        case Instruction::MapAdd:
+        case Instruction::Scale:
+        case Instruction::FilterLess:
+        case Instruction::MapGet:
+        case Instruction::MapHas:
+            depth--;
+            break;
+        case Instruction::Substring:
+        case Instruction::MapPut:
+        case Instruction::EqJmpFalse:
+        case Instruction::GreaterJmpFalse:
+        case Instruction::GreaterEqJmpFalse:
+        case Instruction::LessJmpFalse:
+        case Instruction::LessEqJmpFalse:
+            depth -= 2;
+            break;
+        case Instruction::AddN:
+        case Instruction::MulN:
+        case Instruction::MinN:
+        case Instruction::MaxN:
+        case Instruction::AndN:
+        case Instruction::OrN:
+        case Instruction::EqN:
+        case Instruction::GreaterN:
+        case Instruction::GreaterEqN:
+        case Instruction::LessN:
+        case Instruction::LessEqN:
+        case Instruction::IntArray:
+        case Instruction::FloatArray:
+        case Instruction::Concat:
+        {
+            // With 0 it takes every argument of the running function, and
+            // leaves its result at most one slot above where the body started.
+            int n = mem_get<int>(operands);
+            depth = n == 0 ? 1 : depth - n + 1;
+            break;
+        }
+        case Instruction::Call:
+            depth -= mem_get<int>(operands + sizeof(int)) - 1;
+            break;
+        case Instruction::CallPop:
+            depth -= mem_get<int>(operands);
+            break;
+        case Instruction::CreateClosure:
+            depth -= protos[mem_get<int>(operands)]->n_captures - 1;
+            break;
+        case Instruction::Jmp:
+        case Instruction::TailCall:
+        case Instruction::TailCallPop:
+        case Instruction::Ret:
+            reachable = false;
+            break;
+        default:
+            break;
+        }
+
+        max_depth = std::max(max_depth, depth);
+
+        if (is_jump(inst))
+        {
+            unsigned char* offset = code + pos + inst_size - sizeof(int);
+            size_t target = pos + mem_get<int>(offset);
+
+            if (target <= size)
+            {
+                targets[target] = std::max(targets[target], depth);
+            }
+        }
+
+        pos += inst_size;
+    }
+
+    return max_depth;
+}
+
+// Size of a heap object, including everything it owns.
+size_t object_size(Object* object)
+{
+    switch (object->type)
+    {
+    case ValueType::Closure:
+        return Closure::size(static_cast<Closure*>(object)->proto);
+    case ValueType::Array:
+        return Array::size(static_cast<Array*>(object)->capacity);
+    case ValueType::Map:
+        return Map::size(static_cast<Map*>(object)->capacity);
+    case ValueType::Str:
+        switch (static_cast<String*>(object)->kind)
+        {
+        case StringKind::Flat:
+            return FlatString::size(static_cast<String*>(object)->length);
+        case StringKind::Concat:
+            return sizeof(ConcatString);
+        default:
+            return sizeof(SliceString);
+        }
+    default:
+        return sizeof(Object);
+    }
+}
+
+void free_object(Object* object)
+{
+    switch (object->type)
+    {
+    case ValueType::Closure:
+        static_cast<Closure*>(object)->~Closure();
+        break;
+    case ValueType::Array:
+        static_cast<Array*>(object)->~Array();
+        break;
+    case ValueType::Map:
+        static_cast<Map*>(object)->~Map();
+        break;
+    default:
+        object->~Object();
+        break;
+    }
+
+    ::operator delete(object);
+}
+
+// Marks a value as reachable, if it is a heap object that hasn't been marked
+// yet, and queues it up so that its references are followed.
+void Processor::mark(Value value)
+{
+    if (!value.is_object())
+    {
+        return;
+    }
+
+    Object* object = value.as_object();
+
+    if (!object->marked)
+    {
+        object->marked = true;
+        gray.push_back(object);
+    }
+}
+
+// Follows the references of an object that has been marked.
+void Processor::trace(Object* object, std::vector<FunctionProto*>& reachable)
+{
+    trace_references(object, [this](Value value) { mark(value); });
+
+    if (object->type != ValueType::Closure)
+    {
+        return;
+    }
+
+    auto closure = static_cast<Closure*>(object);
+
+    for (int i = 0; i < closure->proto->n_captures; i++)
+    {
+        mark(closure->captures()[i]);
+    }
+
+    if (!closure->proto->marked)
+    {
+        closure->proto->marked = true;
+        reachable.push_back(closure->proto);
+    }
+}
+
+// Frees every heap object that is not reachable from the roots: the globals,
+// the stack (which holds every frame), the closures that are running, and the
+// constants of the top-level code and of every prototype.
+//
+// If between_forms is set, no code is running, and prototypes that neither a
+// reachable closure was made from nor any reachable prototype's code can
+// create closures from are reclaimed as well. While code is running that
+// can't be done, because the top-level code may still create closures from
+// any prototype. Prototypes are only traced when their code has doubled since
+// the last time, so a long run of small forms doesn't pay for it.
+void Processor::collect(bool between_forms)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    gc_stats.peak_heap_bytes = std::max(gc_stats.peak_heap_bytes, heap_bytes);
+
+    // Mark:
+    for (Value value : globals)
+    {
+        mark(value);
+    }
+
+    for (Value* value = stack.get(); value < sp; value++)
+    {
+        mark(*value);
+    }
+
+    if (closure != nullptr)
+    {
+        mark(Value(closure));
+    }
+
+    for (auto& ret_addr : call_stack)
+    {
+        if (ret_addr.closure != nullptr)
+        {
+            mark(Value(ret_addr.closure));
+        }
+    }
+
+    for (Value value : constants)
+    {
+        mark(value);
+    }
+
+    for (auto& proto : protos)
+    {
+        if (proto == nullptr)
+        {
+            continue;
+        }
+
+        for (Value value : proto->constants)
+        {
+            mark(value);
+        }
+    }
+
+    std::vector<FunctionProto*> reachable;
+
+    while (gray.size() > 0)
+    {
+        Object* object = gray.back();
+        gray.pop_back();
+        trace(object, reachable);
+    }
+
+    // Sweep:
+    Object** link = &objects;
+    size_t live_bytes = 0;
+    size_t n_live = 0;
+
+    while (*link != nullptr)
+    {
+        Object* object = *link;
+        size_t size = object_size(object);
+
+        if (object->marked)
+        {
+            object->marked = false;
+            live_bytes += size;
+            n_live++;
+            link = &object->next;
+            continue;
+        }
+
+        *link = object->next;
+
+        if (object->type == ValueType::Str
+            && static_cast<String*>(object)->kind == StringKind::Flat)
+        {
+            strings.erase(static_cast<FlatString*>(object));
+        }
+
+        free_object(object);
+
+        gc_stats.n_freed++;
+        gc_stats.freed_bytes += size;
+    }
+
+    bool reclaim_protos = between_forms && code_bytes >= code_collect_at;
+
+    // A reachable prototype's code can create closures from the prototypes of
+    // the functions defined in it.
+    while (reclaim_protos && reachable.size() > 0)
+    {
+        FunctionProto* proto = reachable.back();
+        reachable.pop_back();
+
+        for (int index : proto->protos)
+        {
+            FunctionProto* inner = protos[index].get();
+
+            if (!inner->marked)
+            {
+                inner->marked = true;
+                reachable.push_back(inner);
+            }
+        }
+    }
+
+    for (size_t i = 0; i < protos.size(); i++)
+    {
+        auto& proto = protos[i];
+
+        if (proto == nullptr)
+        {
+            continue;
+        }
+
+        if (proto->marked || !reclaim_protos)
+        {
+            proto->marked = false;
+            continue;
+        }
+
+        // Closures that were created from the prototype have just been freed,
+        // since none of them were reachable.
+        n_reclaimed++;
+        reclaimed_bytes += proto->code_size;
+        code_bytes -= proto->code_size;
+
+        proto.reset();
+        free_protos.push_back(i);
+    }
+
+    if (reclaim_protos)
+    {
+        code_collect_at = std::max<size_t>(PROC_CODE_COLLECT_MIN,
+                                           2 * code_bytes);
+    }
+
+    heap_bytes = live_bytes;
+    next_collection = std::max<size_t>(PROC_GC_MIN, 2 * live_bytes);
+
+    auto end = std::chrono::steady_clock::now();
+    uint64_t pause = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        end - start).count();
+
+    gc_stats.n_collections++;
+    gc_stats.total_pause_ns += pause;
+    gc_stats.max_pause_ns = std::max(gc_stats.max_pause_ns, pause);
+    gc_stats.n_objects = n_live;
+}
+
+// Returns the heap copy of a region object, moving it to the heap if it hasn't
+// been already. Its references are followed later by promote(), through the
+// gray list.
+Value Processor::promote(Value value)
+{
+    if (!value.is_object() || !value.as_object()->in_region)
+    {
+        return value;
+    }
+
+    Object* object = value.as_object();
+
+    if (object->marked)
+    {
+        return Value(object->next);
+    }
+
+    size_t size = object_size(object);
+    auto copy = static_cast<Object*>(::operator new(size));
+
+    // Only trivially destructible objects are put in the region, so a plain
+    // copy of the bytes is a valid copy of the object.
+    std::memcpy(static_cast<void*>(copy), object, size);
+    copy->in_region = false;
+    copy->next = objects;
+    objects = copy;
+
+    object->marked = true;
+    object->next = copy;
+    gray.push_back(copy);
+
+    heap_bytes += size;
+    gc_stats.n_objects++;
+    gc_stats.n_promoted++;
+    gc_stats.promoted_bytes += size;
+
+    return Value(copy);
+}
+
+// Moves every region object that is reachable from the globals or the stack to
+// the heap, and then releases the whole region at once. Must only be called
+// between two top-level forms, when no frames or closures are live. Heap
+// objects never refer to region objects afterwards: a binding can't be changed
+// to point at something newer than itself, and the only other way for a heap
+// object to refer to one is being put in a map, which moves it to the heap
+// with to_heap() first. That can happen in the middle of a form, though, and
+// the frames that were live then still hold the forwarding stub that it left
+// behind until the form finishes. Anything that compares objects by address
+// has to look through stubs with resolve_forwarded(), as = does.
+void Processor::promote()
+{
+    for (Value& value : globals)
+    {
+        value = promote(value);
+    }
+
+    for (Value* value = stack.get(); value < sp; value++)
+    {
+        *value = promote(*value);
+    }
+
+    promote_references();
+
+    gc_stats.peak_region_bytes = std::max(gc_stats.peak_region_bytes,
+                                          region.bytes_used());
+    region.reset();
+}
+
+// Moves everything that the objects promote() has just moved refer to, until
+// none of them refers to the region any more.
+void Processor::promote_references()
+{
+    while (gray.size() > 0)
+    {
+        Object* object = gray.back();
+        gray.pop_back();
+
+        if (object->type != ValueType::Closure)
+        {
+            continue;
+        }
+
+        auto closure = static_cast<Closure*>(object);
+
+        for (int i = 0; i < closure->proto->n_captures; i++)
+        {
+            closure->captures()[i] = promote(closure->captures()[i]);
+        }
+    }
+}
+
+GCStats Processor::heap_stats()
+{
+    GCStats stats = gc_stats;
+
+    stats.heap_bytes = heap_bytes;
+    stats.peak_heap_bytes = std::max(stats.peak_heap_bytes, heap_bytes);
+
+    return stats;
+}
+
+CodeStats Processor::code_stats()
+{
+    CodeStats stats;
+
+    stats.toplevel_bytes = toplevel.capacity();
+    stats.n_protos = protos.size() - free_protos.size();
+    stats.proto_bytes = code_bytes;
+    stats.n_reclaimed = n_reclaimed;
+    stats.reclaimed_bytes = reclaimed_bytes;
+
+    return stats;
 }
 
 Processor::Processor()
 {
-    envs.push_back(std::unordered_map<int, std::shared_ptr<Value>>());
-    // Zero out instructions
-    std::memset(instructions, 0, PROC_INSTRUCTION_SIZE);
-    
+    stack.reset(new Value[PROC_STACK_SIZE]);
+    sp = stack.get();
+    base = stack.get();
+
     // Initialize instruction table
-    INST_ENTRY(Instruction::PushInt, push_int);
-    INST_ENTRY(Instruction::PushRef, push_ref);
-    INST_ENTRY(Instruction::Store, store);
-    INST_ENTRY(Instruction::Add, add);
-    INST_ENTRY(Instruction::Sub, sub);
-    INST_ENTRY(Instruction::Mul, mul);
-    INST_ENTRY(Instruction::Div, div);
-    INST_ENTRY(Instruction::Neg, neg);
-    INST_ENTRY(Instruction::Jmp, jmp);
-    INST_ENTRY(Instruction::JmpTrue, jmp_true);
-    INST_ENTRY(Instruction::JmpFalse, jmp_false);
-    INST_ENTRY(Instruction::Call, call);
-    INST_ENTRY(Instruction::CallPop, call_pop);
-    INST_ENTRY(Instruction::CreateClosure, create_closure);
-    INST_ENTRY(Instruction::Ret, ret);
-    INST_ENTRY(Instruction::Eq, eq);
-    INST_ENTRY(Instruction::Greater, greater);
-    INST_ENTRY(Instruction::GreaterEq, greater_eq);
-    INST_ENTRY(Instruction::Less, less);
-    INST_ENTRY(Instruction::LessEq, less_eq);
-}
-
-
-template <typename T>
-inline T Processor::pop_as() {
-    T a = stack.back()->as<T>();
-    stack.pop_back();
-    return a;
+    for (auto& entry : jump_table)
+    {
+        entry = table_unknown;
+    }
+
+#define TABLE_ENTRY(id, fun) INST_ENTRY(Instruction::id, table_entry<fun>);
+    INSTRUCTIONS(TABLE_ENTRY)
+#undef TABLE_ENTRY
+}
+
+Processor::~Processor()
+{
+    while (objects != nullptr)
+    {
+        Object* next = objects->next;
+        free_object(objects);
+        objects = next;
+    }
 }
@@ -1,44 +1,408 @@
 #pragma once
 
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <functional>
 #include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 #include "bytecode.h"
 #include "environment.h"
+#include "region.h"
+#include "str.h"
 
-#define PROC_INSTRUCTION_SIZE 1 << 16
+// Number of bytes of prototype code that have to be added before the
+// processor first looks for prototypes that are no longer reachable.
+#define PROC_CODE_COLLECT_MIN (1 << 16)
+
+// Number of bytes of heap objects that have to be allocated before the first
+// garbage collection.
+#define PROC_GC_MIN (1 << 20)
+#define PROC_STACK_SIZE (1 << 16)
+
+// How the processor dispatches from one instruction to the next.
+enum class Dispatch
+{
+    // One indirect call per instruction through Processor::jump_table.
+    Table,
+
+    // All handlers inlined into a single loop that jumps directly from the end
+    // of one handler to the start of the next.
+    Threaded,
+};
+
+// How much memory the processor's code takes up.
+struct CodeStats
+{
+    // Capacity of the buffer that top-level forms are compiled into.
+    size_t toplevel_bytes = 0;
+
+    // Live function prototypes and the size of their code.
+    size_t n_protos = 0;
+    size_t proto_bytes = 0;
+
+    // Prototypes that have been freed because nothing could run their code
+    // anymore, and the size of their code.
+    size_t n_reclaimed = 0;
+    size_t reclaimed_bytes = 0;
+};
+
+// What the garbage collector has done so far.
+struct GCStats
+{
+    size_t n_collections = 0;
+
+    // Time spent in collections, in nanoseconds. Every collection stops the
+    // program for its whole duration.
+    uint64_t total_pause_ns = 0;
+    uint64_t max_pause_ns = 0;
+
+    // Objects and bytes that were live after the last collection, or that
+    // have been allocated since it.
+    size_t n_objects = 0;
+    size_t heap_bytes = 0;
+
+    // Largest heap_bytes has ever been.
+    size_t peak_heap_bytes = 0;
+
+    // Objects and bytes freed by all collections.
+    size_t n_freed = 0;
+    size_t freed_bytes = 0;
+
+    // Objects and bytes that were moved from the region to the heap because
+    // they were still reachable when their form finished, and the most the
+    // region has held at once.
+    size_t n_promoted = 0;
+    size_t promoted_bytes = 0;
+    size_t peak_region_bytes = 0;
+};
+
+// One in this many instructions has the time its handler takes measured while
+// the processor is profiling. Reading the clock costs more than most handlers
+// do, so timing every one of them would mostly measure the clock.
+#define PROFILE_SAMPLE_INTERVAL 16
+
+// What the processor has run, counted while it is profiling. Instructions are
+// counted as they are dispatched, so an instruction that rewrites itself into
+// a quicker one is counted as itself the first time and as the quicker one
+// after that.
+struct Profile
+{
+    // Executions of each instruction, and of each pair of instructions that
+    // ran one right after the other, indexed by the first one and then the
+    // second.
+    uint64_t counts[256] = {};
+    uint64_t pairs[256][256] = {};
+
+    // Clock ticks spent in the handlers of the executions that were timed,
+    // and how many of them were. Ticks are CPU cycles on x86, and
+    // nanoseconds elsewhere.
+    uint64_t ticks[256] = {};
+    uint64_t samples[256] = {};
+
+    // Ticks that reading the clock twice takes with nothing in between,
+    // which are taken off every sample. Measured on the first run.
+    uint64_t clock_overhead = 0;
+
+    // Instructions dispatched so far, and the last one of them, or 0 before
+    // the first one. Pairs don't span top-level forms.
+    uint64_t n_dispatched = 0;
+    unsigned char last = 0;
+};
+
+// The name of an instruction, as it is spelled in the Instruction enum.
+const char* instruction_name(unsigned char inst);
+
+struct ReturnAddress
+{
+    unsigned char* ip;
+    Value* base;
+    Closure* closure;
+};
 
 struct Processor
 {
-    // Instruction bytes.
-    unsigned char instructions[PROC_INSTRUCTION_SIZE];
+    // Code of the top-level form that is being run. It is thrown away once
+    // the form has run, since everything that outlives it is in a prototype.
+    std::vector<unsigned char> toplevel;
 
-    // Instruction pointer.
-    unsigned char* ip = instructions;
+    // Values that PushConst pushes in the top-level code, which are kept
+    // alive along with the constants of every prototype.
+    std::vector<Value> constants;
 
-    // Pointer to where the next instruction will be emitted.
-    unsigned char* write_head = instructions;
+    // Instruction pointer.
+    unsigned char* ip = nullptr;
 
-    // Program stack.
+    // Program stack. Values are stored unboxed in a single buffer that is
+    // allocated once, so pushing and popping never touch the allocator.
     // TODO: Rename to value_stack or something.
-    std::vector<std::shared_ptr<Value>> stack;
+    std::unique_ptr<Value[]> stack;
+
+    // Stack pointer. Points one past the value on top of the stack.
+    Value* sp;
+
+    // Values of global variables, indexed by the slots the compiler assigns
+    // to top-level defs. The builtins are always the first globals.
+    std::vector<Value> globals;
+
+    // Frame of the function call that is currently running. A frame is a
+    // window of the stack that starts with the call's arguments, which the
+    // caller pushed, followed by the slots of the variables bound by defs in
+    // the function's body.
+    Value* base;
+
+    // Every function prototype the compiler has produced, indexed by
+    // CreateClosure. Prototypes that have been reclaimed leave a nullptr
+    // behind, and their indices are handed out again.
+    std::vector<std::unique_ptr<FunctionProto>> protos;
+    std::vector<int> free_protos;
+
+    // Size of the code of all live prototypes, and the size at which a
+    // collection between two top-level forms next looks for unreachable
+    // ones.
+    size_t code_bytes = 0;
+    size_t code_collect_at = PROC_CODE_COLLECT_MIN;
 
-    // Environment stack.
-    std::vector<std::unordered_map<int, std::shared_ptr<Value>>> envs;
+    size_t n_reclaimed = 0;
+    size_t reclaimed_bytes = 0;
 
-    // All our instruction pointers are put here before we jump to
-    // another function.
-    std::vector<unsigned char*> call_stack;
+    // Closure that is currently running, or nullptr at the top level.
+    Closure* closure = nullptr;
+
+    // Where to continue, and with which frame, when the function that is
+    // currently running returns.
+    std::vector<ReturnAddress> call_stack;
 
     // Table of functions to jump to on each instruction.
     void (*jump_table[256])(Processor &proc);
 
-    template <typename T> inline T pop_as();
+    Dispatch dispatch = Dispatch::Threaded;
+
+    // Set if the processor is profiling, in which case run() uses a loop of
+    // its own that fills it in instead of the one for dispatch, so the others
+    // don't pay anything for profiling.
+    std::unique_ptr<Profile> profile;
+
+    // Every heap object allocated by the processor, linked through
+    // Object::next. The processor owns these. Unreachable ones are freed by
+    // collect(), and the rest are freed when the processor is destroyed.
+    Object* objects = nullptr;
+
+    // Size of all heap objects, and the size at which the next collection
+    // runs.
+    size_t heap_bytes = 0;
+    size_t next_collection = PROC_GC_MIN;
+
+    GCStats gc_stats;
+
+    // Objects that have been marked but whose references haven't been
+    // followed yet. Kept around so that it doesn't have to be reallocated by
+    // every collection.
+    std::vector<Object*> gray;
+
+    // If set, objects are allocated in the region instead of on the heap.
+    // Whatever is still reachable when the form that is running finishes is
+    // moved to the heap by promote(), and the rest is released all at once.
+    // Nothing is collected while a form runs.
+    bool use_region = false;
+    Region region;
+
+    // Every flat string on the heap. Strings are never allocated in the
+    // region, so the table only ever refers to heap objects.
+    StringTable strings;
+
+    inline void push(Value value)
+    {
+        *sp++ = value;
+    }
+
+    inline Value pop()
+    {
+        return *--sp;
+    }
+
+    inline Value& top()
+    {
+        return sp[-1];
+    }
+
+    inline size_t stack_size()
+    {
+        return sp - stack.get();
+    }
+
+    template <typename T, typename... Args>
+    T* allocate(size_t size, Args&&... args);
+
+    template <typename T, typename... Args>
+    T* allocate_on_heap(size_t size, Args&&... args);
+
+    void mark(Value value);
+    void trace(Object* object, std::vector<FunctionProto*>& reachable);
+    void collect(bool between_forms);
+
+    Value promote(Value value);
+    void promote_references();
+    void promote();
+
+    inline bool should_collect()
+    {
+        return heap_bytes >= next_collection;
+    }
+
+    GCStats heap_stats();
+
+    int add_proto(std::unique_ptr<FunctionProto> proto);
+
+    // Largest number of values that code pushes above where it starts, which
+    // is how much room it needs on the stack besides its frame.
+    int stack_depth(unsigned char* code, size_t size);
+    CodeStats code_stats();
+
+    // Runs instructions starting at ip until a 0 byte is reached.
+    void run();
+    void run_table();
+    void run_threaded();
+    void run_profiled();
 
     Processor();
+    Processor(const Processor&) = delete;
+    ~Processor();
 };
 
+// Size of a heap object, including everything it owns, and what freeing it
+// takes. Both processors use these for every object but their closures.
+size_t object_size(Object* object);
+void free_object(Object* object);
+
+// Calls mark on every value that a string or a map refers to. Closures are
+// traced by each processor, since they are laid out differently in each.
+template <typename Mark>
+void trace_references(Object* object, Mark mark)
+{
+    if (object->type == ValueType::Str)
+    {
+        auto string = static_cast<String*>(object);
+
+        if (string->kind == StringKind::Concat)
+        {
+            auto concat = static_cast<ConcatString*>(string);
+
+            mark(concat->left);
+            mark(concat->right);
+
+            if (concat->flat != nullptr)
+            {
+                mark(Value(concat->flat));
+            }
+        }
+        else if (string->kind == StringKind::Slice)
+        {
+            mark(Value(static_cast<SliceString*>(string)->source));
+        }
+    }
+    else if (object->type == ValueType::Map)
+    {
+        auto map = static_cast<Map*>(object);
+
+        for (size_t i = 0; i < map->capacity; i++)
+        {
+            if (map->full(i))
+            {
+                mark(map->slots()[i].key);
+                mark(map->slots()[i].value);
+            }
+        }
+    }
+}
+
+// Allocates an object of size bytes, which is at least sizeof(T), and links it
+// into the processor's object list, or places it in the region if that is in
+// use and T has nothing to destroy. This never collects, so callers that may
+// need a collection check should_collect() at a point where every live value
+// is reachable from a root.
+template <typename T, typename... Args>
+T* Processor::allocate(size_t size, Args&&... args)
+{
+    if (std::is_trivially_destructible<T>::value && use_region)
+    {
+        T* object = new (region.allocate(size)) T(std::forward<Args>(args)...);
+        object->in_region = true;
+        return object;
+    }
+
+    return allocate_on_heap<T>(size, std::forward<Args>(args)...);
+}
+
+// Allocates an object of size bytes on the heap, whether or not the region is
+// in use.
+template <typename T, typename... Args>
+T* Processor::allocate_on_heap(size_t size, Args&&... args)
+{
+    T* object = new (::operator new(size)) T(std::forward<Args>(args)...);
+    object->next = objects;
+    objects = object;
+
+    heap_bytes += size;
+    gc_stats.n_objects++;
+    return object;
+}
+
+// Allocates an array with room for capacity elements. Its elements count
+// towards the size of the heap, so big arrays bring the next collection
+// closer.
+inline Array* allocate_array(Processor& proc, ElementType type,
+                             size_t capacity)
+{
+    auto array = proc.allocate<Array>(sizeof(Array), type, capacity);
+    proc.heap_bytes += Array::size(capacity) - sizeof(Array);
+    return array;
+}
+
+// Allocates an empty map. Like an array's buffer, its table counts towards the
+// size of the heap.
+inline Map* allocate_map(Processor& proc)
+{
+    auto map = proc.allocate<Map>(sizeof(Map), MAP_GROUP_SIZE);
+    proc.heap_bytes += Map::table_size(MAP_GROUP_SIZE);
+    return map;
+}
+
+// Counts the bigger table that a map has grown to.
+inline void map_grown(Processor& proc, size_t old_capacity, size_t capacity)
+{
+    proc.heap_bytes += Map::table_size(capacity)
+        - Map::table_size(old_capacity);
+}
+
+// The heap copy of a value that a heap object is about to refer to, which is
+// moved out of the region right away if it is in it. Whatever it refers to is
+// moved along with it, so heap objects still never refer to region objects.
+inline Value to_heap(Processor& proc, Value value)
+{
+    if (!value.is_object() || !value.as_object()->in_region)
+    {
+        return value;
+    }
+
+    value = proc.promote(value);
+    proc.promote_references();
+    return value;
+}
+
+// Allocates a string object of size bytes, which always goes on the heap.
+template <typename T, typename... Args>
+inline T* allocate_string(Processor& proc, size_t size, Args&&... args)
+{
+    return proc.allocate_on_heap<T>(size, std::forward<Args>(args)...);
+}
+
 template <typename T>
 inline void mem_put(T value, unsigned char* arr)
 {
@@ -52,3 +416,92 @@ inline T mem_get(unsigned char* arr)
     std::memcpy(&value, arr, sizeof(T));
     return value;
 }
+
+// Function objects for min and max, in the style of std::less.
+template <typename T>
+struct minimum
+{
+    T operator()(T a, T b) const
+    {
+        return b < a ? b : a;
+    }
+};
+
+template <typename T>
+struct maximum
+{
+    T operator()(T a, T b) const
+    {
+        return b > a ? b : a;
+    }
+};
+
+[[noreturn]] inline void not_a_number(Value a, Value b)
+{
+    printf("ERROR: Arithmetic on %s and %s, which are not both numbers\n",
+           a.to_string().c_str(), b.to_string().c_str());
+    exit(-1);
+}
+
+// Applies an arithmetic operation or comparison to two integers. Addition,
+// subtraction and multiplication wrap around, and are done on unsigned
+// integers, since overflowing a signed one is undefined. Every path that
+// works on integers goes through this, so they all give the same results.
+template <template <typename> class Operation>
+inline auto int_operation(int a, int b)
+{
+    if constexpr (std::is_same<Operation<int>, std::plus<int>>::value
+                  || std::is_same<Operation<int>, std::minus<int>>::value
+                  || std::is_same<Operation<int>, std::multiplies<int>>::value)
+    {
+        return static_cast<int>(Operation<uint32_t>()(
+            static_cast<uint32_t>(a), static_cast<uint32_t>(b)));
+    }
+    else
+    {
+        return Operation<int>()(a, b);
+    }
+}
+
+// Applies an arithmetic operation or comparison to a and b. Two integers give
+// an integer, or a boolean for a comparison. If either is a float, both are
+// converted to doubles, which keeps the result unboxed. Values that aren't
+// numbers are only equal to themselves, including the heap copy that a region
+// object may have been moved to, or, for strings, to strings with the same
+// bytes, and any other operation on them is an error.
+template <template <typename> class Operation>
+inline Value apply_binary(Value a, Value b)
+{
+    if (Value::both_int(a, b))
+    {
+        return Value(int_operation<Operation>(a.as_int(), b.as_int()));
+    }
+
+    if (a.is_number() && b.is_number())
+    {
+        return Value(Operation<double>()(a.as_number(), b.as_number()));
+    }
+
+    if (std::is_same<Operation<int>, std::equal_to<int>>::value)
+    {
+        return Value(a.bits == b.bits
+                     || resolve_forwarded(a).bits == resolve_forwarded(b).bits
+                     || strings_equal(a, b));
+    }
+
+    not_a_number(a, b);
+}
+
+// Reductions over the n values starting at args, where n is at least 1. Both
+// backends run variadic builtins through these, so that no intermediate result
+// is ever boxed or pushed. They are defined in reduce.cpp, which keeps their
+// loops out of the dispatch loops that would otherwise inline them.
+
+template <template <typename> class Operation>
+Value fold_values(const Value* args, int n);
+
+template <template <typename> class Compare>
+Value chain_values(const Value* args, int n);
+
+Value all_true(const Value* args, int n);
+Value any_true(const Value* args, int n);
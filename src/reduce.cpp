@@ -0,0 +1,55 @@
+#include <algorithm>
+#include <functional>
+
+#include "processor.h"
+
+template <template <typename> class Operation>
+Value fold_values(const Value* args, int n)
+{
+    Value result = args[0];
+
+    for (int i = 1; i < n; i++)
+    {
+        result = apply_binary<Operation>(result, args[i]);
+    }
+
+    return result;
+}
+
+template <template <typename> class Compare>
+Value chain_values(const Value* args, int n)
+{
+    for (int i = 1; i < n; i++)
+    {
+        if (!apply_binary<Compare>(args[i - 1], args[i]).as_bool())
+        {
+            return Value(false);
+        }
+    }
+
+    return Value(true);
+}
+
+Value all_true(const Value* args, int n)
+{
+    return Value(std::all_of(args, args + n,
+                             [](Value v) { return v.as_bool(); }));
+}
+
+Value any_true(const Value* args, int n)
+{
+    return Value(std::any_of(args, args + n,
+                             [](Value v) { return v.as_bool(); }));
+}
+
+// The reductions that the builtins use.
+template Value fold_values<std::plus>(const Value*, int);
+template Value fold_values<std::multiplies>(const Value*, int);
+template Value fold_values<minimum>(const Value*, int);
+template Value fold_values<maximum>(const Value*, int);
+
+template Value chain_values<std::equal_to>(const Value*, int);
+template Value chain_values<std::greater>(const Value*, int);
+template Value chain_values<std::greater_equal>(const Value*, int);
+template Value chain_values<std::less>(const Value*, int);
+template Value chain_values<std::less_equal>(const Value*, int);
@@ -0,0 +1,28 @@
+#include "region.h"
+
+// Moves on to the next chunk that is big enough, allocating a new one if there
+// is none.
+void* Region::allocate_slow(size_t size)
+{
+    if (chunk < chunks.size())
+    {
+        chunk++;
+    }
+
+    while (chunk < chunks.size() && size > chunk_sizes[chunk])
+    {
+        chunk++;
+    }
+
+    if (chunk == chunks.size())
+    {
+        size_t chunk_size = size > REGION_CHUNK_SIZE ? size : REGION_CHUNK_SIZE;
+
+        chunks.emplace_back(new char[chunk_size]);
+        chunk_sizes.push_back(chunk_size);
+    }
+
+    offset = size;
+    used += size;
+    return chunks[chunk].get();
+}
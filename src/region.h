@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+// Size of each chunk of memory that a region allocates from.
+#define REGION_CHUNK_SIZE (1 << 16)
+
+// A bump-pointer allocator. Allocating is just moving a pointer forward, and
+// everything that has been allocated is released at once by reset(). Nothing
+// is ever freed individually, and no destructors are run, so a region may only
+// hold trivially destructible objects.
+//
+// Memory comes from a list of chunks. The chunks are kept when the region is
+// reset, so a region that is reused for work of about the same size stops
+// touching the system allocator altogether.
+class Region
+{
+
+private:
+    std::vector<std::unique_ptr<char[]>> chunks;
+    std::vector<size_t> chunk_sizes;
+
+    // Chunk that is currently being allocated from, and the offset of its
+    // first free byte.
+    size_t chunk = 0;
+    size_t offset = 0;
+
+    // Bytes handed out since the last reset, and the most there have ever
+    // been.
+    size_t used = 0;
+    size_t peak = 0;
+
+    void* allocate_slow(size_t size);
+
+public:
+
+    // Returns size bytes of memory that are aligned for any object with
+    // fundamental alignment.
+    inline void* allocate(size_t size)
+    {
+        size = (size + alignof(std::max_align_t) - 1)
+            & ~(alignof(std::max_align_t) - 1);
+
+        if (chunk < chunks.size() && offset + size <= chunk_sizes[chunk])
+        {
+            void* memory = chunks[chunk].get() + offset;
+            offset += size;
+            used += size;
+            return memory;
+        }
+
+        return allocate_slow(size);
+    }
+
+    // Releases everything that has been allocated.
+    inline void reset()
+    {
+        peak = used > peak ? used : peak;
+
+        chunk = 0;
+        offset = 0;
+        used = 0;
+    }
+
+    inline size_t bytes_used() const
+    {
+        return used;
+    }
+
+    inline size_t peak_bytes() const
+    {
+        return used > peak ? used : peak;
+    }
+};
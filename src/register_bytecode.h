@@ -0,0 +1,144 @@
+#pragma once
+
+// Instruction set of the register backend. Every instruction names its
+// operands explicitly instead of taking them from a stack. Registers are one
+// byte wide and index into the register file of the current frame; integers,
+// global indices, prototype indices and jump offsets are four bytes wide. Jump
+// offsets are relative to the first byte of the jump instruction.
+enum class RegisterInstruction : unsigned char
+{
+    // dst, int
+    LoadInt = 1,
+
+    // dst, double
+    LoadFloat,
+
+    // dst, constant of the running function, or of the top-level form
+    LoadConst,
+
+    // dst
+    LoadNil,
+    LoadTrue,
+    LoadFalse,
+
+    // dst, src
+    Move,
+
+    // dst, global
+    LoadGlobal,
+
+    // global, src
+    StoreGlobal,
+
+    // dst, capture
+    LoadCapture,
+
+    // dst, prototype
+    CreateClosure,
+
+    // offset
+    Jmp,
+
+    // cond, offset
+    JmpFalse,
+    JmpTrue,
+
+    // dst, callee, base, # args
+    //
+    // Arguments are passed in the registers starting at base, which become the
+    // first registers of the callee's frame.
+    Call,
+
+    // dst, global, base, # args
+    CallGlobal,
+
+    // callee, base, # args
+    //
+    // Calls in tail position. The arguments are moved down to the start of
+    // the current frame, which the callee takes over, and the callee returns
+    // straight to the current function's caller.
+    TailCall,
+
+    // global, base, # args
+    TailCallGlobal,
+
+    // src
+    Ret,
+
+    // src. Ends a top-level form, producing src as its result.
+    Halt,
+
+    // Arithmetic and comparison, dst, a, b:
+    Add,
+    Sub,
+    Mul,
+    Div,
+    Eq,
+    Greater,
+    GreaterEq,
+    Less,
+    LessEq,
+    Min,
+    Max,
+
+    // The same operations with an integer as the right operand, dst, a, int:
+    AddInt,
+    SubInt,
+    MulInt,
+    DivInt,
+    EqInt,
+    GreaterInt,
+    GreaterEqInt,
+    LessInt,
+    LessEqInt,
+    MinInt,
+    MaxInt,
+
+    // Reductions of variadic builtins over consecutive registers, dst, first,
+    // count. A count of 0 means all of the arguments of the running function,
+    // which is how a builtin called indirectly gets at however many it was
+    // passed.
+    AddN,
+    MulN,
+    MinN,
+    MaxN,
+    AndN,
+    OrN,
+    EqN,
+    GreaterN,
+    GreaterEqN,
+    LessN,
+    LessEqN,
+
+    // Arrays made out of consecutive registers, dst, first, count, with a
+    // count of 0 meaning all of the arguments like the reductions.
+    IntArray,
+    FloatArray,
+
+    // The other array builtins, dst, a:
+    Range,
+    Length,
+    Sum,
+    ArgMax,
+
+    // and dst, a, b:
+    At,
+    Dot,
+    MapAdd,
+    Scale,
+    FilterLess,
+
+    // A string made out of consecutive registers, dst, first, count, like the
+    // arrays.
+    Concat,
+
+    // dst, s, start, end
+    Substring,
+
+    // Maps, dst followed by the arguments of the builtin of the same name:
+    MakeMap,
+    MapGet,
+    MapPut,
+    MapHas,
+    Count,
+};
@@ -0,0 +1,875 @@
+// The compiler for the register backend.
+//
+// Every expression is compiled into a destination register. Callers either
+// ask for the value in a specific register, or pass -1 and get back whichever
+// register the value ended up in. The latter lets a reference to a local
+// variable compile to nothing at all, since the value is already sitting in
+// the variable's register.
+//
+// Temporaries are handed out in stack order: a compile function remembers
+// fn->next_register before compiling its operands and resets it afterwards.
+// This is also what makes calls cheap. The arguments are compiled into the
+// registers right above all live temporaries, and those registers become the
+// first registers (the parameters) of the callee's frame.
+
+#include "register_compiler.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "error.h"
+#include "processor.h"
+
+struct RegisterBuiltinEntry
+{
+    std::string name;
+
+    // Number of arguments, or the least number for a builtin that isn't
+    // Fixed.
+    int num_args;
+    BuiltinKind kind;
+
+    // Instruction that a call by name is compiled to, and the same one with
+    // an integer as its right operand, or Halt if there is no such variant.
+    RegisterInstruction inst;
+    RegisterInstruction int_inst;
+
+    // Reduction over all of the arguments, for a builtin that isn't Fixed.
+    RegisterInstruction reduce;
+};
+
+using RI = RegisterInstruction;
+using K = BuiltinKind;
+
+const RegisterBuiltinEntry register_builtins[] = {
+
+    // Function name, # args, kind, inst, inst with an integer right operand,
+    // reduction
+    { "+",           1, K::Fold,    RI::Add,        RI::AddInt,       RI::AddN },
+    { "-",           2, K::Fixed,   RI::Sub,        RI::SubInt,       RI::Halt },
+    { "*",           1, K::Fold,    RI::Mul,        RI::MulInt,       RI::MulN },
+    { "/",           2, K::Fixed,   RI::Div,        RI::DivInt,       RI::Halt },
+    { "=",           1, K::Chain,   RI::Eq,         RI::EqInt,        RI::EqN },
+    { ">",           1, K::Chain,   RI::Greater,    RI::GreaterInt,   RI::GreaterN },
+    { ">=",          1, K::Chain,   RI::GreaterEq,  RI::GreaterEqInt, RI::GreaterEqN },
+    { "<",           1, K::Chain,   RI::Less,       RI::LessInt,      RI::LessN },
+    { "<=",          1, K::Chain,   RI::LessEq,     RI::LessEqInt,    RI::LessEqN },
+    { "min",         1, K::Fold,    RI::Min,        RI::MinInt,       RI::MinN },
+    { "max",         1, K::Fold,    RI::Max,        RI::MaxInt,       RI::MaxN },
+    { "and",         1, K::Logical, RI::Halt,       RI::Halt,         RI::AndN },
+    { "or",          1, K::Logical, RI::Halt,       RI::Halt,         RI::OrN },
+    { "int-array",   1, K::Collect, RI::Halt,       RI::Halt,         RI::IntArray },
+    { "float-array", 1, K::Collect, RI::Halt,       RI::Halt,         RI::FloatArray },
+    { "range",       1, K::Fixed,   RI::Range,      RI::Halt,         RI::Halt },
+    { "length",      1, K::Fixed,   RI::Length,     RI::Halt,         RI::Halt },
+    { "at",          2, K::Fixed,   RI::At,         RI::Halt,         RI::Halt },
+    { "sum",         1, K::Fixed,   RI::Sum,        RI::Halt,         RI::Halt },
+    { "dot",         2, K::Fixed,   RI::Dot,        RI::Halt,         RI::Halt },
+    { "map+",        2, K::Fixed,   RI::MapAdd,     RI::Halt,         RI::Halt },
+    { "scale",       2, K::Fixed,   RI::Scale,      RI::Halt,         RI::Halt },
+    { "filter<",     2, K::Fixed,   RI::FilterLess, RI::Halt,         RI::Halt },
+    { "argmax",      1, K::Fixed,   RI::ArgMax,     RI::Halt,         RI::Halt },
+    { "concat",      1, K::Collect, RI::Halt,       RI::Halt,         RI::Concat },
+    { "substring",   3, K::Fixed,   RI::Substring,  RI::Halt,         RI::Halt },
+    { "hash-map",    0, K::Fixed,   RI::MakeMap,    RI::Halt,         RI::Halt },
+    { "get",         2, K::Fixed,   RI::MapGet,     RI::Halt,         RI::Halt },
+    { "put",         3, K::Fixed,   RI::MapPut,     RI::Halt,         RI::Halt },
+    { "has?",        2, K::Fixed,   RI::MapHas,     RI::Halt,         RI::Halt },
+    { "count",       1, K::Fixed,   RI::Count,      RI::Halt,         RI::Halt },
+};
+
+RegisterCompiler::RegisterCompiler()
+{
+    // Builtins are called like any other function when they are not called by
+    // name, so each of them gets a tiny prototype of its own. A variadic one
+    // reduces however many arguments it was passed.
+    for (const auto& builtin : register_builtins)
+    {
+        auto proto = std::make_unique<RegisterProto>();
+        proto->name = builtin.name;
+
+        if (builtin.kind != K::Fixed)
+        {
+            proto->n_params = 1;
+            proto->variadic = true;
+            proto->n_registers = 1;
+            proto->code = {
+                static_cast<unsigned char>(builtin.reduce), 0, 0, 0,
+                static_cast<unsigned char>(RI::Ret), 0,
+            };
+        }
+        else
+        {
+            // The result goes in register 0, even if there are no
+            // parameters.
+            proto->n_params = builtin.num_args;
+            proto->n_registers = std::max(builtin.num_args, 1);
+            proto->code = { static_cast<unsigned char>(builtin.inst), 0 };
+
+            for (int i = 0; i < builtin.num_args; i++)
+            {
+                proto->code.push_back(i);
+            }
+
+            proto->code.push_back(static_cast<unsigned char>(RI::Ret));
+            proto->code.push_back(0);
+        }
+
+        auto closure = proc.allocate<RegisterClosure>(proto.get());
+        proc.protos.push_back(std::move(proto));
+
+        globals[symbols().intern(builtin.name)] = builtin_counter;
+        proc.globals.push_back(Value(closure));
+        builtin_counter++;
+    }
+}
+
+inline void RegisterCompiler::emit_inst(RegisterInstruction inst)
+{
+    fn->proto->code.push_back(static_cast<unsigned char>(inst));
+}
+
+inline void RegisterCompiler::emit_reg(int reg)
+{
+    fn->proto->code.push_back(static_cast<unsigned char>(reg));
+}
+
+inline void RegisterCompiler::emit_int(int i)
+{
+    auto& code = fn->proto->code;
+    code.resize(code.size() + sizeof(int));
+    mem_put<int>(i, &code[code.size() - sizeof(int)]);
+}
+
+inline void RegisterCompiler::emit_float(double d)
+{
+    auto& code = fn->proto->code;
+    code.resize(code.size() + sizeof(double));
+    mem_put<double>(d, &code[code.size() - sizeof(double)]);
+}
+
+inline void RegisterCompiler::patch_int(size_t pos, int i)
+{
+    mem_put<int>(i, &fn->proto->code[pos]);
+}
+
+// Index of a constant of the function being compiled, which is added if the
+// function doesn't have it yet.
+int RegisterCompiler::add_constant(Value value)
+{
+    auto& constants = fn->proto->constants;
+
+    for (size_t i = 0; i < constants.size(); i++)
+    {
+        if (constants[i].bits == value.bits)
+        {
+            return i;
+        }
+    }
+
+    constants.push_back(value);
+    return constants.size() - 1;
+}
+
+// Hands out the next free temporary register.
+int RegisterCompiler::alloc_register(std::unique_ptr<AST>& ast)
+{
+    int reg = fn->next_register++;
+
+    if (reg > 255)
+    {
+        err_token(ast->source, ast->token,
+                  "expression needs more than 256 registers");
+    }
+
+    fn->proto->n_registers = std::max(fn->proto->n_registers, reg + 1);
+    return reg;
+}
+
+// Returns the index of the capture through which a function can read a local of
+// one of its enclosing functions, adding captures to every function in between
+// as needed. Returns -1 if no enclosing function binds the name.
+int RegisterCompiler::resolve_capture(FunctionState* state,
+                                      uint32_t symbol)
+{
+    auto it = state->captures.find(symbol);
+
+    if (it != state->captures.end())
+    {
+        return it->second;
+    }
+
+    FunctionState* parent = state->parent;
+
+    if (parent == nullptr)
+    {
+        return -1;
+    }
+
+    CaptureInfo info;
+    auto local = parent->locals.find(symbol);
+
+    if (local != parent->locals.end())
+    {
+        // A function bound by a def can't capture the register it is being
+        // bound to, since that register isn't written until after the
+        // closure has been created.
+        info.source = local->second == state->self_register
+            ? CaptureSource::Self
+            : CaptureSource::Register;
+        info.index = local->second;
+    }
+    else
+    {
+        int index = resolve_capture(parent, symbol);
+
+        if (index < 0)
+        {
+            return -1;
+        }
+
+        info.source = CaptureSource::Capture;
+        info.index = index;
+    }
+
+    int index = state->proto->captures.size();
+    state->proto->captures.push_back(info);
+    state->captures[symbol] = index;
+    return index;
+}
+
+// If name refers to a builtin in the current function, returns the builtin's
+// index. Otherwise returns -1.
+int RegisterCompiler::global_builtin(uint32_t symbol)
+{
+    if (fn->locals.count(symbol) > 0 || resolve_capture(fn, symbol) >= 0)
+    {
+        return -1;
+    }
+
+    auto it = globals.find(symbol);
+
+    if (it == globals.end() || it->second >= builtin_counter)
+    {
+        return -1;
+    }
+
+    return it->second;
+}
+
+int RegisterCompiler::compile_symbol(std::unique_ptr<AST>& ast, int dst)
+{
+    uint32_t symbol = ast->token.id;
+    auto local = fn->locals.find(symbol);
+
+    if (local != fn->locals.end())
+    {
+        if (dst < 0 || dst == local->second)
+        {
+            return local->second;
+        }
+
+        emit_inst(RegisterInstruction::Move);
+        emit_reg(dst);
+        emit_reg(local->second);
+        return dst;
+    }
+
+    if (dst < 0)
+    {
+        dst = alloc_register(ast);
+    }
+
+    int capture = resolve_capture(fn, symbol);
+
+    if (capture >= 0)
+    {
+        emit_inst(RegisterInstruction::LoadCapture);
+        emit_reg(dst);
+        emit_int(capture);
+        return dst;
+    }
+
+    auto global = globals.find(symbol);
+
+    if (global == globals.end())
+    {
+        err_token(ast->source, ast->token,
+                  "Undefined symbol '" + ast->symbol_name() + "'");
+    }
+
+    emit_inst(RegisterInstruction::LoadGlobal);
+    emit_reg(dst);
+    emit_int(global->second);
+    return dst;
+}
+
+int RegisterCompiler::compile_do(std::unique_ptr<AST>& ast, int dst, bool tail)
+{
+    if (ast->children.size() == 1)
+    {
+        if (dst < 0)
+        {
+            dst = alloc_register(ast);
+        }
+
+        emit_inst(RegisterInstruction::LoadNil);
+        emit_reg(dst);
+        return dst;
+    }
+
+    int mark = fn->next_register;
+
+    for (size_t i = 1; i < ast->children.size() - 1; i++)
+    {
+        compile_expr(ast->children[i], -1);
+        fn->next_register = mark;
+    }
+
+    return compile_expr(ast->children.back(), dst, tail);
+}
+
+int RegisterCompiler::compile_if(std::unique_ptr<AST>& ast, int dst, bool tail)
+{
+    auto& condition = ast->children[1];
+    auto& if_part = ast->children[2];
+    auto& else_part = ast->children[3];
+
+    if (dst < 0)
+    {
+        dst = alloc_register(ast);
+    }
+
+    int mark = fn->next_register;
+    auto& code = fn->proto->code;
+
+    int cond = compile_expr(condition, -1);
+    fn->next_register = mark;
+
+    size_t jmp_false = code.size();
+    emit_inst(RegisterInstruction::JmpFalse);
+    emit_reg(cond);
+    emit_int(0);
+
+    compile_expr(if_part, dst, tail);
+    fn->next_register = mark;
+
+    size_t jmp = code.size();
+    emit_inst(RegisterInstruction::Jmp);
+    emit_int(0);
+
+    patch_int(jmp_false + 2, code.size() - jmp_false);
+
+    compile_expr(else_part, dst, tail);
+    fn->next_register = mark;
+
+    patch_int(jmp + 1, code.size() - jmp);
+    return dst;
+}
+
+int RegisterCompiler::compile_def(std::unique_ptr<AST>& ast, int dst)
+{
+    auto& left = ast->children[1];
+    auto& right = ast->children[2];
+
+    if (left->type != ASTType::Symbol)
+    {
+        err_token(left->source, left->token, "variable name must be a symbol");
+    }
+
+    uint32_t symbol = left->token.id;
+    const std::string& symbol_name = left->symbol_name();
+
+    if (dst < 0)
+    {
+        dst = alloc_register(ast);
+    }
+
+    int mark = fn->next_register;
+
+    bool is_fn = right->type == ASTType::Expr
+        && right->children.size() > 0
+        && right->children[0]->type == ASTType::Symbol
+        && right->children[0]->token.id == SYM_FN;
+
+    // A def at the top level binds a global.
+    if (fn->parent == nullptr)
+    {
+        if (globals.count(symbol) > 0)
+        {
+            err_token(left->source, left->token,
+                      "redefinition of variable '" + symbol_name + "'");
+        }
+
+        // Like the stack machine, the name is defined before we compile what
+        // it is bound to, so that recursive functions can refer to it.
+        int global = proc.globals.size();
+        globals[symbol] = global;
+        proc.globals.push_back(Value());
+
+        int src = is_fn
+            ? compile_fn(right, -1, symbol_name, -1)
+            : compile_expr(right, -1);
+
+        emit_inst(RegisterInstruction::StoreGlobal);
+        emit_int(global);
+        emit_reg(src);
+    }
+    else
+    {
+        if (fn->locals.count(symbol) > 0)
+        {
+            err_token(left->source, left->token,
+                      "redefinition of variable '" + symbol_name + "'");
+        }
+
+        int local = fn->next_local++;
+        fn->locals[symbol] = local;
+
+        if (is_fn)
+        {
+            compile_fn(right, local, symbol_name, local);
+        }
+        else
+        {
+            compile_expr(right, local);
+        }
+    }
+
+    fn->next_register = mark;
+
+    // Like a Store on the stack machine, a def doesn't produce a value.
+    emit_inst(RegisterInstruction::LoadNil);
+    emit_reg(dst);
+    return dst;
+}
+
+// Counts the defs that bind locals in a function body, which is every def that
+// is not inside a nested fn.
+int count_defs(std::unique_ptr<AST>& ast)
+{
+    if (ast->children.size() == 0)
+    {
+        return 0;
+    }
+
+    auto& head = ast->children[0];
+    uint32_t form = head->type == ASTType::Symbol ? head->token.id : SYM_EMPTY;
+
+    if (form == SYM_FN)
+    {
+        return 0;
+    }
+
+    int count = form == SYM_DEF;
+
+    for (auto& child : ast->children)
+    {
+        count += count_defs(child);
+    }
+
+    return count;
+}
+
+int RegisterCompiler::compile_fn(std::unique_ptr<AST>& ast, int dst,
+                                 const std::string& name, int self_register)
+{
+    if (dst < 0)
+    {
+        dst = alloc_register(ast);
+    }
+
+    auto proto = std::make_unique<RegisterProto>();
+    proto->name = name.empty() ? "<fn>" : name;
+
+    FunctionState state;
+    state.parent = fn;
+    state.proto = proto.get();
+    state.self_register = self_register;
+
+    auto& param_list = ast->children[1];
+
+    for (size_t i = 0; i < param_list->children.size(); i++)
+    {
+        auto& child = param_list->children[i];
+
+        if (child->type != ASTType::Symbol)
+        {
+            err_token(child->source, child->token,
+                      "parameter must be a symbol");
+        }
+
+        state.locals[child->token.id] = i;
+    }
+
+    int n_defs = 0;
+
+    for (size_t i = 2; i < ast->children.size(); i++)
+    {
+        n_defs += count_defs(ast->children[i]);
+    }
+
+    proto->n_params = param_list->children.size();
+    state.next_local = proto->n_params;
+    state.next_register = proto->n_params + n_defs;
+    proto->n_registers = state.next_register;
+
+    if (state.next_register > 256)
+    {
+        err_token(ast->source, ast->token,
+                  "function needs more than 256 registers");
+    }
+
+    fn = &state;
+
+    int result = -1;
+    int mark = fn->next_register;
+
+    // The last expression of the body is in tail position.
+    for (size_t i = 2; i < ast->children.size(); i++)
+    {
+        fn->next_register = mark;
+        result = compile_expr(ast->children[i], -1,
+                              i == ast->children.size() - 1);
+    }
+
+    if (result < 0)
+    {
+        result = alloc_register(ast);
+        emit_inst(RegisterInstruction::LoadNil);
+        emit_reg(result);
+    }
+
+    emit_inst(RegisterInstruction::Ret);
+    emit_reg(result);
+
+    fn = state.parent;
+
+    int index = proc.protos.size();
+    proc.protos.push_back(std::move(proto));
+
+    emit_inst(RegisterInstruction::CreateClosure);
+    emit_reg(dst);
+    emit_int(index);
+    return dst;
+}
+
+int RegisterCompiler::compile_call(std::unique_ptr<AST>& ast, int dst,
+                                   bool tail)
+{
+    auto& first = ast->children[0];
+    int n_args = ast->children.size() - 1;
+
+    if (dst < 0)
+    {
+        dst = alloc_register(ast);
+    }
+
+    int mark = fn->next_register;
+    bool is_call_by_name = first->type == ASTType::Symbol;
+
+    int builtin = is_call_by_name ? global_builtin(first->token.id) : -1;
+
+    if (builtin >= 0)
+    {
+        compile_builtin(ast, register_builtins[builtin], dst);
+        fn->next_register = mark;
+        return dst;
+    }
+
+    // Put the arguments in consecutive registers above every live temporary.
+    int base = fn->next_register;
+
+    for (int i = 0; i < n_args; i++)
+    {
+        int reg = alloc_register(ast);
+        compile_expr(ast->children[i + 1], reg);
+        fn->next_register = reg + 1;
+    }
+
+    uint32_t symbol = first->token.id;
+    bool is_global = is_call_by_name
+        && fn->locals.count(symbol) == 0
+        && resolve_capture(fn, symbol) < 0;
+
+    if (is_global)
+    {
+        auto global = globals.find(symbol);
+
+        if (global == globals.end())
+        {
+            err_token(first->source, first->token,
+                      "Undefined function '" + first->symbol_name() + "'");
+        }
+
+        if (tail)
+        {
+            emit_inst(RegisterInstruction::TailCallGlobal);
+        }
+        else
+        {
+            emit_inst(RegisterInstruction::CallGlobal);
+            emit_reg(dst);
+        }
+
+        emit_int(global->second);
+        emit_reg(base);
+        emit_reg(n_args);
+    }
+    else
+    {
+        int callee = compile_expr(first, -1);
+
+        if (tail)
+        {
+            emit_inst(RegisterInstruction::TailCall);
+        }
+        else
+        {
+            emit_inst(RegisterInstruction::Call);
+            emit_reg(dst);
+        }
+
+        emit_reg(callee);
+        emit_reg(base);
+        emit_reg(n_args);
+    }
+
+    fn->next_register = mark;
+    return dst;
+}
+
+// Compiles a call by name to a builtin into dst. Arithmetic is applied to the
+// first two arguments and then to the result and each following argument, as
+// one three-address instruction each. Chained comparisons and builtins that
+// collect their arguments are a single reduction over all of them, and and/or
+// short-circuit.
+void RegisterCompiler::compile_builtin(std::unique_ptr<AST>& ast,
+                                       const RegisterBuiltinEntry& builtin,
+                                       int dst)
+{
+    auto& first = ast->children[0];
+    int n_args = ast->children.size() - 1;
+    bool fixed = builtin.kind == K::Fixed;
+
+    if (fixed ? n_args != builtin.num_args : n_args < builtin.num_args)
+    {
+        err_token(first->source, first->token,
+                  "'" + builtin.name + "' expects "
+                  + (fixed ? "" : "at least ")
+                  + std::to_string(builtin.num_args) + " arguments, but got "
+                  + std::to_string(n_args));
+    }
+
+    if (builtin.kind == K::Logical)
+    {
+        compile_logical(ast, builtin.reduce == RI::AndN, dst);
+        return;
+    }
+
+    if (builtin.kind == K::Collect
+        || (builtin.kind == K::Chain && n_args != 2))
+    {
+        int base = fn->next_register;
+
+        for (int i = 1; i <= n_args; i++)
+        {
+            int reg = alloc_register(ast);
+            compile_expr(ast->children[i], reg);
+            fn->next_register = reg + 1;
+        }
+
+        emit_inst(builtin.reduce);
+        emit_reg(dst);
+        emit_reg(base);
+        emit_reg(n_args);
+        return;
+    }
+
+    if (fixed && builtin.int_inst == RI::Halt)
+    {
+        std::vector<int> args;
+
+        for (int i = 1; i <= n_args; i++)
+        {
+            args.push_back(compile_expr(ast->children[i], -1));
+        }
+
+        emit_inst(builtin.inst);
+        emit_reg(dst);
+
+        for (int arg : args)
+        {
+            emit_reg(arg);
+        }
+
+        return;
+    }
+
+    if (n_args == 1)
+    {
+        compile_expr(ast->children[1], dst);
+        return;
+    }
+
+    // Partial results go in a temporary, so that dst isn't written before the
+    // last argument has been evaluated.
+    int acc = compile_expr(ast->children[1], -1);
+
+    for (int i = 2; i <= n_args; i++)
+    {
+        auto& right = ast->children[i];
+        int target = i == n_args ? dst : alloc_register(ast);
+
+        if (right->type == ASTType::IntLiteral)
+        {
+            emit_inst(builtin.int_inst);
+            emit_reg(target);
+            emit_reg(acc);
+            emit_int(right->int_value());
+        }
+        else
+        {
+            int b = compile_expr(right, -1);
+
+            emit_inst(builtin.inst);
+            emit_reg(target);
+            emit_reg(acc);
+            emit_reg(b);
+        }
+
+        acc = target;
+    }
+}
+
+// Compiles (and ...) or (or ...) into dst. Arguments are only evaluated until
+// one of them settles the result, which is always a boolean.
+void RegisterCompiler::compile_logical(std::unique_ptr<AST>& ast, bool is_and,
+                                       int dst)
+{
+    auto& code = fn->proto->code;
+    int mark = fn->next_register;
+    std::vector<size_t> settled;
+
+    for (size_t i = 1; i < ast->children.size(); i++)
+    {
+        int cond = compile_expr(ast->children[i], -1);
+        fn->next_register = mark;
+
+        settled.push_back(code.size());
+        emit_inst(is_and ? RI::JmpFalse : RI::JmpTrue);
+        emit_reg(cond);
+        emit_int(0);
+    }
+
+    emit_inst(is_and ? RI::LoadTrue : RI::LoadFalse);
+    emit_reg(dst);
+
+    size_t jmp = code.size();
+    emit_inst(RI::Jmp);
+    emit_int(0);
+
+    for (size_t jmp_settled : settled)
+    {
+        patch_int(jmp_settled + 2, code.size() - jmp_settled);
+    }
+
+    emit_inst(is_and ? RI::LoadFalse : RI::LoadTrue);
+    emit_reg(dst);
+
+    patch_int(jmp + 1, code.size() - jmp);
+}
+
+// tail is set if the expression is in tail position in a function body. Calls
+// in tail position reuse the caller's frame.
+int RegisterCompiler::compile_expr(std::unique_ptr<AST>& ast, int dst,
+                                   bool tail)
+{
+    if (ast->children.size() == 0)
+    {
+        if (ast->type == ASTType::Symbol)
+        {
+            return compile_symbol(ast, dst);
+        }
+
+        if (dst < 0)
+        {
+            dst = alloc_register(ast);
+        }
+
+        if (ast->type == ASTType::IntLiteral)
+        {
+            emit_inst(RegisterInstruction::LoadInt);
+            emit_reg(dst);
+            emit_int(ast->int_value());
+        }
+        else if (ast->type == ASTType::FloatLiteral)
+        {
+            emit_inst(RegisterInstruction::LoadFloat);
+            emit_reg(dst);
+            emit_float(ast->float_value());
+        }
+        else if (ast->type == ASTType::StrLiteral)
+        {
+            emit_inst(RegisterInstruction::LoadConst);
+            emit_reg(dst);
+            emit_int(add_constant(make_string(proc, ast->string_value())));
+        }
+        else if (ast->type == ASTType::BoolLiteral)
+        {
+            emit_inst(ast->text() == "true" ? RI::LoadTrue : RI::LoadFalse);
+            emit_reg(dst);
+        }
+        else
+        {
+            emit_inst(RegisterInstruction::LoadNil);
+            emit_reg(dst);
+        }
+
+        return dst;
+    }
+
+    auto& head = ast->children[0];
+
+    // Special forms are told apart from calls by the ID of their symbol.
+    uint32_t form = head->type == ASTType::Symbol ? head->token.id : SYM_EMPTY;
+
+    switch (form)
+    {
+    case SYM_DEF:
+        return compile_def(ast, dst);
+    case SYM_DO:
+        return compile_do(ast, dst, tail);
+    case SYM_IF:
+        return compile_if(ast, dst, tail);
+    case SYM_FN:
+        return compile_fn(ast, dst, "", -1);
+    default:
+        return compile_call(ast, dst, tail);
+    }
+}
+
+Value RegisterCompiler::eval_ast(std::unique_ptr<AST>& ast)
+{
+    // Every top-level form is compiled as the body of a function with no
+    // parameters, which ends in a Halt instead of a Ret.
+    RegisterProto toplevel;
+    toplevel.name = "<toplevel>";
+
+    FunctionState state;
+    state.proto = &toplevel;
+    fn = &state;
+
+    int result = compile_expr(ast, -1);
+
+    emit_inst(RegisterInstruction::Halt);
+    emit_reg(result);
+
+    fn = nullptr;
+    return proc.run(&toplevel);
+}
+
+GCStats RegisterCompiler::gc_stats()
+{
+    return proc.heap_stats();
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "ast.h"
+#include "environment.h"
+#include "register_processor.h"
+
+struct RegisterBuiltinEntry;
+
+// Compile-time state of a function whose code is currently being emitted.
+struct FunctionState
+{
+    // State of the enclosing function, or nullptr for a top-level form.
+    FunctionState* parent = nullptr;
+
+    RegisterProto* proto = nullptr;
+
+    // Symbols bound by this function's parameters and defs, and the
+    // registers they live in.
+    std::unordered_map<uint32_t, int> locals;
+
+    // Symbols captured from enclosing functions, and their capture indices.
+    std::unordered_map<uint32_t, int> captures;
+
+    // If this function is being bound by a def in its enclosing function, the
+    // register it is being bound to there. Otherwise -1.
+    int self_register = -1;
+
+    // Next register to hand out to a def. Locals are laid out right after the
+    // parameters, and temporaries come after all of the locals.
+    int next_local = 0;
+
+    // Next free temporary register.
+    int next_register = 0;
+};
+
+// Compiles ASTs to three-address register code and runs them on a
+// RegisterProcessor. This is an alternative to the stack machine that a
+// Runtime can be configured to use instead.
+class RegisterCompiler
+{
+
+private:
+    RegisterProcessor proc;
+
+    // Global symbols and their indices into proc.globals. The builtins are
+    // always the first globals.
+    std::unordered_map<uint32_t, int> globals;
+    int builtin_counter = 0;
+
+    // Function whose code is currently being emitted.
+    FunctionState* fn = nullptr;
+
+    void emit_inst(RegisterInstruction inst);
+    void emit_reg(int reg);
+    void emit_int(int i);
+    void emit_float(double d);
+    void patch_int(size_t pos, int i);
+    int add_constant(Value value);
+
+    int alloc_register(std::unique_ptr<AST>& ast);
+    int resolve_capture(FunctionState* state, uint32_t symbol);
+    int global_builtin(uint32_t symbol);
+
+    int compile_symbol(std::unique_ptr<AST>& ast, int dst);
+    int compile_do(std::unique_ptr<AST>& ast, int dst, bool tail);
+    int compile_if(std::unique_ptr<AST>& ast, int dst, bool tail);
+    int compile_def(std::unique_ptr<AST>& ast, int dst);
+    int compile_fn(std::unique_ptr<AST>& ast, int dst,
+                   const std::string& name, int self_register);
+    void compile_builtin(std::unique_ptr<AST>& ast,
+                         const RegisterBuiltinEntry& builtin, int dst);
+    void compile_logical(std::unique_ptr<AST>& ast, bool is_and, int dst);
+    int compile_call(std::unique_ptr<AST>& ast, int dst, bool tail);
+    int compile_expr(std::unique_ptr<AST>& ast, int dst, bool tail = false);
+
+public:
+
+    RegisterCompiler();
+
+    Value eval_ast(std::unique_ptr<AST>& ast);
+
+    // What the processor's garbage collector has done so far.
+    GCStats gc_stats();
+};
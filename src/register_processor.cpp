@@ -0,0 +1,678 @@
+#include "register_processor.h"
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <memory>
+
+#include "array.h"
+#include "map.h"
+#include "processor.h"
+
+// Instruction handlers for the register backend.
+//
+// Like the stack machine's handlers, these are inline functions that get
+// inlined into one threaded interpreter loop. They receive the instruction
+// pointer and the base of the current frame's registers by reference, so that
+// both can live in machine registers for the whole run.
+
+inline void load_int(RegisterProcessor&, unsigned char*& ip, Value*& base)
+{
+    base[ip[1]] = Value(mem_get<int>(ip + 2));
+    ip += 2 + sizeof(int);
+}
+
+inline void load_float(RegisterProcessor&, unsigned char*& ip, Value*& base)
+{
+    base[ip[1]] = Value(mem_get<double>(ip + 2));
+    ip += 2 + sizeof(double);
+}
+
+inline void load_const(RegisterProcessor &proc, unsigned char*& ip,
+                       Value*& base)
+{
+    auto& constants = proc.closure != nullptr ? proc.closure->proto->constants
+                                              : proc.toplevel->constants;
+
+    base[ip[1]] = constants[mem_get<int>(ip + 2)];
+    ip += 2 + sizeof(int);
+}
+
+inline void load_nil(RegisterProcessor&, unsigned char*& ip, Value*& base)
+{
+    base[ip[1]] = Value();
+    ip += 2;
+}
+
+inline void load_true(RegisterProcessor&, unsigned char*& ip, Value*& base)
+{
+    base[ip[1]] = Value(true);
+    ip += 2;
+}
+
+inline void load_false(RegisterProcessor&, unsigned char*& ip, Value*& base)
+{
+    base[ip[1]] = Value(false);
+    ip += 2;
+}
+
+inline void move(RegisterProcessor&, unsigned char*& ip, Value*& base)
+{
+    base[ip[1]] = base[ip[2]];
+    ip += 3;
+}
+
+inline void load_global(RegisterProcessor &proc, unsigned char*& ip,
+                        Value*& base)
+{
+    base[ip[1]] = proc.globals[mem_get<int>(ip + 2)];
+    ip += 2 + sizeof(int);
+}
+
+inline void store_global(RegisterProcessor &proc, unsigned char*& ip,
+                         Value*& base)
+{
+    proc.globals[mem_get<int>(ip + 1)] = base[ip[1 + sizeof(int)]];
+    ip += 2 + sizeof(int);
+}
+
+inline void load_capture(RegisterProcessor &proc, unsigned char*& ip,
+                         Value*& base)
+{
+    base[ip[1]] = proc.closure->captures[mem_get<int>(ip + 2)];
+    ip += 2 + sizeof(int);
+}
+
+// Collects garbage if it is due, before an instruction allocates. Whatever
+// the instruction works on has to still be in the current frame's registers.
+inline void collect_if_due(RegisterProcessor& proc, Value* base)
+{
+    if (proc.should_collect())
+    {
+        proc.collect(base);
+    }
+}
+
+inline void create_closure(RegisterProcessor &proc, unsigned char*& ip,
+                           Value*& base)
+{
+    RegisterProto* proto = proc.protos[mem_get<int>(ip + 2)].get();
+
+    // The captured values are still in registers here, so they survive.
+    collect_if_due(proc, base);
+
+    auto closure = proc.allocate<RegisterClosure>(proto);
+    closure->captures.reserve(proto->captures.size());
+
+    for (const auto& capture : proto->captures)
+    {
+        switch (capture.source)
+        {
+        case CaptureSource::Register:
+            closure->captures.push_back(base[capture.index]);
+            break;
+        case CaptureSource::Capture:
+            closure->captures.push_back(proc.closure->captures[capture.index]);
+            break;
+        case CaptureSource::Self:
+            closure->captures.push_back(Value(closure));
+            break;
+        }
+    }
+
+    base[ip[1]] = Value(closure);
+    ip += 2 + sizeof(int);
+}
+
+inline void jmp(RegisterProcessor&, unsigned char*& ip, Value*&)
+{
+    ip += mem_get<int>(ip + 1);
+}
+
+inline void jmp_false(RegisterProcessor&, unsigned char*& ip, Value*& base)
+{
+    if (!base[ip[1]].as<bool>())
+    {
+        ip += mem_get<int>(ip + 2);
+        return;
+    }
+
+    ip += 2 + sizeof(int);
+}
+
+inline void jmp_true(RegisterProcessor&, unsigned char*& ip, Value*& base)
+{
+    if (base[ip[1]].as<bool>())
+    {
+        ip += mem_get<int>(ip + 2);
+        return;
+    }
+
+    ip += 2 + sizeof(int);
+}
+
+inline void check_arity(RegisterProto* proto, int n_args)
+{
+    if (n_args == proto->n_params
+        || (proto->variadic && n_args > proto->n_params))
+    {
+        return;
+    }
+
+    printf("ERROR: %s expects %s%d arguments, but got %d\n",
+           proto->name.c_str(), proto->variadic ? "at least " : "",
+           proto->n_params, n_args);
+    exit(-1);
+}
+
+// Enters a closure whose arguments are already in the registers starting at
+// args. inst_size is the size of the call instruction.
+inline void enter(RegisterProcessor &proc, unsigned char*& ip, Value*& base,
+                  RegisterClosure* closure, Value* dst, Value* args,
+                  int n_args, int inst_size)
+{
+    RegisterProto* proto = closure->proto;
+
+    check_arity(proto, n_args);
+
+    // Every register the callee uses is in its frame, which has room for all
+    // of the arguments of a variadic call as well.
+    if (args - proc.registers.get() + std::max(proto->n_registers, n_args)
+        > REGISTER_FILE_SIZE)
+    {
+        printf("ERROR: Stack overflow\n");
+        exit(-1);
+    }
+
+    proc.frames.push_back({ ip + inst_size, base, dst, proc.closure });
+
+    proc.closure = closure;
+    proc.n_args = n_args;
+    base = args;
+    ip = proto->code.data();
+}
+
+inline void call(RegisterProcessor &proc, unsigned char*& ip, Value*& base)
+{
+    auto closure = static_cast<RegisterClosure*>(base[ip[2]].as_object());
+    enter(proc, ip, base, closure, &base[ip[1]], &base[ip[3]], ip[4], 5);
+}
+
+inline void call_global(RegisterProcessor &proc, unsigned char*& ip,
+                        Value*& base)
+{
+    auto closure = static_cast<RegisterClosure*>(
+        proc.globals[mem_get<int>(ip + 2)].as_object());
+
+    enter(proc, ip, base, closure, &base[ip[1]],
+          &base[ip[2 + sizeof(int)]], ip[3 + sizeof(int)], 4 + sizeof(int));
+}
+
+// Enters a closure whose arguments are in the registers starting at args,
+// reusing the current frame.
+inline void tail_enter(RegisterProcessor &proc, unsigned char*& ip,
+                       Value*& base, RegisterClosure* closure, Value* args,
+                       int n_args)
+{
+    RegisterProto* proto = closure->proto;
+
+    check_arity(proto, n_args);
+
+    if (base - proc.registers.get() + std::max(proto->n_registers, n_args)
+        > REGISTER_FILE_SIZE)
+    {
+        printf("ERROR: Stack overflow\n");
+        exit(-1);
+    }
+
+    for (int i = 0; i < n_args; i++)
+    {
+        base[i] = args[i];
+    }
+
+    proc.closure = closure;
+    proc.n_args = n_args;
+    ip = proto->code.data();
+}
+
+inline void tail_call(RegisterProcessor &proc, unsigned char*& ip,
+                      Value*& base)
+{
+    auto closure = static_cast<RegisterClosure*>(base[ip[1]].as_object());
+    tail_enter(proc, ip, base, closure, &base[ip[2]], ip[3]);
+}
+
+inline void tail_call_global(RegisterProcessor &proc, unsigned char*& ip,
+                             Value*& base)
+{
+    auto closure = static_cast<RegisterClosure*>(
+        proc.globals[mem_get<int>(ip + 1)].as_object());
+
+    tail_enter(proc, ip, base, closure, &base[ip[1 + sizeof(int)]],
+               ip[2 + sizeof(int)]);
+}
+
+inline void ret(RegisterProcessor &proc, unsigned char*& ip, Value*& base)
+{
+    Value result = base[ip[1]];
+    RegisterFrame& frame = proc.frames.back();
+
+    *frame.dst = result;
+    ip = frame.ret_ip;
+    base = frame.base;
+    proc.closure = frame.closure;
+
+    proc.frames.pop_back();
+}
+
+template <template <typename> class Operation>
+inline void binary(RegisterProcessor&, unsigned char*& ip, Value*& base)
+{
+    base[ip[1]] = apply_binary<Operation>(base[ip[2]], base[ip[3]]);
+    ip += 4;
+}
+
+template <template <typename> class Operation>
+inline void binary_int(RegisterProcessor&, unsigned char*& ip, Value*& base)
+{
+    Value a = base[ip[2]];
+    int b = mem_get<int>(ip + 3);
+    base[ip[1]] = a.is_int() ? Value(int_operation<Operation>(a.as_int(), b))
+                             : apply_binary<Operation>(a, Value(b));
+    ip += 3 + sizeof(int);
+}
+
+template <Value (*reduction)(const Value*, int)>
+inline void reduce(RegisterProcessor &proc, unsigned char*& ip, Value*& base)
+{
+    int n = ip[3] == 0 ? proc.n_args : ip[3];
+    base[ip[1]] = reduction(&base[ip[2]], n);
+    ip += 4;
+}
+
+// The array, string and map builtins. Those that allocate collect first if
+// it is due, while their operands are still in registers, since the builtins
+// themselves never collect.
+
+template <Value (*op)(RegisterProcessor&, const Value*, int)>
+inline void make_from(RegisterProcessor &proc, unsigned char*& ip,
+                      Value*& base)
+{
+    collect_if_due(proc, base);
+
+    int n = ip[3] == 0 ? proc.n_args : ip[3];
+    base[ip[1]] = op(proc, &base[ip[2]], n);
+    ip += 4;
+}
+
+template <Value (*op)(Value)>
+inline void array_unary(RegisterProcessor&, unsigned char*& ip, Value*& base)
+{
+    base[ip[1]] = op(base[ip[2]]);
+    ip += 3;
+}
+
+template <Value (*op)(Value, Value)>
+inline void array_binary(RegisterProcessor&, unsigned char*& ip, Value*& base)
+{
+    base[ip[1]] = op(base[ip[2]], base[ip[3]]);
+    ip += 4;
+}
+
+inline void range(RegisterProcessor &proc, unsigned char*& ip, Value*& base)
+{
+    collect_if_due(proc, base);
+    base[ip[1]] = array_range(proc, base[ip[2]]);
+    ip += 3;
+}
+
+template <Value (*op)(RegisterProcessor&, Value, Value)>
+inline void array_build(RegisterProcessor &proc, unsigned char*& ip,
+                        Value*& base)
+{
+    collect_if_due(proc, base);
+    base[ip[1]] = op(proc, base[ip[2]], base[ip[3]]);
+    ip += 4;
+}
+
+template <Value (*op)(RegisterProcessor&, Value, Value, Value)>
+inline void build3(RegisterProcessor &proc, unsigned char*& ip, Value*& base)
+{
+    collect_if_due(proc, base);
+    base[ip[1]] = op(proc, base[ip[2]], base[ip[3]], base[ip[4]]);
+    ip += 5;
+}
+
+inline void make_map(RegisterProcessor &proc, unsigned char*& ip,
+                     Value*& base)
+{
+    collect_if_due(proc, base);
+    base[ip[1]] = map_new(proc);
+    ip += 2;
+}
+
+// Every instruction except Halt, along with its handler.
+#define REGISTER_INSTRUCTIONS(X)                                        \
+    X(LoadInt, load_int)                                                \
+    X(LoadFloat, load_float)                                            \
+    X(LoadConst, load_const)                                            \
+    X(LoadNil, load_nil)                                                \
+    X(LoadTrue, load_true)                                              \
+    X(LoadFalse, load_false)                                            \
+    X(Move, move)                                                       \
+    X(LoadGlobal, load_global)                                          \
+    X(StoreGlobal, store_global)                                        \
+    X(LoadCapture, load_capture)                                        \
+    X(CreateClosure, create_closure)                                    \
+    X(Jmp, jmp)                                                         \
+    X(JmpFalse, jmp_false)                                              \
+    X(JmpTrue, jmp_true)                                                \
+    X(Call, call)                                                       \
+    X(CallGlobal, call_global)                                          \
+    X(TailCall, tail_call)                                              \
+    X(TailCallGlobal, tail_call_global)                                 \
+    X(Ret, ret)                                                         \
+    X(Add, binary<std::plus>)                                           \
+    X(Sub, binary<std::minus>)                                          \
+    X(Mul, binary<std::multiplies>)                                     \
+    X(Div, binary<std::divides>)                                        \
+    X(Eq, binary<std::equal_to>)                                        \
+    X(Greater, binary<std::greater>)                                    \
+    X(GreaterEq, binary<std::greater_equal>)                            \
+    X(Less, binary<std::less>)                                          \
+    X(LessEq, binary<std::less_equal>)                                  \
+    X(Min, binary<minimum>)                                             \
+    X(Max, binary<maximum>)                                             \
+    X(AddInt, binary_int<std::plus>)                                    \
+    X(SubInt, binary_int<std::minus>)                                   \
+    X(MulInt, binary_int<std::multiplies>)                              \
+    X(DivInt, binary_int<std::divides>)                                 \
+    X(EqInt, binary_int<std::equal_to>)                                 \
+    X(GreaterInt, binary_int<std::greater>)                             \
+    X(GreaterEqInt, binary_int<std::greater_equal>)                     \
+    X(LessInt, binary_int<std::less>)                                   \
+    X(LessEqInt, binary_int<std::less_equal>)                           \
+    X(MinInt, binary_int<minimum>)                                      \
+    X(MaxInt, binary_int<maximum>)                                      \
+    X(AddN, reduce<fold_values<std::plus>>)                             \
+    X(MulN, reduce<fold_values<std::multiplies>>)                       \
+    X(MinN, reduce<fold_values<minimum>>)                               \
+    X(MaxN, reduce<fold_values<maximum>>)                               \
+    X(AndN, reduce<all_true>)                                           \
+    X(OrN, reduce<any_true>)                                            \
+    X(EqN, reduce<chain_values<std::equal_to>>)                         \
+    X(GreaterN, reduce<chain_values<std::greater>>)                     \
+    X(GreaterEqN, reduce<chain_values<std::greater_equal>>)             \
+    X(LessN, reduce<chain_values<std::less>>)                           \
+    X(LessEqN, reduce<chain_values<std::less_equal>>)                   \
+    X(IntArray, make_from<array_of_values<ElementType::Int>>)           \
+    X(FloatArray, make_from<array_of_values<ElementType::Float>>)       \
+    X(Range, range)                                                     \
+    X(Length, array_unary<array_length>)                                \
+    X(At, array_binary<array_at>)                                       \
+    X(Sum, array_unary<array_sum>)                                      \
+    X(Dot, array_binary<array_dot>)                                     \
+    X(MapAdd, array_build<array_map_add<RegisterProcessor>>)            \
+    X(Scale, array_build<array_scale<RegisterProcessor>>)               \
+    X(FilterLess, array_build<array_filter_less<RegisterProcessor>>)    \
+    X(ArgMax, array_unary<array_argmax>)                                \
+    X(Concat, make_from<string_concat<RegisterProcessor>>)              \
+    X(Substring, build3<string_substring<RegisterProcessor>>)           \
+    X(MakeMap, make_map)                                                \
+    X(MapGet, array_binary<map_get>)                                    \
+    X(MapPut, build3<map_put<RegisterProcessor>>)                       \
+    X(MapHas, array_binary<map_has>)                                    \
+    X(Count, array_unary<map_count>)
+
+Value RegisterProcessor::run(RegisterProto* proto)
+{
+    unsigned char* ip = proto->code.data();
+    Value* base = registers.get();
+
+    closure = nullptr;
+    toplevel = proto;
+
+#if defined(__GNUC__)
+    void* labels[256];
+
+    for (auto& label : labels)
+    {
+        label = &&unknown;
+    }
+
+    labels[(unsigned long) RegisterInstruction::Halt] = &&halt;
+
+#define LABEL_ENTRY(id, fun)                                            \
+    labels[(unsigned long) RegisterInstruction::id] = &&op_##id;
+    REGISTER_INSTRUCTIONS(LABEL_ENTRY)
+#undef LABEL_ENTRY
+
+    goto *labels[*ip];
+
+#define LABEL_BODY(id, fun)                     \
+    op_##id:                                    \
+    fun(*this, ip, base);                       \
+    goto *labels[*ip];
+    REGISTER_INSTRUCTIONS(LABEL_BODY)
+#undef LABEL_BODY
+
+#else
+    for (;;)
+    {
+        switch (static_cast<RegisterInstruction>(*ip))
+        {
+#define CASE_BODY(id, fun)                      \
+        case RegisterInstruction::id:           \
+            fun(*this, ip, base);               \
+            break;
+            REGISTER_INSTRUCTIONS(CASE_BODY)
+#undef CASE_BODY
+        case RegisterInstruction::Halt:
+            goto halt;
+        default:
+            goto unknown;
+        }
+    }
+#endif
+
+unknown:
+    printf("ERROR: Unknown instruction %d\n", *ip);
+    exit(-1);
+
+halt:
+    return base[ip[1]];
+}
+
+// Size of a heap object, including everything it owns.
+static size_t register_object_size(Object* object)
+{
+    if (object->type != ValueType::Closure)
+    {
+        return object_size(object);
+    }
+
+    auto closure = static_cast<RegisterClosure*>(object);
+    return sizeof(RegisterClosure)
+        + closure->captures.capacity() * sizeof(Value);
+}
+
+static void free_register_object(Object* object)
+{
+    if (object->type == ValueType::Closure)
+    {
+        delete static_cast<RegisterClosure*>(object);
+        return;
+    }
+
+    free_object(object);
+}
+
+// Marks a value as reachable, if it is a heap object that hasn't been marked
+// yet, and queues it up so that its references are followed.
+void RegisterProcessor::mark(Value value)
+{
+    if (!value.is_object())
+    {
+        return;
+    }
+
+    Object* object = value.as_object();
+
+    if (!object->marked)
+    {
+        object->marked = true;
+        gray.push_back(object);
+    }
+}
+
+// Follows the references of an object that has been marked.
+void RegisterProcessor::trace(Object* object)
+{
+    trace_references(object, [this](Value value) { mark(value); });
+
+    if (object->type == ValueType::Closure)
+    {
+        for (Value value : static_cast<RegisterClosure*>(object)->captures)
+        {
+            mark(value);
+        }
+    }
+}
+
+// Frees every heap object that is not reachable from the roots: the globals,
+// the registers of every frame up to the end of the current one at base, the
+// closures that are running, and the constants of the top-level form and of
+// every prototype. Prototypes themselves are never freed.
+//
+// The registers above the current frame are cleared, so that nothing can read
+// a freed object out of them later. A def in a branch that wasn't taken leaves
+// its register as it was, so a frame can read a register it never wrote.
+void RegisterProcessor::collect(Value* base)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    gc_stats.peak_heap_bytes = std::max(gc_stats.peak_heap_bytes, heap_bytes);
+
+    // Mark:
+    RegisterProto* proto = closure != nullptr ? closure->proto : toplevel;
+
+    // A variadic builtin can be called with more arguments than it has
+    // registers.
+    Value* top = base + std::max(proto->n_registers, n_args);
+    Value* end = registers.get() + REGISTER_FILE_SIZE;
+
+    for (Value* value = registers.get(); value < top; value++)
+    {
+        mark(*value);
+    }
+
+    std::fill(top, end, Value());
+
+    for (Value value : globals)
+    {
+        mark(value);
+    }
+
+    if (closure != nullptr)
+    {
+        mark(Value(closure));
+    }
+
+    for (auto& frame : frames)
+    {
+        if (frame.closure != nullptr)
+        {
+            mark(Value(frame.closure));
+        }
+    }
+
+    for (Value value : toplevel->constants)
+    {
+        mark(value);
+    }
+
+    for (auto& proto : protos)
+    {
+        for (Value value : proto->constants)
+        {
+            mark(value);
+        }
+    }
+
+    while (gray.size() > 0)
+    {
+        Object* object = gray.back();
+        gray.pop_back();
+        trace(object);
+    }
+
+    // Sweep:
+    Object** link = &objects;
+    size_t live_bytes = 0;
+    size_t n_live = 0;
+
+    while (*link != nullptr)
+    {
+        Object* object = *link;
+        size_t size = register_object_size(object);
+
+        if (object->marked)
+        {
+            object->marked = false;
+            live_bytes += size;
+            n_live++;
+            link = &object->next;
+            continue;
+        }
+
+        *link = object->next;
+
+        if (object->type == ValueType::Str
+            && static_cast<String*>(object)->kind == StringKind::Flat)
+        {
+            strings.erase(static_cast<FlatString*>(object));
+        }
+
+        free_register_object(object);
+
+        gc_stats.n_freed++;
+        gc_stats.freed_bytes += size;
+    }
+
+    heap_bytes = live_bytes;
+    next_collection = std::max<size_t>(PROC_GC_MIN, 2 * live_bytes);
+
+    auto finish = std::chrono::steady_clock::now();
+    uint64_t pause = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        finish - start).count();
+
+    gc_stats.n_collections++;
+    gc_stats.total_pause_ns += pause;
+    gc_stats.max_pause_ns = std::max(gc_stats.max_pause_ns, pause);
+    gc_stats.n_objects = n_live;
+}
+
+GCStats RegisterProcessor::heap_stats()
+{
+    GCStats stats = gc_stats;
+
+    stats.heap_bytes = heap_bytes;
+    stats.peak_heap_bytes = std::max(stats.peak_heap_bytes, heap_bytes);
+
+    return stats;
+}
+
+RegisterProcessor::RegisterProcessor()
+{
+    registers.reset(new Value[REGISTER_FILE_SIZE]);
+}
+
+RegisterProcessor::~RegisterProcessor()
+{
+    while (objects != nullptr)
+    {
+        Object* next = objects->next;
+        free_register_object(objects);
+        objects = next;
+    }
+}
@@ -0,0 +1,207 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "environment.h"
+#include "processor.h"
+#include "register_bytecode.h"
+#include "str.h"
+
+#define REGISTER_FILE_SIZE (1 << 16)
+
+// Where a closure gets one of its captured values from when it is created.
+enum class CaptureSource
+{
+    // A register in the frame that creates the closure.
+    Register,
+
+    // One of the captured values of the closure that creates the closure.
+    Capture,
+
+    // The closure itself. Used by local functions that refer to their own name.
+    Self,
+};
+
+struct CaptureInfo
+{
+    CaptureSource source;
+    int index;
+};
+
+// Everything the register backend knows about a compiled function. Prototypes
+// are created once by the compiler and shared by every closure made from them.
+struct RegisterProto
+{
+    std::string name;
+    int n_params = 0;
+
+    // Whether the function takes n_params or more arguments. Only builtins
+    // are variadic.
+    bool variadic = false;
+
+    // Size of the function's register file. The parameters are the first
+    // n_params registers.
+    int n_registers = 0;
+
+    std::vector<CaptureInfo> captures;
+    std::vector<unsigned char> code;
+
+    // Values that LoadConst loads, by index.
+    std::vector<Value> constants;
+};
+
+struct RegisterClosure : Object
+{
+    RegisterProto* proto;
+
+    // Values captured from the enclosing functions when the closure was
+    // created, in the order given by proto->captures.
+    std::vector<Value> captures;
+
+    RegisterClosure(RegisterProto* proto)
+        : Object(ValueType::Closure), proto(proto)
+    {
+
+    }
+};
+
+// Bookkeeping for a function call that we need in order to return from it.
+struct RegisterFrame
+{
+    unsigned char* ret_ip;
+    Value* base;
+
+    // Register in the caller's frame that receives the return value.
+    Value* dst;
+
+    RegisterClosure* closure;
+};
+
+struct RegisterProcessor
+{
+    // All frames' registers live in this one buffer. A frame is a window into
+    // it starting at the frame's base, and a callee's window starts at the
+    // registers its caller put the arguments in.
+    std::unique_ptr<Value[]> registers;
+
+    std::vector<RegisterFrame> frames;
+
+    // Closure whose code is currently running, or nullptr at the top level.
+    RegisterClosure* closure = nullptr;
+
+    // Prototype of the top-level form that is running.
+    RegisterProto* toplevel = nullptr;
+
+    std::vector<Value> globals;
+
+    // Number of arguments the running function was called with, which only
+    // differs from its n_params if it is variadic.
+    int n_args = 0;
+
+    // Every prototype the compiler has produced, indexed by CreateClosure.
+    std::vector<std::unique_ptr<RegisterProto>> protos;
+
+    // Every heap object allocated by the processor, linked through
+    // Object::next. Unreachable ones are freed by collect(), and the rest are
+    // freed when the processor is destroyed.
+    Object* objects = nullptr;
+
+    // Size of all heap objects, and the size at which the next collection
+    // runs.
+    size_t heap_bytes = 0;
+    size_t next_collection = PROC_GC_MIN;
+
+    GCStats gc_stats;
+
+    // Objects that have been marked but whose references haven't been
+    // followed yet.
+    std::vector<Object*> gray;
+
+    // Every flat string the processor has made.
+    StringTable strings;
+
+    template <typename T, typename... Args> T* allocate(Args&&... args);
+
+    inline bool should_collect()
+    {
+        return heap_bytes >= next_collection;
+    }
+
+    void mark(Value value);
+    void trace(Object* object);
+    void collect(Value* base);
+
+    GCStats heap_stats();
+
+    // Runs the code of a top-level prototype until it halts, and returns the
+    // value it halted with.
+    Value run(RegisterProto* proto);
+
+    RegisterProcessor();
+    RegisterProcessor(const RegisterProcessor&) = delete;
+    ~RegisterProcessor();
+};
+
+// Allocates a heap object and links it into the processor's object list. This
+// never collects, so instructions that allocate check should_collect() before
+// they start, while everything they work on is still in registers.
+template <typename T, typename... Args>
+T* RegisterProcessor::allocate(Args&&... args)
+{
+    T* object = new T(std::forward<Args>(args)...);
+    object->next = objects;
+    objects = object;
+
+    heap_bytes += sizeof(T);
+    gc_stats.n_objects++;
+    return object;
+}
+
+// Allocates an array with room for capacity elements. As on the stack
+// machine, its elements count towards the size of the heap.
+inline Array* allocate_array(RegisterProcessor& proc, ElementType type,
+                             size_t capacity)
+{
+    auto array = proc.allocate<Array>(type, capacity);
+    proc.heap_bytes += Array::size(capacity) - sizeof(Array);
+    return array;
+}
+
+// Allocates an empty map, whose table counts towards the size of the heap.
+inline Map* allocate_map(RegisterProcessor& proc)
+{
+    auto map = proc.allocate<Map>(MAP_GROUP_SIZE);
+    proc.heap_bytes += Map::table_size(MAP_GROUP_SIZE);
+    return map;
+}
+
+// Counts the bigger table that a map has grown to.
+inline void map_grown(RegisterProcessor& proc, size_t old_capacity,
+                      size_t capacity)
+{
+    proc.heap_bytes += Map::table_size(capacity)
+        - Map::table_size(old_capacity);
+}
+
+// Nothing is ever allocated anywhere but on the heap.
+inline Value to_heap(RegisterProcessor&, Value value)
+{
+    return value;
+}
+
+// Allocates a string object of size bytes, which can be bigger than T.
+template <typename T, typename... Args>
+inline T* allocate_string(RegisterProcessor& proc, size_t size,
+                          Args&&... args)
+{
+    T* object = new (::operator new(size)) T(std::forward<Args>(args)...);
+    object->next = proc.objects;
+    proc.objects = object;
+
+    proc.heap_bytes += size;
+    proc.gc_stats.n_objects++;
+    return object;
+}
@@ -41,6 +41,8 @@
 #include "runtime.h"
 #include <stddef.h>
 
+#include <algorithm>
+#include <climits>
 #include <cstring>
 #include <iostream>
 #include <math.h>
@@ -51,104 +53,509 @@
 struct BuiltinEntry
 {
     std::string name;
+
+    // Number of arguments, or the least number for a builtin that isn't
+    // Fixed.
     int num_args;
-    bool variadic;
+    BuiltinKind kind;
+
+    // Instruction that a call by name is compiled to.
     Instruction inst;
 
-    BuiltinEntry(std::string name, int n_args, bool variadic, Instruction inst)
-        : name(name), num_args(n_args), variadic(variadic), inst(inst)
-    {
-        
-    }
+    // Instruction that takes all of the arguments at once, which is what the
+    // builtin's own code runs if it isn't Fixed.
+    Instruction reduce;
+};
+
+using I = Instruction;
+using K = BuiltinKind;
+
+// The builtins, in the order of their global slots.
+const BuiltinEntry builtins[] = {
+
+    // Function name, # args, kind, inst, reduction
+    { "+",           1, K::Fold,    I::Add,         I::AddN },
+    { "-",           2, K::Fixed,   I::Sub,         I::Sub },
+    { "*",           1, K::Fold,    I::Mul,         I::MulN },
+    { "/",           2, K::Fixed,   I::Div,         I::Div },
+    { "=",           1, K::Chain,   I::Eq,          I::EqN },
+    { ">",           1, K::Chain,   I::Greater,     I::GreaterN },
+    { ">=",          1, K::Chain,   I::GreaterEq,   I::GreaterEqN },
+    { "<",           1, K::Chain,   I::Less,        I::LessN },
+    { "<=",          1, K::Chain,   I::LessEq,      I::LessEqN },
+    { "min",         1, K::Fold,    I::Min,         I::MinN },
+    { "max",         1, K::Fold,    I::Max,         I::MaxN },
+    { "and",         1, K::Logical, I::And,         I::AndN },
+    { "or",          1, K::Logical, I::Or,          I::OrN },
+    { "int-array",   1, K::Collect, I::IntArray,    I::IntArray },
+    { "float-array", 1, K::Collect, I::FloatArray,  I::FloatArray },
+    { "range",       1, K::Fixed,   I::Range,       I::Range },
+    { "length",      1, K::Fixed,   I::Length,      I::Length },
+    { "at",          2, K::Fixed,   I::At,          I::At },
+    { "sum",         1, K::Fixed,   I::Sum,         I::Sum },
+    { "dot",         2, K::Fixed,   I::Dot,         I::Dot },
+    { "map+",        2, K::Fixed,   I::MapAdd,      I::MapAdd },
+    { "scale",       2, K::Fixed,   I::Scale,       I::Scale },
+    { "filter<",     2, K::Fixed,   I::FilterLess,  I::FilterLess },
+    { "argmax",      1, K::Fixed,   I::ArgMax,      I::ArgMax },
+    { "concat",      1, K::Collect, I::Concat,      I::Concat },
+    { "substring",   3, K::Fixed,   I::Substring,   I::Substring },
+    { "hash-map",    0, K::Fixed,   I::MakeMap,     I::MakeMap },
+    { "get",         2, K::Fixed,   I::MapGet,      I::MapGet },
+    { "put",         3, K::Fixed,   I::MapPut,      I::MapPut },
+    { "has?",        2, K::Fixed,   I::MapHas,      I::MapHas },
+    { "count",       1, K::Fixed,   I::Count,       I::Count },
 };
 
-Runtime::Runtime()
+Runtime::Runtime(RuntimeOptions options) : options(options)
 {
+    proc.dispatch = options.dispatch;
+
+    if (options.profile)
+    {
+        proc.profile = std::make_unique<Profile>();
+    }
+
+    if (options.backend == Backend::Register)
+    {
+        register_backend = std::make_unique<RegisterCompiler>();
+    }
+
     scopes.push_back(Scope());
 
     // Initialize default runtime environment:
-    auto& env = proc.envs.back();
     auto& scope = scopes.back();
 
-    const BuiltinEntry builtins[] = {
-
-        // Function name, # args, variadic, inst
-        BuiltinEntry("+",    2, false, Instruction::Add),
-        BuiltinEntry("-",    2, false, Instruction::Sub),
-        BuiltinEntry("*",    2, false, Instruction::Mul),
-        BuiltinEntry("/",    2, false, Instruction::Div),
-        BuiltinEntry("=",    2, false, Instruction::Eq),
-        BuiltinEntry(">",    2, false, Instruction::Greater),
-        BuiltinEntry(">=",   2, false, Instruction::GreaterEq),
-        BuiltinEntry("<",    2, false, Instruction::Less),
-        BuiltinEntry("<=",   2, false, Instruction::LessEq),
-    };
-
     // Insert builtin information into the global scope and the
     // global processor environment.
     for (const auto& builtin : builtins)
     {
         auto& fn_name = builtin.name;
-        int n_args = builtin.num_args;
-        bool variadic = builtin.variadic;
-        Instruction instruction = builtin.inst;
-
-        // TODO: Maybe constructing closures shouldn't be this annoying.
-        auto c = std::make_shared<Closure>(
-            n_args,
-            variadic,
-            static_cast<unsigned char>(instruction));
-        
-        Value v;
-        v.type = ValueType::Closure;
-        v.value = c;
 
-        scope.var_indices[fn_name] = var_counter;
-        env[var_counter] = std::make_shared<Value>(v);
+        auto proto = std::make_unique<FunctionProto>();
+        proto->name = fn_name;
+        proto->n_args = builtin.num_args;
+        proto->last_param_variadic = builtin.kind != BuiltinKind::Fixed;
+
+        // Builtins are usually inlined at the call site, but when one is
+        // called indirectly it needs to return like any other closure. A
+        // variadic one reduces however many arguments it was given.
+        if (proto->last_param_variadic)
+        {
+            proto->code.push_back(static_cast<unsigned char>(builtin.reduce));
+            proto->code.resize(proto->code.size() + sizeof(int));
+        }
+        else
+        {
+            proto->code.push_back(static_cast<unsigned char>(builtin.inst));
+        }
+
+        proto->code.push_back(static_cast<unsigned char>(Instruction::Ret));
+        proto->entry = proto->code.data();
+        proto->code_size = proto->code.size();
+        proto->max_stack = proc.stack_depth(proto->code.data(),
+                                            proto->code.size());
+
+        auto c = proc.allocate<Closure>(Closure::size(proto.get()), proto.get());
+        proc.protos.push_back(std::move(proto));
+
+        bind(0, symbols().intern(fn_name),
+             { BindingKind::Global, scope.n_slots++ });
+        proc.globals.push_back(Value(c));
 
-        var_counter++;
         builtin_counter++;
     }
+
+    // The builtins live as long as the runtime, so they stay on the heap.
+    proc.use_region = options.region_heap;
+}
+
+// Appends a single instruction byte to the code being emitted.
+inline void Runtime::emit_inst(Instruction inst)
+{
+    code->push_back(static_cast<unsigned char>(inst));
+}
+
+// Appends an integer operand to the code being emitted.
+inline void Runtime::emit_int(int i)
+{
+    code->resize(code->size() + sizeof(int));
+    mem_put<int>(i, &(*code)[code->size() - sizeof(int)]);
+}
+
+// Overwrites the integer operand at pos, which has already been emitted.
+inline void Runtime::patch_int(size_t pos, int i)
+{
+    mem_put<int>(i, &(*code)[pos]);
 }
 
 // Relative emit - emits an int exactly at write_offset, then advances
 // write_offset.
 inline void Runtime::emit_push_int(int i)
 {
-    mem_put<Instruction>(Instruction::PushInt, proc.write_head);
-    proc.write_head += sizeof(Instruction);
+    emit_inst(Instruction::PushInt);
+    emit_int(i);
+}
 
-    mem_put<int>(i, proc.write_head);
-    proc.write_head += sizeof(int);
+// Floats are immediate operands too, so pushing one never allocates.
+inline void Runtime::emit_push_float(double d)
+{
+    emit_inst(Instruction::PushFloat);
+    code->resize(code->size() + sizeof(double));
+    mem_put<double>(d, &(*code)[code->size() - sizeof(double)]);
 }
-                                                                                  
-// Emit a push_ref instruction for a symbol.
-inline void Runtime::emit_push_ref(std::unique_ptr<AST>& ast)
+
+// Strings are made when the code is compiled, and kept in the constants of the
+// function being compiled, or of the top-level code. The same literal is only
+// kept once per function.
+void Runtime::emit_push_string(std::string_view chars)
 {
-    // Figure out this ref's index. Start at the current environment and go back
-    // up the stack, looking for the name. If not found, error out.
-    auto& name = ast->token->string_value;
-    
-    int var_index = -1;
-    for (int i = scopes.size() - 1; i >= 0; i--)
+    auto& constants = scopes.back().proto != nullptr
+        ? scopes.back().proto->constants
+        : proc.constants;
+    Value value = make_string(proc, chars);
+    size_t index = 0;
+
+    while (index < constants.size() && constants[index].bits != value.bits)
+    {
+        index++;
+    }
+
+    if (index == constants.size())
+    {
+        constants.push_back(value);
+    }
+
+    emit_inst(Instruction::PushConst);
+    emit_int(index);
+}
+
+// Emit the instruction that pushes a value the compiler has worked out, which
+// is a number or a boolean.
+void Runtime::emit_constant(Value value)
+{
+    if (value.is_int())
+    {
+        emit_push_int(value.as_int());
+    }
+    else if (value.is_float())
+    {
+        emit_push_float(value.as_float());
+    }
+    else
+    {
+        emit_inst(value.as_bool() ? Instruction::PushTrue
+                                  : Instruction::PushFalse);
+    }
+}
+
+// Binds a symbol in the given scope, shadowing whatever it was bound to in the
+// scopes that enclose it. The scope must be the innermost one the symbol is
+// bound in.
+void Runtime::bind(size_t scope, uint32_t symbol, Binding binding)
+{
+    if (symbol >= bound.size())
+    {
+        bound.resize(symbols().size(), -1);
+    }
+
+    int entry;
+
+    if (free_entries.size() > 0)
+    {
+        entry = free_entries.back();
+        free_entries.pop_back();
+    }
+    else
+    {
+        entry = entries.size();
+        entries.emplace_back();
+    }
+
+    entries[entry] = { static_cast<int>(scope), binding, bound[symbol] };
+    bound[symbol] = entry;
+    scopes[scope].symbols.push_back(symbol);
+}
+
+// Ends the innermost scope, unbinds every symbol that was bound in it, and
+// returns it.
+Scope Runtime::pop_scope()
+{
+    Scope scope = std::move(scopes.back());
+    scopes.pop_back();
+
+    for (auto it = scope.symbols.rbegin(); it != scope.symbols.rend(); it++)
+    {
+        int entry = bound[*it];
+        bound[*it] = entries[entry].shadowed;
+        free_entries.push_back(entry);
+    }
+
+    return scope;
+}
+
+// Unbinds the last n symbols bound in the innermost scope, ahead of the end of
+// the scope.
+void Runtime::unbind(size_t n)
+{
+    auto& scope = scopes.back();
+
+    for (size_t i = 0; i < n; i++)
+    {
+        uint32_t symbol = scope.symbols.back();
+        int entry = bound[symbol];
+
+        bound[symbol] = entries[entry].shadowed;
+        free_entries.push_back(entry);
+        scope.symbols.pop_back();
+    }
+}
+
+// Finds where a symbol is stored, as seen from the function of the given
+// scope. If it belongs to an enclosing function, it becomes one of the
+// function's captures, and of the captures of every function in between.
+// Returns false if the symbol is not bound anywhere.
+//
+// Nothing is bound in a scope inside the given one while this runs, so the
+// symbol's innermost entry is the only one that can be in the given scope.
+bool Runtime::resolve(size_t scope_index, uint32_t symbol, Binding& binding)
+{
+    int entry = symbol < bound.size() ? bound[symbol] : -1;
+
+    if (entry >= 0 && entries[entry].scope == static_cast<int>(scope_index))
+    {
+        binding = entries[entry].binding;
+        return true;
+    }
+
+    if (scope_index == 0)
+    {
+        return false;
+    }
+
+    Binding outer;
+
+    if (!resolve(scope_index - 1, symbol, outer))
+    {
+        return false;
+    }
+
+    if (outer.kind == BindingKind::Global
+        || outer.kind == BindingKind::Constant)
+    {
+        binding = outer;
+        return true;
+    }
+
+    auto& scope = scopes[scope_index];
+
+    // A function bound by a def can't capture the slot it is being bound to,
+    // since that slot isn't written until after the closure has been created.
+    if (outer.kind == BindingKind::Local && outer.index == scope.self_slot)
+    {
+        binding.kind = BindingKind::Self;
+        return true;
+    }
+
+    binding.kind = BindingKind::Capture;
+    binding.index = scope.captures.size();
+
+    scope.captures.push_back(outer);
+    bind(scope_index, symbol, binding);
+    return true;
+}
+
+// Finds where a symbol is stored, as seen from the current function.
+bool Runtime::lookup(uint32_t symbol, Binding& binding)
+{
+    return resolve(scopes.size() - 1, symbol, binding);
+}
+
+// Finds where a symbol is stored, or errors out if it is undefined.
+Binding Runtime::lookup_symbol(std::unique_ptr<AST>& ast)
+{
+    Binding binding;
+
+    if (!lookup(ast->token.id, binding))
+    {
+        err_token(ast->source, ast->token,
+                  "Undefined symbol '" + ast->symbol_name() + "'");
+    }
+
+    return binding;
+}
+
+// If ast is a call-by-name to a builtin with exactly two arguments, returns
+// the instruction that the builtin is inlined as. Otherwise returns 0.
+unsigned char Runtime::binary_builtin(std::unique_ptr<AST>& ast)
+{
+    if (ast->type != ASTType::Expr
+        || ast->children.size() != 3
+        || ast->children[0]->type != ASTType::Symbol)
+    {
+        return 0;
+    }
+
+    Binding binding;
+
+    if (!lookup(ast->children[0]->token.id, binding)
+        || binding.kind != BindingKind::Global
+        || binding.index >= builtin_counter)
     {
-        auto& var_indices = scopes[i].var_indices;
-        if (var_indices.count(name) > 0)
+        return 0;
+    }
+
+    return static_cast<unsigned char>(builtins[binding.index].inst);
+}
+
+// Works out the value of an expression at compile time, if it is a literal or
+// applies arithmetic and comparison builtins to nothing but constants. Returns
+// false if the value is only known once the code runs, or if working it out
+// would fault, as dividing by zero does.
+bool Runtime::constant(std::unique_ptr<AST>& ast, Value& value)
+{
+    switch (ast->type)
+    {
+    case ASTType::IntLiteral:
+        value = Value(ast->int_value());
+        return true;
+    case ASTType::FloatLiteral:
+        value = Value(ast->float_value());
+        return true;
+    case ASTType::BoolLiteral:
+        value = Value(ast->text() == "true");
+        return true;
+    case ASTType::Expr:
+        break;
+    default:
+        return false;
+    }
+
+    unsigned char builtin = binary_builtin(ast);
+    Value left, right;
+
+    if (builtin == 0
+        || !constant(ast->children[1], left) || !left.is_number()
+        || !constant(ast->children[2], right) || !right.is_number())
+    {
+        return false;
+    }
+
+    // Dividing integers by zero, or INT_MIN by -1, faults, and is left to do
+    // so at run time.
+    if (Value::both_int(left, right)
+        && static_cast<Instruction>(builtin) == Instruction::Div
+        && (right.as_int() == 0
+            || (left.as_int() == INT_MIN && right.as_int() == -1)))
+    {
+        return false;
+    }
+
+    return fold(static_cast<Instruction>(builtin), left, right, value);
+}
+
+// Folds an operation on two numbers with apply_binary(), which is what the
+// processor runs it with, so folding can't change any results.
+bool Runtime::fold(Instruction inst, Value left, Value right, Value& value)
+{
+    switch (inst)
+    {
+    case Instruction::Add:
+        value = apply_binary<std::plus>(left, right);
+        return true;
+    case Instruction::Sub:
+        value = apply_binary<std::minus>(left, right);
+        return true;
+    case Instruction::Mul:
+        value = apply_binary<std::multiplies>(left, right);
+        return true;
+    case Instruction::Div:
+        value = apply_binary<std::divides>(left, right);
+        return true;
+    case Instruction::Eq:
+        value = apply_binary<std::equal_to>(left, right);
+        return true;
+    case Instruction::Greater:
+        value = apply_binary<std::greater>(left, right);
+        return true;
+    case Instruction::GreaterEq:
+        value = apply_binary<std::greater_equal>(left, right);
+        return true;
+    case Instruction::Less:
+        value = apply_binary<std::less>(left, right);
+        return true;
+    case Instruction::LessEq:
+        value = apply_binary<std::less_equal>(left, right);
+        return true;
+    case Instruction::Min:
+        value = apply_binary<minimum>(left, right);
+        return true;
+    case Instruction::Max:
+        value = apply_binary<maximum>(left, right);
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Whether evaluating an expression does nothing but push a value, so that it
+// can be left out when the value isn't used. A symbol still has to be defined,
+// but that is all that is checked. Looking up a variable of an enclosing
+// function would make it one of the function's captures, which nothing would
+// read once the symbol is left out.
+bool Runtime::pure(std::unique_ptr<AST>& ast)
+{
+    Value value;
+
+    switch (ast->type)
+    {
+    case ASTType::IntLiteral:
+    case ASTType::FloatLiteral:
+    case ASTType::StrLiteral:
+    case ASTType::BoolLiteral:
+        return true;
+    case ASTType::Symbol:
+        if (ast->token.id >= bound.size() || bound[ast->token.id] < 0)
         {
-            var_index = var_indices[name];
-            break;
+            lookup_symbol(ast);
         }
-    }
 
-    if (var_index < 0)
+        return true;
+    default:
+        return constant(ast, value);
+    }
+}
+                                                                                  
+// Emit the instruction that pushes the value of a variable.
+void Runtime::emit_push_binding(Binding binding)
+{
+    switch (binding.kind)
     {
-        err_token(ast->token, "Undefined symbol '" + name + "'");
+    case BindingKind::Global:
+        emit_inst(Instruction::PushGlobal);
+        emit_int(binding.index);
+        break;
+    case BindingKind::Local:
+        emit_inst(Instruction::PushRef);
+        emit_int(binding.index);
+        break;
+    case BindingKind::Capture:
+        emit_inst(Instruction::PushCapture);
+        emit_int(binding.index);
+        break;
+    case BindingKind::Self:
+        emit_inst(Instruction::PushSelf);
+        break;
+    case BindingKind::Constant:
+        emit_push_int(binding.index);
+        break;
     }
+}
 
-    mem_put<Instruction>(Instruction::PushRef, proc.write_head);
-    proc.write_head += sizeof(Instruction);
-    mem_put<int>(var_index, proc.write_head);
-    proc.write_head += sizeof(int);
+// Emit the instruction that pushes the value of a symbol.
+inline void Runtime::emit_push_ref(std::unique_ptr<AST>& ast)
+{
+    emit_push_binding(lookup_symbol(ast));
 }
 
 void Runtime::emit_push(std::unique_ptr<AST>& ast)
@@ -156,7 +563,17 @@ void Runtime::emit_push(std::unique_ptr<AST>& ast)
     switch (ast->type)
     {
     case ASTType::IntLiteral:
-        emit_push_int(std::stoi(ast->token->string_value));
+        emit_push_int(ast->int_value());
+        break;
+    case ASTType::FloatLiteral:
+        emit_push_float(ast->float_value());
+        break;
+    case ASTType::StrLiteral:
+        emit_push_string(ast->string_value());
+        break;
+    case ASTType::BoolLiteral:
+        emit_inst(ast->text() == "true" ? Instruction::PushTrue
+                                        : Instruction::PushFalse);
         break;
     case ASTType::Symbol:
         emit_push_ref(ast);
@@ -166,8 +583,10 @@ void Runtime::emit_push(std::unique_ptr<AST>& ast)
     }
 }
 
-// Emit bytecode for an expression (or simply a symbol/literal).
-void Runtime::emit_expr(std::unique_ptr<AST>& ast)
+// Emit bytecode for an expression (or simply a symbol/literal). tail is set if
+// the expression is in tail position in a function body, meaning its value is
+// what the function returns.
+void Runtime::emit_expr(std::unique_ptr<AST>& ast, bool tail)
 {
     if (ast->children.size() == 0)
     {
@@ -180,36 +599,102 @@ void Runtime::emit_expr(std::unique_ptr<AST>& ast)
         // code for it at all.
         return;
     }
+
+    Value value;
+
+    if (options.optimize > 0 && constant(ast, value))
+    {
+        emit_constant(value);
+        return;
+    }
     
-    auto& first = ast->children[0]->token->string_value;
-    
-    if (first == "def")
+    auto& first = ast->children[0];
+
+    // Special forms are told apart from calls by the ID of their symbol.
+    uint32_t form = first->type == ASTType::Symbol ? first->token.id
+                                                   : SYM_EMPTY;
+
+    switch (form)
     {
+    case SYM_DEF:
         emit_def(ast);
+        break;
+    case SYM_DO:
+        emit_do(ast, tail);
+        break;
+    case SYM_IF:
+        emit_if(ast, tail);
+        break;
+    case SYM_FN:
+        emit_fn(ast, "<fn>");
+        break;
+    default:
+        emit_call(ast, tail);
+        break;
     }
-    else if (first == "do")
+}
+
+// Emit (+ x 1), (+ 1 x) or (- x 1), where x is a local variable, as a single
+// RefIntAdd or RefIntSub. Returns false without emitting anything if the call
+// does not have that shape.
+bool Runtime::emit_ref_int_op(std::unique_ptr<AST>& ast)
+{
+    unsigned char builtin = binary_builtin(ast);
+    Instruction fused;
+
+    if (builtin == static_cast<unsigned char>(Instruction::Add))
     {
-        emit_do(ast);
+        fused = Instruction::RefIntAdd;
     }
-    else if (first == "if")
+    else if (builtin == static_cast<unsigned char>(Instruction::Sub))
     {
-        emit_if(ast);
+        fused = Instruction::RefIntSub;
     }
-    else if (first == "fn")
+    else
     {
-        emit_fn(ast);
+        return false;
     }
-    else
+
+    auto* ref = &ast->children[1];
+    auto* literal = &ast->children[2];
+
+    // Addition commutes, so the literal is allowed to come first.
+    if (fused == Instruction::RefIntAdd
+        && (*ref)->type == ASTType::IntLiteral)
     {
-        emit_call(ast);
+        std::swap(ref, literal);
     }
+
+    if ((*ref)->type != ASTType::Symbol
+        || (*literal)->type != ASTType::IntLiteral)
+    {
+        return false;
+    }
+
+    Binding binding = lookup_symbol(*ref);
+
+    if (binding.kind != BindingKind::Local)
+    {
+        return false;
+    }
+
+    emit_inst(fused);
+    emit_int(binding.index);
+    emit_int((*literal)->int_value());
+    return true;
 }
 
-// Emit a function call.
-void Runtime::emit_call(std::unique_ptr<AST>& ast)
+// Emit a function call. Calls in tail position reuse the caller's frame, so
+// recursion in tail position runs in constant space.
+void Runtime::emit_call(std::unique_ptr<AST>& ast, bool tail)
 {
     auto& first = ast->children[0];
 
+    if (options.superinstructions && emit_ref_int_op(ast))
+    {
+        return;
+    }
+
     // Call-by-name: (factorial 6)
     // Indirect call: ((fn (n) (* 2 n)) 2)
     
@@ -223,6 +708,24 @@ void Runtime::emit_call(std::unique_ptr<AST>& ast)
     
     bool is_call_by_name = first->type == ASTType::Symbol;
 
+    if (is_call_by_name && options.optimize > 0 && emit_inline(ast, tail))
+    {
+        return;
+    }
+
+    if (is_call_by_name)
+    {
+        Binding binding;
+
+        if (lookup(first->token.id, binding)
+            && binding.kind == BindingKind::Global
+            && binding.index < builtin_counter)
+        {
+            emit_builtin(ast, builtins[binding.index]);
+            return;
+        }
+    }
+
     // First, add all the operands to the stack:
     for (unsigned long i = 1; i < ast->children.size(); i++)
     {
@@ -237,66 +740,411 @@ void Runtime::emit_call(std::unique_ptr<AST>& ast)
         }
     }
 
+    int n_args = ast->children.size() - 1;
+
     if (!is_call_by_name)
     {
         // We are assuming that executing the bytecode for the first node will
         // leave us with a closure at the top of the stack.
         emit_expr(first);
-        mem_put<Instruction>(Instruction::CallPop, proc.write_head);
-        proc.write_head += sizeof(Instruction);
+        emit_inst(tail ? Instruction::TailCallPop : Instruction::CallPop);
+        emit_int(n_args);
         return;
     }
 
-    // Get the function's index
-    std::string& fn_name = first->token->string_value;
-    int var_index = -1;
+    // Find out where the function is stored
+    Binding binding;
 
-    for (int i = scopes.size() - 1; i >= 0; i--)
+    if (!lookup(first->token.id, binding))
     {
-        auto& var_indices = scopes[i].var_indices;
-        if (var_indices.count(fn_name) > 0)
+        err_token(first->source, first->token,
+                  "Undefined function '" + first->symbol_name() + "'");
+    }
+
+    if (binding.kind != BindingKind::Global)
+    {
+        // Functions that aren't globals are called like indirect ones.
+        emit_push_binding(binding);
+        emit_inst(tail ? Instruction::TailCallPop : Instruction::CallPop);
+        emit_int(n_args);
+    }
+    else
+    {
+        emit_inst(tail ? Instruction::TailCall : Instruction::Call);
+        emit_int(binding.index);
+        emit_int(n_args);
+    }
+}
+
+// Emit a call by name to a builtin, which is inlined. With more than two
+// arguments, a Fold builtin is applied to the first two and then to the
+// result and each following argument, so n arguments take n - 1
+// instructions.
+void Runtime::emit_builtin(std::unique_ptr<AST>& ast,
+                           const BuiltinEntry& builtin)
+{
+    auto& first = ast->children[0];
+    int n_args = ast->children.size() - 1;
+    bool fixed = builtin.kind == BuiltinKind::Fixed;
+
+    if (fixed ? n_args != builtin.num_args : n_args < builtin.num_args)
+    {
+        err_token(first->source, first->token,
+                  "'" + builtin.name + "' expects "
+                  + (fixed ? "" : "at least ")
+                  + std::to_string(builtin.num_args) + " arguments, but got "
+                  + std::to_string(n_args));
+    }
+
+    if (builtin.kind == BuiltinKind::Logical)
+    {
+        emit_logical(ast, builtin.inst == Instruction::And);
+        return;
+    }
+
+    if (builtin.kind == BuiltinKind::Fold)
+    {
+        emit_expr(ast->children[1]);
+
+        for (int i = 2; i <= n_args; i++)
         {
-            var_index = var_indices[fn_name];
-            break;
+            emit_expr(ast->children[i]);
+            emit_inst(builtin.inst);
         }
+
+        return;
     }
 
-    if (var_index < 0)
+    for (int i = 1; i <= n_args; i++)
     {
-        err_token(first->token, "Undefined function '" + fn_name + "'");
+        emit_expr(ast->children[i]);
     }
 
-    // If this is a builtin function, just inline it. It is guaranteed to be
-    // just one instruction.
-    if (var_index < builtin_counter)
+    if (fixed || (builtin.kind == BuiltinKind::Chain && n_args == 2))
     {
-        // Using operator[] is okay, since the closure is guaranteed to be
-        // located in the first environment.
-        auto value = proc.envs.front()[var_index];
-        auto closure = value->as<std::shared_ptr<Closure>>();
-        mem_put<unsigned char>(closure->instructions[0], proc.write_head);
-        proc.write_head += sizeof(unsigned char);
+        emit_inst(builtin.inst);
     }
     else
     {
-        mem_put<Instruction>(Instruction::Call, proc.write_head);
-        proc.write_head += sizeof(Instruction);
-        mem_put<int>(var_index, proc.write_head);
-        proc.write_head += sizeof(int);
+        emit_inst(builtin.reduce);
+        emit_int(n_args);
     }
 }
 
-// Emit the bytecode for a do statement.
-void Runtime::emit_do(std::unique_ptr<AST>& ast)
+// Emit (and ...) or (or ...). Arguments are only evaluated until one of them
+// settles the result, so a later one can rely on the earlier ones, as in
+// (and (> n 0) (f (- n 1))). The result is always a boolean.
+void Runtime::emit_logical(std::unique_ptr<AST>& ast, bool is_and)
 {
+    std::vector<size_t> settled;
+
     for (size_t i = 1; i < ast->children.size(); i++)
     {
         emit_expr(ast->children[i]);
+
+        settled.push_back(code->size());
+        emit_inst(is_and ? Instruction::JmpFalse : Instruction::JmpTrue);
+        emit_int(0);
+    }
+
+    emit_inst(is_and ? Instruction::PushTrue : Instruction::PushFalse);
+
+    size_t end_jmp = code->size();
+    emit_inst(Instruction::Jmp);
+    emit_int(0);
+
+    for (size_t jmp : settled)
+    {
+        patch_int(jmp + sizeof(Instruction), code->size() - jmp);
+    }
+
+    emit_inst(is_and ? Instruction::PushFalse : Instruction::PushTrue);
+    patch_int(end_jmp + sizeof(Instruction), code->size() - end_jmp);
+}
+
+// Adds up the nodes of a function body and collects the symbols it refers to.
+// Returns false if the body can't be inlined: if it defines variables or
+// creates closures, which would need slots and captures of their own, or if it
+// refers to the function itself, or if it is bigger than budget.
+static bool scan_inline_body(AST* ast, uint32_t self, int budget, int& size,
+                             std::vector<uint32_t>& symbols)
+{
+    if (++size > budget)
+    {
+        return false;
+    }
+
+    if (ast->type == ASTType::Symbol)
+    {
+        symbols.push_back(ast->token.id);
+        return ast->token.id != self;
+    }
+
+    if (ast->children.size() > 0
+        && ast->children[0]->type == ASTType::Symbol
+        && (ast->children[0]->token.id == SYM_DEF
+            || ast->children[0]->token.id == SYM_FN))
+    {
+        return false;
+    }
+
+    for (auto& child : ast->children)
+    {
+        if (!scan_inline_body(child.get(), self, budget, size, symbols))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Keeps the (fn ...) form of a global function around for inlining, if its
+// body is a single expression that is small enough. Globals can't be
+// redefined, so every call to the function by name calls this body.
+void Runtime::add_inlinable(std::unique_ptr<AST>& fn, int slot,
+                            uint32_t symbol)
+{
+    if (fn->children.size() != 3)
+    {
+        return;
+    }
+
+    Inlinable inlinable_fn;
+
+    if (!scan_inline_body(fn->children[2].get(), symbol, options.inline_budget,
+                          inlinable_fn.size, inlinable_fn.free_symbols))
+    {
+        return;
+    }
+
+    auto& free = inlinable_fn.free_symbols;
+
+    std::sort(free.begin(), free.end());
+    free.erase(std::unique(free.begin(), free.end()), free.end());
+
+    for (auto& param : fn->children[1]->children)
+    {
+        auto it = std::lower_bound(free.begin(), free.end(), param->token.id);
+
+        if (it != free.end() && *it == param->token.id)
+        {
+            free.erase(it);
+        }
+    }
+
+    inlinable_fn.name = symbols().name(symbol);
+    inlinable_fn.fn = std::move(fn);
+    inlinable[slot] = std::move(inlinable_fn);
+}
+
+// Emit a call by name to a global function as a copy of the function's body,
+// if the function is inlinable. Returns false without emitting anything if it
+// isn't.
+//
+// The parameters are bound in the calling function. A parameter whose argument
+// is a variable becomes another name for that variable, which is fine because
+// bindings never change, one whose argument is an integer literal is bound to
+// its value, and any other argument is evaluated into a fresh slot of the
+// caller's frame. Nothing is inlined into top-level forms, which have no
+// frame of their own.
+bool Runtime::emit_inline(std::unique_ptr<AST>& ast, bool tail)
+{
+    Binding binding;
+
+    if (scopes.size() == 1
+        || inline_depth >= INLINE_MAX_DEPTH
+        || !lookup(ast->children[0]->token.id, binding)
+        || binding.kind != BindingKind::Global)
+    {
+        return false;
+    }
+
+    auto it = inlinable.find(binding.index);
+
+    if (it == inlinable.end())
+    {
+        return false;
+    }
+
+    Inlinable& callee = it->second;
+    auto& params = callee.fn->children[1]->children;
+    size_t n_args = ast->children.size() - 1;
+
+    // A call with the wrong number of arguments errors out when it runs.
+    if (n_args != params.size())
+    {
+        return false;
+    }
+
+    // The body refers to globals by name, which the caller may have shadowed.
+    for (uint32_t symbol : callee.free_symbols)
+    {
+        int entry = symbol < bound.size() ? bound[symbol] : -1;
+
+        if (entry >= 0 && entries[entry].scope != 0)
+        {
+            return false;
+        }
+    }
+
+    // Arguments can contain functions, whose scopes are pushed on top of
+    // this one, so scopes.back() can't be held on to.
+    int first_slot = scopes.back().n_slots;
+    size_t first_symbol = scopes.back().symbols.size();
+    std::vector<Binding> args;
+
+    for (size_t i = 1; i <= n_args; i++)
+    {
+        auto& arg = ast->children[i];
+
+        if (arg->type == ASTType::Symbol)
+        {
+            args.push_back(lookup_symbol(arg));
+            continue;
+        }
+
+        if (arg->type == ASTType::IntLiteral)
+        {
+            args.push_back({ BindingKind::Constant, arg->int_value() });
+            continue;
+        }
+
+        int slot = scopes.back().n_slots++;
+
+        emit_expr(arg);
+        emit_inst(Instruction::Store);
+        emit_int(slot);
+        args.push_back({ BindingKind::Local, slot });
+    }
+
+    // The arguments are all evaluated before any parameter is bound, so a
+    // parameter can't shadow a variable that a later argument refers to.
+    for (size_t i = 0; i < n_args; i++)
+    {
+        bind(scopes.size() - 1, params[i]->token.id, args[i]);
+    }
+
+    inline_depth++;
+    emit_expr(callee.fn->children[2], tail);
+    inline_depth--;
+
+    unbind(n_args);
+
+    // The argument slots are free again, unless a def in one of the
+    // arguments took a slot after them that is still in use.
+    auto& scope = scopes.back();
+
+    if (scope.symbols.size() == first_symbol)
+    {
+        scope.max_slots = std::max(scope.max_slots, scope.n_slots);
+        scope.n_slots = first_slot;
+    }
+
+    callee.n_sites++;
+    return true;
+}
+
+// Emit the bytecode for a do statement. Only the last expression can be in
+// tail position. When optimizing, the expressions before it are left out if
+// all they would do is push a value.
+void Runtime::emit_do(std::unique_ptr<AST>& ast, bool tail)
+{
+    for (size_t i = 1; i < ast->children.size(); i++)
+    {
+        bool last = i == ast->children.size() - 1;
+
+        if (!last && options.optimize > 0 && pure(ast->children[i]))
+        {
+            continue;
+        }
+
+        emit_expr(ast->children[i], tail && last);
+    }
+}
+
+// Comparison instructions, along with the superinstructions that fuse them
+// with a following JmpFalse.
+struct FusedCompare
+{
+    Instruction compare;
+    Instruction jmp_false;
+    Instruction ref_int_jmp_false;
+};
+
+const FusedCompare fused_compares[] = {
+    { Instruction::Eq,
+      Instruction::EqJmpFalse,
+      Instruction::RefIntEqJmpFalse },
+    { Instruction::Greater,
+      Instruction::GreaterJmpFalse,
+      Instruction::RefIntGreaterJmpFalse },
+    { Instruction::GreaterEq,
+      Instruction::GreaterEqJmpFalse,
+      Instruction::RefIntGreaterEqJmpFalse },
+    { Instruction::Less,
+      Instruction::LessJmpFalse,
+      Instruction::RefIntLessJmpFalse },
+    { Instruction::LessEq,
+      Instruction::LessEqJmpFalse,
+      Instruction::RefIntLessEqJmpFalse },
+};
+
+// Emit the bytecode for a condition, followed by a jump that is taken when the
+// condition is false. If the condition is a comparison, the comparison and the
+// jump are fused into one superinstruction. The jump offset is always the last
+// operand of the emitted instruction and is left for the caller to fill in.
+// Returns the position of the jump instruction.
+size_t Runtime::emit_jmp_false(std::unique_ptr<AST>& condition)
+{
+    unsigned char builtin = binary_builtin(condition);
+    size_t jmp_head;
+
+    for (const auto& fused : fused_compares)
+    {
+        if (!options.superinstructions
+            || builtin != static_cast<unsigned char>(fused.compare))
+        {
+            continue;
+        }
+
+        auto& left = condition->children[1];
+        auto& right = condition->children[2];
+
+        if (left->type == ASTType::Symbol
+            && right->type == ASTType::IntLiteral
+            && lookup_symbol(left).kind == BindingKind::Local)
+        {
+            Binding binding = lookup_symbol(left);
+
+            jmp_head = code->size();
+            emit_inst(fused.ref_int_jmp_false);
+            emit_int(binding.index);
+            emit_int(right->int_value());
+            emit_int(0);
+            return jmp_head;
+        }
+
+        emit_expr(left);
+        emit_expr(right);
+
+        jmp_head = code->size();
+        emit_inst(fused.jmp_false);
+        emit_int(0);
+        return jmp_head;
     }
+
+    emit_expr(condition);
+
+    jmp_head = code->size();
+    emit_inst(Instruction::JmpFalse);
+    emit_int(0);
+    return jmp_head;
 }
 
-// Emit the bytecode for an if statement.
-void Runtime::emit_if(std::unique_ptr<AST>& ast)
+// Emit the bytecode for an if statement. If it is in tail position, so are
+// both of its branches.
+void Runtime::emit_if(std::unique_ptr<AST>& ast, bool tail)
 {
     // Structure of an if statement in bytecode:
     //
@@ -310,47 +1158,145 @@ void Runtime::emit_if(std::unique_ptr<AST>& ast)
     auto& if_part = ast->children[2];
     auto& else_part = ast->children[3];
 
-    // Emit bytecode for the condition:
-    emit_expr(condition);
-    
-    // Save current write_offset and allocate space for the jmp_false
-    // instruction that runs before the if block. We will later use old_woff as
-    // an offset into proc.instructions to write the jmp_false instruction.
-    unsigned char* old_head = proc.write_head;
-    proc.write_head += sizeof(Instruction);
-    proc.write_head += sizeof(int);
+    Value value;
+
+    if (options.optimize > 0 && constant(condition, value))
+    {
+        emit_constant_if(ast, value.as_bool(), tail);
+        return;
+    }
+
+    // Emit bytecode for the condition and the jmp_false instruction that runs
+    // before the if block. We will later come back to old_head to fill in the
+    // jump's offset.
+    size_t old_head = emit_jmp_false(condition);
+    size_t offset_head = code->size() - sizeof(int);
 
     // Emit if-part's bytecode.
-    emit_expr(if_part);
+    emit_expr(if_part, tail);
+
+    // In tail position the if block can return straight away instead of
+    // jumping to the Ret after the else block.
+    if (tail && options.optimize > 0)
+    {
+        emit_inst(Instruction::Ret);
+        patch_int(offset_head, code->size() - old_head);
+        emit_expr(else_part, tail);
+        return;
+    }
 
-    // else_woff is where the else bytecode will begin, accounting for the
+    // else_head is where the else bytecode will begin, accounting for the
     // additional jump instruction we're going to insert at the end of the if
     // block.
-    unsigned char* else_head = proc.write_head + sizeof(Instruction) + sizeof(int);
-    
-    // At old_woff, insert a JmpFalse with the address of the byte after the if
-    // block.
-    mem_put<Instruction>(Instruction::JmpFalse, old_head);
+    size_t else_head = code->size() + sizeof(Instruction) + sizeof(int);
 
-    // Add number of bytes emitted between else_woff and old_woff as an argument
-    // to jmp_false.
-    mem_put<int>(else_head - old_head, old_head + sizeof(Instruction));
+    // Add number of bytes emitted between else_head and old_head as an
+    // argument to jmp_false.
+    patch_int(offset_head, else_head - old_head);
 
-    // Now save the write_offset again as old_woff. We're going to use this to
-    // write the jmp instruction which jumps to the byte after the else block.
-    old_head = proc.write_head;
+    // Now save the position again as old_head, and emit the jmp instruction
+    // which jumps to the byte after the else block. Its offset is filled in
+    // once we know where that is.
+    old_head = code->size();
 
-    // Move write_offset past our allocated space:
-    proc.write_head += sizeof(Instruction);
-    proc.write_head += sizeof(int);
+    emit_inst(Instruction::Jmp);
+    emit_int(0);
 
     // Emit else-part's bytecode.
-    emit_expr(else_part);
+    emit_expr(else_part, tail);
 
-    // At old_woff (the end of the if block), insert an unconditional jump to
+    // At old_head (the end of the if block), fill in the unconditional jump to
     // skip over the else block if it ever gets executed.
-    mem_put<Instruction>(Instruction::Jmp, old_head);
-    mem_put<int>(proc.write_head - old_head, old_head + sizeof(Instruction));
+    patch_int(old_head + sizeof(Instruction), code->size() - old_head);
+}
+
+// Emit only the branch of an if statement that its constant condition
+// selects. The other branch is never compiled, so that none of its functions,
+// constants or inlined calls are left behind, but its defs are still bound,
+// just as they would be otherwise.
+void Runtime::emit_constant_if(std::unique_ptr<AST>& ast, bool taken,
+                               bool tail)
+{
+    auto& live = ast->children[taken ? 2 : 3];
+    auto& dead = ast->children[taken ? 3 : 2];
+
+    if (taken)
+    {
+        emit_expr(live, tail);
+    }
+
+    declare_defs(dead);
+
+    if (!taken)
+    {
+        emit_expr(live, tail);
+    }
+}
+
+// Binds every def in an expression that isn't emitted, which is every def
+// that is not inside a nested fn, in the order emitting it would have.
+void Runtime::declare_defs(std::unique_ptr<AST>& ast)
+{
+    if (ast->type != ASTType::Expr || ast->children.size() == 0)
+    {
+        return;
+    }
+
+    auto& head = ast->children[0];
+    uint32_t form = head->type == ASTType::Symbol ? head->token.id : SYM_EMPTY;
+
+    if (form == SYM_FN)
+    {
+        return;
+    }
+
+    if (form == SYM_DEF)
+    {
+        declare_def(ast->children[1]);
+    }
+
+    for (auto& child : ast->children)
+    {
+        declare_defs(child);
+    }
+}
+
+// Binds the symbol of a def to a new slot of the innermost scope, and returns
+// the slot.
+int Runtime::declare_def(std::unique_ptr<AST>& left)
+{
+    if (left->type != ASTType::Symbol)
+    {
+        err_token(left->source, left->token, "variable name must be a symbol");
+    }
+
+    uint32_t symbol = left->token.id;
+    auto& scope = scopes.back();
+    bool is_global = scopes.size() == 1;
+
+    // Look for symbol in this environment. Captures don't count, since a def
+    // may shadow a variable of an enclosing function.
+    int entry = symbol < bound.size() ? bound[symbol] : -1;
+
+    if (entry >= 0
+        && entries[entry].scope == static_cast<int>(scopes.size() - 1)
+        && entries[entry].binding.kind != BindingKind::Capture)
+    {
+        err_token(left->source, left->token,
+                  "redefinition of variable '" + left->symbol_name() + "'");
+    }
+
+    int slot = scope.n_slots++;
+
+    if (is_global)
+    {
+        proc.globals.push_back(Value());
+    }
+
+    bind(scopes.size() - 1, symbol,
+         { is_global ? BindingKind::Global : BindingKind::Local, slot });
+
+    return slot;
 }
 
 // Emit the bytecode for a def.
@@ -360,146 +1306,261 @@ void Runtime::emit_def(std::unique_ptr<AST>& ast)
     // TODO: error handling here, like for having too many child nodes
     auto& left = ast->children[1];
     auto& right = ast->children[2];
-    std::string symbol_name = left->token->string_value;
-    
-    // Look for symbol in this environment
-    if (scopes.back().var_indices.count(symbol_name) > 0)
+    bool is_global = scopes.size() == 1;
+
+    // We will consider the symbol "defined" before we even figure out what the
+    // symbol is bound to. This avoids bugs when parsing recursive functions.
+    int slot = declare_def(left);
+    uint32_t symbol = left->token.id;
+
+    if (right->type == ASTType::Expr
+        && right->children.size() > 0
+        && right->children[0]->type == ASTType::Symbol
+        && right->children[0]->token.id == SYM_FN)
+    {
+        emit_fn(right, left->symbol_name(), is_global ? -1 : slot);
+
+        if (is_global && options.optimize > 0)
+        {
+            add_inlinable(right, slot, symbol);
+        }
+    }
+    else
     {
-        err_token(left->token, "redefinition of variable '" + symbol_name + "'");
+        emit_expr(right);
     }
 
-    int var_number = var_counter;
+    emit_inst(is_global ? Instruction::StoreGlobal : Instruction::Store);
+    emit_int(slot);
+}
 
-    // We will consider the symbol "defined" before we even figure out what the
-    // symbol is bound to. This avoids bugs when parsing recursive functions.
-    scopes.back().var_indices[symbol_name] = var_number;
-    
-    var_counter++;
-    
-    emit_expr(right);
-    
-    mem_put<Instruction>(Instruction::Store, proc.write_head);
-    proc.write_head += sizeof(Instruction);
+// Retargets every jump in code[start, end) that lands on a Jmp to wherever
+// that Jmp leads, so that a chain of jumps is taken in one go. Nested ifs
+// leave such chains behind, since the jump over an inner else block lands
+// right on the jump over the outer one.
+static void thread_jumps(unsigned char* code, size_t start, size_t end)
+{
+    for (size_t pos = start; pos < end;)
+    {
+        auto inst = static_cast<Instruction>(code[pos]);
+        size_t size = instruction_size(inst);
 
-    mem_put<int>(var_number, proc.write_head);
-    proc.write_head += sizeof(int);
+        if (is_jump(inst))
+        {
+            unsigned char* operand = code + pos + size - sizeof(int);
+            size_t target = pos + mem_get<int>(operand);
+
+            // Jumps always go forwards, but give up after a few hops anyway.
+            for (int hops = 0;
+                 hops < 8
+                 && target < end
+                 && code[target] == static_cast<unsigned char>(Instruction::Jmp);
+                 hops++)
+            {
+                target += mem_get<int>(code + target + 1);
+            }
+
+            mem_put<int>(target - pos, operand);
+        }
+
+        pos += size;
+    }
 }
 
 // Emit the bytecode to generate a lambda.
-void Runtime::emit_fn(std::unique_ptr<AST>& ast)
+void Runtime::emit_fn(std::unique_ptr<AST>& ast, const std::string& name,
+                      int self_slot)
 {
 
     // This creates a new scope.
     scopes.push_back(Scope());
+    scopes.back().self_slot = self_slot;
 
     auto& param_list = ast->children[1];
+    int n_args = param_list->children.size();
 
-    unsigned char* old_head = proc.write_head;
+    // When we make a function call, all the arguments are pushed onto the
+    // stack before the jump, and they stay where they are as the first slots
+    // of the new frame.
+    scopes.back().n_slots = n_args;
 
-    // Allocate space for jump instruction
-    proc.write_head += sizeof(Instruction) + sizeof(int);
-        
-    // It is assumed that when we make a function call, all the arguments are
-    // pushed onto the stack before the jump. Here we emit store instructions
-    // for those arguments and store their values into the new environment.
-    for (int i = param_list->children.size() - 1; i >= 0; i--)
+    for (int i = 0; i < n_args; i++)
     {
         auto& child = param_list->children[i];
         
         // TODO: better error handling here
         if (child->type != ASTType::Symbol)
         {
-            err_token(child->token, "parameter must be a symbol");
+            err_token(child->source, child->token, "parameter must be a symbol");
         }
 
-        std::string &param_name = child->token->string_value;
-        scopes.back().var_indices[param_name] = var_counter;
-        
-        mem_put<Instruction>(Instruction::Store, proc.write_head);
-        proc.write_head += sizeof(Instruction);
-        
-        mem_put<int>(var_counter, proc.write_head);
-        proc.write_head += sizeof(int);
-        
-        var_counter++;
+        bind(scopes.size() - 1, child->token.id, { BindingKind::Local, i });
     }
 
+    // The body is emitted straight into the function's prototype.
+    auto proto = std::make_unique<FunctionProto>();
+    scopes.back().proto = proto.get();
+
+    auto enclosing_code = code;
+    code = &proto->code;
+
     // Now go through the rest of the expressions in the function and emit
-    // bytecode for them.
+    // bytecode for them. The last one is in tail position.
     for (size_t i = 2; i < ast->children.size(); i++)
     {
-        emit_expr(ast->children[i]);
+        emit_expr(ast->children[i], i == ast->children.size() - 1);
     }
 
     // Lastly, emit the ret instruction:
-    mem_put<Instruction>(Instruction::Ret, proc.write_head);
-    proc.write_head += sizeof(Instruction);
+    emit_inst(Instruction::Ret);
+
+    code = enclosing_code;
 
-    // The closure body begins `sizeof(Instruction) + sizeof(int)` bytes after
-    // the jump.
-    unsigned char* code_begin = old_head + sizeof(Instruction) + sizeof(int);
-    unsigned char* code_end = proc.write_head;
+    if (options.optimize > 0)
+    {
+        thread_jumps(proto->code.data(), 0, proto->code.size());
+    }
 
-    mem_put<Instruction>(Instruction::CreateClosure, proc.write_head);
-    proc.write_head += sizeof(Instruction);
+    // Destroy current scope. Everything the function captures is now known.
+    Scope scope = pop_scope();
 
-    mem_put<int>(code_end - code_begin, proc.write_head);
-    proc.write_head += sizeof(int);
-    
-    // Now go back to the beginning and add the jmp that skips over the function
-    // body.
-    mem_put<Instruction>(Instruction::Jmp, old_head);
-    
-    mem_put<int>(proc.write_head - old_head - sizeof(Instruction) - sizeof(int),
-                 old_head + sizeof(Instruction));
-    
-    // Destroy current scope:
-    scopes.pop_back();
+    proto->name = name;
+    proto->n_args = n_args;
+    proto->frame_size = std::max(scope.n_slots, scope.max_slots);
+    proto->max_stack = proc.stack_depth(proto->code.data(),
+                                        proto->code.size());
+    proto->n_captures = scope.captures.size();
+
+    int index = proc.add_proto(std::move(proto));
+
+    if (scopes.back().proto != nullptr)
+    {
+        scopes.back().proto->protos.push_back(index);
+    }
+
+    // Push the captured values, as seen from the enclosing function, and
+    // create the closure from them.
+    for (auto& capture : scope.captures)
+    {
+        emit_push_binding(capture);
+    }
+
+    emit_inst(Instruction::CreateClosure);
+    emit_int(index);
+}
+
+Value Runtime::eval_ast(std::unique_ptr<AST>& ast)
+{
+    if (register_backend)
+    {
+        return register_backend->eval_ast(ast);
+    }
+
+    // Every top-level form is compiled into the same buffer, which only has to
+    // hold one form at a time.
+    proc.toplevel.clear();
+    proc.constants.clear();
+    int max_stack = compile_ast(ast, proc.toplevel);
+
+    return run_toplevel(proc.toplevel.data(), max_stack);
 }
 
-std::shared_ptr<Value> Runtime::eval_ast(std::unique_ptr<AST>& ast)
+// Compiles a top-level form for the stack machine without running it, and
+// appends its code, followed by a 0 byte, to out. Returns how many values the
+// code pushes at most.
+int Runtime::compile_ast(std::unique_ptr<AST>& ast,
+                          std::vector<unsigned char>& out)
 {
-    unsigned char* old_head = proc.write_head;
+    code = &out;
+    size_t start = out.size();
+
     emit_expr(ast);
 
+    if (options.optimize > 0)
+    {
+        thread_jumps(out.data(), start, out.size());
+    }
+
     // TODO: Implement some kind of error flag that we can set during bytecode
     // generation. At this point, we should check the error flag and potentially
-    // zero out all the bytecode we just generated if we know it is invalid.
+    // throw away all the bytecode we just generated if we know it is invalid.
 
     // Run until we hit a 0 byte
-    while (*proc.ip)
+    code->push_back(0);
+
+    return proc.stack_depth(out.data() + start, out.size() - start);
+}
+
+// Runs the code of a top-level form on the stack machine, and returns the
+// form's result. max_stack is what compile_ast() returned for it.
+Value Runtime::run_toplevel(unsigned char* toplevel, int max_stack)
+{
+    if (proc.stack_size() + max_stack > PROC_STACK_SIZE)
     {
-        unsigned char inst = *proc.ip;
-        proc.jump_table[inst](proc);
+        printf("ERROR: Stack overflow\n");
+        exit(-1);
     }
 
-    // Expressions that cannot possibly be referenced later in the program
-    // (i.e. literally anything that is not a def or defn (possibly others) can
-    // simply have their instructions zeroed out to free up space.
-    if (ast->children.size() > 0)
+    proc.ip = toplevel;
+    proc.run();
+
+    // Whatever the form allocated in the region and left behind in a global
+    // or as its result has to outlive it.
+    if (proc.use_region)
     {
-        auto form = ast->children[0]->token->string_value;
-        if (form != "def")
-        {
-            std::memset(old_head, 0, proc.write_head - old_head);
+        proc.promote();
+    }
 
-            // Reset instruction pointer:
-            proc.write_head = old_head;
-            proc.ip = old_head;
-        }
+    // Nothing is running between two forms, so this is the only time when
+    // unreachable prototypes can be reclaimed along with the heap. The
+    // result is still on the stack, which keeps it alive.
+    if (proc.should_collect() || proc.code_bytes >= proc.code_collect_at)
+    {
+        proc.collect(true);
     }
 
-    if (proc.stack.size() > 0)
+    Value result;
+
+    if (proc.stack_size() > 0)
     {
-        auto result = proc.stack.back();
-        proc.stack.clear();
-        return result;
+        result = proc.top();
+        proc.sp = proc.stack.get();
     }
-    else
+
+    return result;
+}
+
+CodeStats Runtime::code_stats()
+{
+    return proc.code_stats();
+}
+
+GCStats Runtime::gc_stats()
+{
+    if (register_backend)
     {
-        proc.stack.clear();
+        return register_backend->gc_stats();
+    }
 
-        // Default constructor initializes type to nil
-        return std::make_shared<Value>();
+    return proc.heap_stats();
+}
+
+const Profile* Runtime::profile()
+{
+    return proc.profile.get();
+}
+
+std::vector<InlineStats> Runtime::inline_stats()
+{
+    std::vector<InlineStats> stats;
+
+    for (auto& [slot, fn] : inlinable)
+    {
+        if (fn.n_sites > 0)
+        {
+            stats.push_back({ fn.name, fn.size, fn.n_sites });
+        }
     }
+
+    return stats;
 }
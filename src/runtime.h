@@ -1,10 +1,12 @@
 #pragma once
 
-#include <any>
 #include <cstring>
 #include <deque>
+#include <functional>
 #include <iostream>
+#include <map>
 #include <memory>
+#include <string_view>
 #include <tuple>
 #include <unordered_map>
 #include <vector>
@@ -12,35 +14,244 @@
 #include "ast.h"
 #include "environment.h"
 #include "processor.h"
+#include "register_compiler.h"
 
+// How many calls deep an inlined function may itself have calls inlined.
+#define INLINE_MAX_DEPTH 4
+
+// Which virtual machine a Runtime compiles to and runs code on.
+enum class Backend
+{
+    Stack,
+    Register,
+};
+
+// Settings that are fixed for the lifetime of a Runtime.
+struct RuntimeOptions
+{
+    Backend backend = Backend::Stack;
+
+    // Dispatch mode of the stack machine. The register backend always uses
+    // threaded dispatch.
+    Dispatch dispatch = Dispatch::Threaded;
+
+    // Whether the compiler fuses common instruction sequences into
+    // superinstructions.
+    bool superinstructions = true;
+
+    // Whether the stack machine allocates the objects of each top-level form
+    // in a region that is released when the form finishes, moving only those
+    // that outlive the form to the heap.
+    bool region_heap = false;
+
+    // How hard the stack compiler optimizes. At 1 it folds constant
+    // arithmetic and comparisons, drops branches whose condition is a
+    // constant and expressions whose value is never used, and threads jumps
+    // that lead to other jumps. It also inlines small functions at the call
+    // sites in other functions' bodies. 0 emits code exactly as written.
+    int optimize = 0;
+
+    // Largest function body, in AST nodes, that is inlined when optimizing.
+    int inline_budget = 12;
+
+    // Whether the stack machine counts the instructions it runs, and the
+    // pairs of them that run one after the other, and times a sample of
+    // them. It runs slower while it does.
+    bool profile = false;
+};
+
+enum class BindingKind
+{
+    // index is an index into Processor::globals.
+    Global,
+
+    // index is a slot in the current frame.
+    Local,
+
+    // index is an index into the running closure's captures.
+    Capture,
+
+    // The name of the running closure, which refers to itself.
+    Self,
+
+    // index is the value itself. A parameter of an inlined function whose
+    // argument is an integer literal is bound to it.
+    Constant,
+};
+
+// Where a variable is stored, as resolved at compile time.
+struct Binding
+{
+    BindingKind kind;
+    int index;
+};
+
+// The global scope, or the body of one function.
 struct Scope {
-    std::unordered_map<std::string, int> var_indices;
+    // Symbols bound in the scope, in the order they were bound. They are
+    // unbound again when the scope ends.
+    std::vector<uint32_t> symbols;
+
+    // Number of slots handed out so far. In the global scope the slots are
+    // indices into Processor::globals, and otherwise they are slots of the
+    // function's frame.
+    int n_slots = 0;
+
+    // Where each captured value comes from, as seen by the enclosing
+    // function.
+    std::vector<Binding> captures;
+
+    // If the function is being bound by a def in its enclosing function, the
+    // slot it is being bound to there. Otherwise -1.
+    int self_slot = -1;
+
+    // Prototype of the function, or nullptr for the global scope.
+    FunctionProto* proto = nullptr;
+
+    // Most slots that have been in use at once. The slots that hold the
+    // arguments of an inlined call are handed out again after it, so this
+    // can be more than n_slots.
+    int max_slots = 0;
+};
+
+// A symbol bound in one scope. The entries of a symbol form a chain from the
+// innermost scope it is bound in outwards, so an inner binding shadows the
+// outer ones until its scope ends.
+struct ScopeEntry {
+    // Index into Runtime::scopes.
+    int scope;
+
+    // Global in the global scope, and otherwise Local or Capture.
+    Binding binding;
+
+    // Entry of the same symbol that this one shadows, or -1.
+    int shadowed;
+};
+
+// A global function whose body is small enough to be copied into the
+// functions that call it.
+struct Inlinable {
+    std::string name;
+
+    // The function's (fn ...) form, taken over from the top-level form that
+    // defined it.
+    std::unique_ptr<AST> fn;
+
+    // Number of nodes in the body, and the symbols it refers to other than
+    // its parameters. All of them are globals.
+    int size = 0;
+    std::vector<uint32_t> free_symbols;
+
+    // Number of call sites the body has been copied into.
+    int n_sites = 0;
+};
+
+// A function that has been inlined, as reported by Runtime::inline_stats().
+struct InlineStats {
+    std::string name;
+    int size;
+    int n_sites;
 };
 
+struct BuiltinEntry;
 
 class Runtime {
 
+    friend bool write_bobac(Runtime& runtime, std::string_view source,
+                            const char* path);
+    friend bool run_bobac(Runtime& runtime, std::string_view image,
+                          const std::function<void(Value)>& on_result);
+
 private:
+    RuntimeOptions options;
     Processor proc;
 
+    // Compiler and processor for the register backend. Only created if the
+    // runtime uses that backend.
+    std::unique_ptr<RegisterCompiler> register_backend;
+
+    // The global scope, followed by the scopes of the functions whose code is
+    // currently being emitted.
     std::vector<Scope> scopes;
-    int var_counter = 0;
     int builtin_counter = 0;
 
+    // Innermost entry of every symbol, indexed by symbol ID, or -1 if the
+    // symbol isn't bound. Looking up a name is a single index, whatever the
+    // number of scopes.
+    std::vector<int> bound;
+    std::vector<ScopeEntry> entries;
+    std::vector<int> free_entries;
+
+    // Code that is currently being emitted: either the body of a function's
+    // prototype or the processor's top-level code.
+    std::vector<unsigned char>* code = nullptr;
+
+    // Functions that calls may be inlined to, indexed by their global slot,
+    // and how many inlined calls the code being emitted is nested in.
+    std::map<int, Inlinable> inlinable;
+    int inline_depth = 0;
+
+    void emit_inst(Instruction inst);
+    void emit_int(int i);
+    void patch_int(size_t pos, int i);
+    void bind(size_t scope, uint32_t symbol, Binding binding);
+    Scope pop_scope();
+    void unbind(size_t n);
+    bool resolve(size_t scope, uint32_t symbol, Binding& binding);
+    bool lookup(uint32_t symbol, Binding& binding);
+    Binding lookup_symbol(std::unique_ptr<AST>& ast);
+    unsigned char binary_builtin(std::unique_ptr<AST>& ast);
+    bool constant(std::unique_ptr<AST>& ast, Value& value);
+    bool fold(Instruction inst, Value left, Value right, Value& value);
+    bool pure(std::unique_ptr<AST>& ast);
+
     void emit_push_int(int i);
+    void emit_push_float(double d);
+    void emit_constant(Value value);
+    void emit_push_string(std::string_view chars);
+    void emit_push_binding(Binding binding);
     void emit_push_ref(std::unique_ptr<AST>& ast);
     void emit_push(std::unique_ptr<AST>& ast);
-    void emit_do(std::unique_ptr<AST>& ast);
-    void emit_if(std::unique_ptr<AST>& ast);
+    void emit_do(std::unique_ptr<AST>& ast, bool tail);
+    size_t emit_jmp_false(std::unique_ptr<AST>& condition);
+    void emit_if(std::unique_ptr<AST>& ast, bool tail);
+    void emit_constant_if(std::unique_ptr<AST>& ast, bool taken, bool tail);
     void emit_cond(std::unique_ptr<AST>& ast);
+    void declare_defs(std::unique_ptr<AST>& ast);
+    int declare_def(std::unique_ptr<AST>& left);
     void emit_def(std::unique_ptr<AST>& ast);
-    void emit_fn(std::unique_ptr<AST>& ast);
-    void emit_call(std::unique_ptr<AST>& ast);
-    void emit_expr(std::unique_ptr<AST>& ast);
+    void emit_fn(std::unique_ptr<AST>& ast, const std::string& name,
+                 int self_slot = -1);
+    bool emit_ref_int_op(std::unique_ptr<AST>& ast);
+    void emit_call(std::unique_ptr<AST>& ast, bool tail);
+    void emit_builtin(std::unique_ptr<AST>& ast, const BuiltinEntry& builtin);
+    void emit_logical(std::unique_ptr<AST>& ast, bool is_and);
+    void add_inlinable(std::unique_ptr<AST>& fn, int slot, uint32_t symbol);
+    bool emit_inline(std::unique_ptr<AST>& ast, bool tail);
+    void emit_expr(std::unique_ptr<AST>& ast, bool tail = false);
 
 public:
 
-    Runtime();
+    Runtime(RuntimeOptions options = RuntimeOptions());
+
+    // Compiles and runs a top-level form. When optimizing, the source of the
+    // form has to outlive the runtime, since the bodies of small functions
+    // are kept around to be inlined.
+    Value eval_ast(std::unique_ptr<AST>& ast);
+    int compile_ast(std::unique_ptr<AST>& ast,
+                    std::vector<unsigned char>& out);
+    Value run_toplevel(unsigned char* toplevel, int max_stack);
+
+    // Memory taken up by code on the stack machine.
+    CodeStats code_stats();
+
+    // What the garbage collector of the backend has done so far.
+    GCStats gc_stats();
+
+    // What the stack machine has run so far, or nullptr if it isn't
+    // profiling.
+    const Profile* profile();
 
-    std::shared_ptr<Value> eval_ast(std::unique_ptr<AST>& ast);
+    // Functions that have been inlined, in the order they were defined.
+    std::vector<InlineStats> inline_stats();
 };
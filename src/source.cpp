@@ -0,0 +1,66 @@
+#include "source.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+bool SourceFile::open(const char* path)
+{
+    int fd = ::open(path, O_RDONLY);
+
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    struct stat st;
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        // The mapping is private, so writes to it, like the processor
+        // quickening the code of a .bobac file, only ever change this
+        // process's copy of the pages they touch.
+        void* p = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE, fd, 0);
+
+        if (p != MAP_FAILED)
+        {
+            // The lexer reads the file from front to back once.
+            madvise(p, st.st_size, MADV_SEQUENTIAL);
+
+            mapping = p;
+            mapping_size = st.st_size;
+            contents = std::string_view(static_cast<char*>(p), mapping_size);
+
+            close(fd);
+            return true;
+        }
+    }
+
+    char chunk[1 << 16];
+    ssize_t n;
+
+    while ((n = read(fd, chunk, sizeof(chunk))) > 0)
+    {
+        buffer.append(chunk, n);
+    }
+
+    close(fd);
+
+    if (n < 0)
+    {
+        return false;
+    }
+
+    contents = buffer;
+    return true;
+}
+
+SourceFile::~SourceFile()
+{
+    if (mapping != nullptr)
+    {
+        munmap(mapping, mapping_size);
+    }
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+// The contents of a source file. Regular files are memory-mapped, so nothing
+// is copied and only the pages the lexer actually reaches are read in. Files
+// that can't be mapped, like pipes, are read into a string instead.
+class SourceFile
+{
+
+private:
+    void* mapping = nullptr;
+    size_t mapping_size = 0;
+
+    // Contents of a file that couldn't be mapped.
+    std::string buffer;
+
+    std::string_view contents;
+
+public:
+
+    // Opens the file at path. Returns false, with errno set, if it can't be
+    // opened.
+    bool open(const char* path);
+
+    inline std::string_view text() const
+    {
+        return contents;
+    }
+
+    SourceFile() = default;
+    SourceFile(const SourceFile&) = delete;
+    ~SourceFile();
+};
@@ -0,0 +1,426 @@
+#include "str.h"
+
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "processor.h"
+#include "register_processor.h"
+
+// Stands in for an erased string in StringTable's slots.
+static FlatString* const TOMBSTONE = reinterpret_cast<FlatString*>(1);
+
+#define STRING_TABLE_MIN 64
+
+[[noreturn]] static void string_error(const std::string& message)
+{
+    printf("ERROR: %s\n", message.c_str());
+    exit(-1);
+}
+
+static void expect_string(Value value, const char* builtin)
+{
+    if (value.type() != ValueType::Str)
+    {
+        string_error(std::string(builtin) + " expects a string, but got "
+                     + value.to_string());
+    }
+}
+
+// FNV-1a.
+uint32_t hash_chars(std::string_view chars)
+{
+    uint32_t hash = 2166136261u;
+
+    for (char c : chars)
+    {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+FlatString* StringTable::find(std::string_view chars, uint32_t hash) const
+{
+    if (slots.empty())
+    {
+        return nullptr;
+    }
+
+    size_t mask = slots.size() - 1;
+
+    for (size_t i = hash & mask; slots[i] != nullptr; i = (i + 1) & mask)
+    {
+        FlatString* string = slots[i];
+
+        if (string != TOMBSTONE && string->hash == hash
+            && string->length == chars.size()
+            && std::memcmp(string->chars(), chars.data(), chars.size()) == 0)
+        {
+            return string;
+        }
+    }
+
+    return nullptr;
+}
+
+void StringTable::insert(FlatString* string)
+{
+    // Keep at least a quarter of the slots empty, so that probes stay short.
+    if (4 * (n_used + 1) > 3 * slots.size())
+    {
+        grow();
+    }
+
+    size_t mask = slots.size() - 1;
+    size_t i = string->hash & mask;
+
+    while (slots[i] != nullptr && slots[i] != TOMBSTONE)
+    {
+        i = (i + 1) & mask;
+    }
+
+    if (slots[i] == nullptr)
+    {
+        n_used++;
+    }
+
+    slots[i] = string;
+    n_live++;
+}
+
+void StringTable::erase(FlatString* string)
+{
+    size_t mask = slots.size() - 1;
+    size_t i = string->hash & mask;
+
+    while (slots[i] != string)
+    {
+        i = (i + 1) & mask;
+    }
+
+    slots[i] = TOMBSTONE;
+    n_live--;
+}
+
+// Rehashes the live strings into a table that is at least twice as big as
+// they need, which also clears out the tombstones.
+void StringTable::grow()
+{
+    size_t capacity = STRING_TABLE_MIN;
+
+    while (capacity < 4 * (n_live + 1))
+    {
+        capacity *= 2;
+    }
+
+    std::vector<FlatString*> old(capacity, nullptr);
+    old.swap(slots);
+    n_live = 0;
+    n_used = 0;
+
+    for (FlatString* string : old)
+    {
+        if (string != nullptr && string != TOMBSTONE)
+        {
+            insert(string);
+        }
+    }
+}
+
+static inline size_t length_of(Value s)
+{
+    return s.is_short_string() ? s.short_string_length()
+                               : s.as<String*>()->length;
+}
+
+// Copies the bytes of a string to chars, which has room for all of them.
+// Concatenations are walked with a stack of their own, since a string that
+// was built a piece at a time is as deep as it has pieces.
+static void write_chars(Value s, char* chars)
+{
+    std::vector<Value> pending = { s };
+
+    while (!pending.empty())
+    {
+        Value value = pending.back();
+        pending.pop_back();
+
+        if (value.is_short_string())
+        {
+            value.short_string_chars(chars);
+            chars += value.short_string_length();
+            continue;
+        }
+
+        auto string = value.as<String*>();
+
+        switch (string->kind)
+        {
+        case StringKind::Flat:
+            std::memcpy(chars, static_cast<FlatString*>(string)->chars(),
+                        string->length);
+            chars += string->length;
+            break;
+        case StringKind::Slice:
+            std::memcpy(chars, static_cast<SliceString*>(string)->chars(),
+                        string->length);
+            chars += string->length;
+            break;
+        case StringKind::Concat:
+        {
+            auto concat = static_cast<ConcatString*>(string);
+
+            if (concat->flat != nullptr)
+            {
+                pending.push_back(Value(concat->flat));
+                break;
+            }
+
+            pending.push_back(concat->right);
+            pending.push_back(concat->left);
+            break;
+        }
+        }
+    }
+}
+
+std::string string_chars(Value value)
+{
+    std::string chars(length_of(value), '\0');
+    write_chars(value, chars.data());
+    return chars;
+}
+
+bool strings_equal(Value a, Value b)
+{
+    if (a.type() != ValueType::Str || b.type() != ValueType::Str
+        || length_of(a) != length_of(b))
+    {
+        return false;
+    }
+
+    // Short strings and flat strings that aren't the same value differ.
+    auto shared = [](Value s)
+    {
+        return !s.is_short_string()
+            && s.as<String*>()->kind != StringKind::Flat;
+    };
+
+    return (shared(a) || shared(b)) && string_chars(a) == string_chars(b);
+}
+
+Value string_length(Value s)
+{
+    expect_string(s, "length");
+    return Value(static_cast<int>(length_of(s)));
+}
+
+std::string_view string_bytes(Value s, std::string& storage)
+{
+    auto string = s.as<String*>();
+    FlatString* flat = nullptr;
+
+    switch (string->kind)
+    {
+    case StringKind::Flat:
+        flat = static_cast<FlatString*>(string);
+        break;
+    case StringKind::Slice:
+        return std::string_view(static_cast<SliceString*>(string)->chars(),
+                                string->length);
+    case StringKind::Concat:
+        flat = static_cast<ConcatString*>(string)->flat;
+        break;
+    }
+
+    if (flat != nullptr)
+    {
+        return std::string_view(flat->chars(), flat->length);
+    }
+
+    storage = string_chars(s);
+    return storage;
+}
+
+template <typename Proc>
+Value make_string(Proc& proc, std::string_view chars)
+{
+    if (chars.size() <= Value::SHORT_STRING_MAX)
+    {
+        return Value::short_string(chars.data(), chars.size());
+    }
+
+    uint32_t hash = hash_chars(chars);
+    FlatString* string = proc.strings.find(chars, hash);
+
+    if (string == nullptr)
+    {
+        string = allocate_string<FlatString>(proc, FlatString::size(
+                                                 chars.size()),
+                                             chars.size(), hash);
+        std::memcpy(string->chars(), chars.data(), chars.size());
+        proc.strings.insert(string);
+    }
+
+    return Value(string);
+}
+
+// The flat string a long string's bytes are in, and where in it they start.
+// A concatenation is flattened, once.
+template <typename Proc>
+static FlatString* flatten(Proc& proc, Value s, uint32_t& start)
+{
+    auto string = s.as<String*>();
+    start = 0;
+
+    switch (string->kind)
+    {
+    case StringKind::Flat:
+        return static_cast<FlatString*>(string);
+    case StringKind::Slice:
+        start = static_cast<SliceString*>(string)->start;
+        return static_cast<SliceString*>(string)->source;
+    default:
+        break;
+    }
+
+    auto concat = static_cast<ConcatString*>(string);
+
+    if (concat->flat == nullptr)
+    {
+        Value flat = make_string(proc, string_chars(s));
+        concat->flat = static_cast<FlatString*>(flat.as_object());
+        concat->left = Value();
+        concat->right = Value();
+    }
+
+    return concat->flat;
+}
+
+template <typename Proc>
+Value string_intern(Proc& proc, Value s)
+{
+    if (s.is_short_string() || s.as<String*>()->kind == StringKind::Flat)
+    {
+        return s;
+    }
+
+    uint32_t start;
+    FlatString* source = flatten(proc, s, start);
+
+    if (s.as<String*>()->kind == StringKind::Concat)
+    {
+        return Value(source);
+    }
+
+    return make_string(proc, std::string_view(source->chars() + start,
+                                              s.as<String*>()->length));
+}
+
+template <typename Proc>
+static Value concat2(Proc& proc, Value a, Value b)
+{
+    size_t length = length_of(a) + length_of(b);
+
+    if (length > UINT32_MAX)
+    {
+        string_error("concat makes a string that is too long");
+    }
+
+    if (length_of(b) == 0)
+    {
+        return a;
+    }
+
+    if (length_of(a) == 0)
+    {
+        return b;
+    }
+
+    if (length <= STRING_COPY_MAX)
+    {
+        char chars[STRING_COPY_MAX];
+        write_chars(a, chars);
+        write_chars(b, chars + length_of(a));
+        return make_string(proc, std::string_view(chars, length));
+    }
+
+    return Value(allocate_string<ConcatString>(proc, sizeof(ConcatString),
+                                               length, a, b));
+}
+
+template <typename Proc>
+Value string_concat(Proc& proc, const Value* values, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        expect_string(values[i], "concat");
+    }
+
+    Value result = values[0];
+
+    for (int i = 1; i < n; i++)
+    {
+        result = concat2(proc, result, values[i]);
+    }
+
+    return result;
+}
+
+template <typename Proc>
+Value string_substring(Proc& proc, Value s, Value start, Value end)
+{
+    expect_string(s, "substring");
+
+    size_t length = length_of(s);
+
+    if (!start.is_int() || !end.is_int() || start.as_int() < 0
+        || start.as_int() > end.as_int()
+        || static_cast<size_t>(end.as_int()) > length)
+    {
+        string_error("substring from " + start.to_string() + " to "
+                     + end.to_string() + " is out of bounds for a string of "
+                     + std::to_string(length) + " bytes");
+    }
+
+    uint32_t from = start.as_int();
+    uint32_t n = end.as_int() - start.as_int();
+
+    if (n == length)
+    {
+        return s;
+    }
+
+    if (s.is_short_string())
+    {
+        // As big as the length field of a short string can say, rather than
+        // SHORT_STRING_MAX, which the compiler can't see is its limit.
+        char chars[8];
+        s.short_string_chars(chars);
+        return Value::short_string(chars + from, n);
+    }
+
+    uint32_t offset;
+    FlatString* source = flatten(proc, s, offset);
+
+    if (n <= STRING_COPY_MAX)
+    {
+        return make_string(proc, std::string_view(source->chars() + offset
+                                                  + from, n));
+    }
+
+    return Value(allocate_string<SliceString>(proc, sizeof(SliceString), n,
+                                              source, offset + from));
+}
+
+#define INSTANTIATE_STRING_BUILTINS(Proc)                               \
+    template Value make_string(Proc&, std::string_view);                \
+    template Value string_intern(Proc&, Value);                         \
+    template Value string_concat(Proc&, const Value*, int);             \
+    template Value string_substring(Proc&, Value, Value, Value);
+
+INSTANTIATE_STRING_BUILTINS(Processor)
+INSTANTIATE_STRING_BUILTINS(RegisterProcessor)
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+#include "environment.h"
+
+// Strings. A string is either stored in its value, if it is short enough, or
+// is one of the heap objects in environment.h. Making a string always picks
+// the same representation for the same bytes: a short string in the value if
+// it fits, and otherwise the interned flat string. Strings made that way are
+// equal exactly when their values are, so comparing them costs no more than
+// comparing integers.
+//
+// Concatenations and substrings of long strings are the exception. They are
+// ConcatStrings and SliceStrings, which point at the strings they were made
+// from instead of copying them, so building a string a piece at a time or
+// walking through one never copies the same bytes over and over. Comparing
+// one of them compares bytes.
+
+// Concatenations and substrings up to this long are copied into a string of
+// their own, which is as cheap as pointing at their parts.
+#define STRING_COPY_MAX 64
+
+// The interned flat strings of a processor, in an open-addressing table with
+// linear probing, so that looking up a string goes straight to its hash's
+// slot. The table doesn't keep its strings alive; the processor removes each
+// one before it frees it.
+class StringTable
+{
+public:
+    // The flat string with these bytes and hash, or nullptr if there isn't
+    // one.
+    FlatString* find(std::string_view chars, uint32_t hash) const;
+
+    // Adds a string that isn't in the table yet.
+    void insert(FlatString* string);
+    void erase(FlatString* string);
+
+    size_t size() const
+    {
+        return n_live;
+    }
+
+private:
+    // Empty slots are nullptr. Erased ones hold a tombstone, which lookups
+    // probe past and inserts reuse.
+    std::vector<FlatString*> slots;
+    size_t n_live = 0;
+    size_t n_used = 0;
+
+    void grow();
+};
+
+uint32_t hash_chars(std::string_view chars);
+
+// Whether a and b, which are not the same value, are strings with the same
+// bytes. That can only happen if one of them is a concatenation or a
+// substring.
+bool strings_equal(Value a, Value b);
+
+// (length s) of a string.
+Value string_length(Value s);
+
+// The bytes of a string that isn't short. They are only copied to storage if
+// they aren't in one place already, as a concatenation's aren't until it has
+// been flattened.
+std::string_view string_bytes(Value s, std::string& storage);
+
+// The builtins that make strings allocate them in the processor they get,
+// through its allocate_string(), and intern them in its strings table. They
+// never collect, and are instantiated for both processors.
+
+// The string with the given bytes.
+template <typename Proc>
+Value make_string(Proc& proc, std::string_view chars);
+
+// The string with the same bytes as s that making them would give: s itself,
+// unless it is a concatenation or a substring, which is flattened.
+template <typename Proc>
+Value string_intern(Proc& proc, Value s);
+
+// (concat ...)
+template <typename Proc>
+Value string_concat(Proc& proc, const Value* values, int n);
+
+// (substring s start end) is the bytes of s from start up to, but not
+// including, end.
+template <typename Proc>
+Value string_substring(Proc& proc, Value s, Value start, Value end);
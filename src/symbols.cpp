@@ -0,0 +1,23 @@
+#include "symbols.h"
+
+uint32_t SymbolTable::intern(std::string_view name)
+{
+    auto it = ids.find(name);
+
+    if (it != ids.end())
+    {
+        return it->second;
+    }
+
+    uint32_t id = names.size();
+    names.emplace_back(name);
+    ids.emplace(names.back(), id);
+
+    return id;
+}
+
+SymbolTable& symbols()
+{
+    static SymbolTable table;
+    return table;
+}
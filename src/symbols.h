@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// Symbols that every table starts out with, in this order, so that the
+// compiler can recognize special forms by their IDs.
+enum : uint32_t
+{
+    SYM_EMPTY,
+    SYM_DEF,
+    SYM_DO,
+    SYM_IF,
+    SYM_FN,
+};
+
+// Gives every distinct symbol name a small integer ID. The lexer interns the
+// name of each symbol it reads, so that later stages can compare and hash
+// symbols as integers instead of strings. IDs are handed out in order and stay
+// valid for the rest of the program. ID 0 is the empty name, which is what
+// tokens that aren't symbols have.
+class SymbolTable
+{
+
+private:
+    // A deque never moves its elements, so the views in ids stay valid as
+    // names are added.
+    std::deque<std::string> names;
+    std::unordered_map<std::string_view, uint32_t> ids;
+
+public:
+
+    SymbolTable()
+    {
+        for (auto name : { "", "def", "do", "if", "fn" })
+        {
+            intern(name);
+        }
+    }
+
+    // Returns the ID of name, giving it a new one if it hasn't been seen
+    // before.
+    uint32_t intern(std::string_view name);
+
+    inline const std::string& name(uint32_t id) const
+    {
+        return names[id];
+    }
+
+    inline size_t size() const
+    {
+        return names.size();
+    }
+};
+
+// Table that every symbol in the program is interned in.
+SymbolTable& symbols();
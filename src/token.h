@@ -1,9 +1,9 @@
 #pragma once
 
-#include <string>
-#include <memory>
+#include <cstdint>
+#include <string_view>
 
-enum class TokenType {
+enum class TokenType : uint8_t {
     Punctuation,
     
     // Anything that isn't a literal - can be a function name,
@@ -17,23 +17,23 @@ enum class TokenType {
     BoolLiteral,
 };
 
-
+// A token doesn't hold its text. It only records where in the source the text
+// is, which keeps it small enough that a whole file's tokens fit in one flat
+// array. Line and column numbers are only needed for error messages, so they
+// are worked out from the offset when one is printed.
 struct Token {
 
-    int line_num, col_num;
+    TokenType type;
 
-    // TODO: This is probably not good, but for the sake of
-    // error-handling there needs to be some way of determining the
-    // stream the token originally came from. We obviously don't want
-    // to make a copy of the stream for every token so we'll just take
-    // a pointer to the stream instead. Probably want some other way
-    // of getting the parent stream in the future. Thankfully fixing
-    // this should only be a matter of fixing lexer.cpp, error.cpp,
-    // and this file.
-    std::string* stream;
+    // Position and length of the token's text in the source, in bytes.
+    uint32_t offset;
+    uint32_t length;
 
-    TokenType type;
+    // For symbols, the ID the name is interned under in symbols().
+    uint32_t id;
 
-    // TODO: more types eventually?
-    std::string string_value;
+    inline std::string_view text(std::string_view source) const
+    {
+        return source.substr(offset, length);
+    }
 };
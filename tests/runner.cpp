@@ -4,37 +4,78 @@
 #include <string>
 #include <fstream>
 
+#include "bobac.h"
 #include "lexer.h"
 #include "parser.h"
 #include "runtime.h"
+#include "source.h"
 
 
 class TestRunner {
 
 private:
     Runtime runtime;
-    std::deque<std::shared_ptr<Token>> tokens;
+
+    // Tokens refer to the source they were lexed from, so it is kept here.
+    std::string source;
+    TokenList tokens;
 
 public:
 
-    void tokenize_string(std::string str) {
-        TextHandle handle(str);
-        auto lexed_tokens = tokenize(handle);
-        for (auto token : lexed_tokens) {
-            tokens.push_back(token);
-        }
+    TestRunner(RuntimeOptions options) : runtime(options) {}
+
+    void tokenize_string(const std::string& str) {
+        source = str;
+        TextHandle handle(source);
+        tokens = tokenize(handle);
     }
     
-    std::shared_ptr<Value> eval_expr() {
+    Value eval_expr() {
         auto ast = parse_expr(tokens);
         return runtime.eval_ast(ast);
     }
 };
 
-int main() {
-    TestRunner t;
+// A runtime configuration that every test file is run under.
+struct TestConfig {
+    std::string name;
+    RuntimeOptions options;
+
+    // Whether the file is compiled to a .bobac file first, which is then run
+    // by a fresh runtime.
+    bool compiled = false;
+};
+
+// Compiles source to a .bobac file with one runtime, then runs that file with
+// another, and returns the result of every form.
+std::vector<std::string> run_compiled(const std::string& source,
+                                      const std::string& path,
+                                      const RuntimeOptions& options) {
+    std::vector<std::string> results;
+
+    Runtime compiler(options);
+    if (!write_bobac(compiler, source, path.c_str()))
+        return results;
 
-    std::ifstream test_file("tests/arithmetic.test");
+    SourceFile file;
+    if (!file.open(path.c_str()))
+        return results;
+
+    Runtime runtime(options);
+    run_bobac(runtime, file.text(), [&](Value result) {
+        results.push_back(result.to_string());
+    });
+
+    return results;
+}
+
+// Runs every test in a file under the given configuration. Returns the number
+// of failed tests.
+int run_test_file(const std::string& path, const TestConfig& config,
+                  int& successes) {
+    TestRunner t(config.options);
+
+    std::ifstream test_file(path);
     std::string content = "";
     
     std::vector<std::string> expected_outputs;
@@ -58,14 +99,26 @@ int main() {
     }
 
     assert(expected_outputs.size() == section_names.size());
-    t.tokenize_string(content);
+
+    std::vector<std::string> compiled_results;
+
+    if (config.compiled) {
+        std::string name = path.substr(path.find_last_of('/') + 1);
+        compiled_results = run_compiled(content, "build/" + name + ".bobac",
+                                        config.options);
+        compiled_results.resize(expected_outputs.size(), "<not run>");
+    }
+    else {
+        t.tokenize_string(content);
+    }
     
-    int successes = 0;
     int failures = 0;
     
     for (size_t i = 0; i < expected_outputs.size(); i++) {
-        std::cout << "Running " << section_names[i] << "... ";
-        auto result = t.eval_expr()->to_string();
+        std::cout << "Running " << section_names[i]
+                  << " [" << config.name << "]... ";
+        auto result = config.compiled ? compiled_results[i]
+                                      : t.eval_expr().to_string();
         if (result == expected_outputs[i]) {
             std::cout << "OK\n";
             successes++;
@@ -77,6 +130,45 @@ int main() {
         }
     }
 
+    return failures;
+}
+
+int main() {
+    const std::string test_files[] = {
+        "tests/arithmetic.test",
+        "tests/functions.test",
+        "tests/floats.test",
+        "tests/variadic.test",
+        "tests/arrays.test",
+        "tests/strings.test",
+        "tests/maps.test",
+    };
+
+    std::vector<TestConfig> configs(7);
+    configs[0].name = "default";
+    configs[1].name = "table";
+    configs[1].options.dispatch = Dispatch::Table;
+    configs[1].options.superinstructions = false;
+    configs[2].name = "register";
+    configs[2].options.backend = Backend::Register;
+    configs[3].name = "region";
+    configs[3].options.region_heap = true;
+    configs[4].name = "bobac";
+    configs[4].compiled = true;
+    configs[5].name = "optimized";
+    configs[5].options.optimize = 1;
+    configs[6].name = "profiled";
+    configs[6].options.profile = true;
+
+    int successes = 0;
+    int failures = 0;
+
+    for (const auto& path : test_files) {
+        for (const auto& config : configs) {
+            failures += run_test_file(path, config, successes);
+        }
+    }
+
     printf("===================================================\n");
     printf("Test run complete: Successes: %d, failures: %d, "
            "total: %d\n", successes, failures, successes + failures);